@@ -13,8 +13,15 @@ void loop(){}
 #include "USB.h"
 #include "USBMSC.h"
 #include "ssh_exec.h"
+#include "session.h"
 #include "ipc.h"
 #include "cache.h"
+#include "writeback.h"
+#include "prefetch.h"
+#include "flashcache.h"
+#include "fatpin.h"
+#include "trace.h"
+#include "perf.h"
 #include "esp32-hal-psram.h"
 
 #if ARDUINO_USB_CDC_ON_BOOT
@@ -25,13 +32,12 @@ void loop(){}
 USBCDC USBSerial;
 #endif
 
-USBMSC MSC;
-struct ipc_msg msg;
-//int ipc_num = 0;
-
 // Set local disk sector configuration below.
 #include "wifimsc_disk_config.h"
 
+// One logical unit per storage profile.
+USBMSC MSC[DISK_LUNS];
+
 #if defined CONFIG_IDF_TARGET_ESP32S2
 short ledPins[] = { 15, 16, 17, 18, 21, 33, 34 };
 #elif defined CONFIG_IDF_TARGET_ESP32S3
@@ -41,7 +47,53 @@ short ledPins[] = { 47, 15, 16, 17, 18, 21, 43 };
 #error Please configure LED pin array
 #endif
 
-static int32_t onWrite(uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize){
+// Move bufsize bytes between buffer and the remote host of a LUN, keeping
+// up to IPC_SLOTS requests queued at its SSH task.  Each request is lent its
+// part of the USB buffer, up to ipc_xfer_size() bytes, so the SSH task reads
+// and writes it in place.  Sectors
+// flagged in skip, if given, are left alone and split the transfer into
+// separate requests.  Returns -1 if the remote host failed any of them.
+static int remote_io(uint8_t lun, enum host_cmds cmd, uint32_t lba,
+  uint8_t* buffer, uint32_t bufsize, const bool* skip)
+{
+  struct ipc_msg *pending[IPC_SLOTS], *msg;
+  int head = 0, inflight = 0, rc = 0;
+  uint32_t n, l = 0, sectors = bufsize / DISK_SECTOR_SIZE;
+  while (l < sectors || inflight)
+  {
+    while (skip && l < sectors && skip[l]) l++;
+    if (l < sectors && (msg = ipc_alloc(lun, inflight ? 0 : portMAX_DELAY)))
+    {
+      for (n = 1; l + n < sectors && !(skip && skip[l + n]) &&
+        (n + 1) * DISK_SECTOR_SIZE <= ipc_xfer_size(lun); n++);
+      msg->host_cmd = cmd;
+      msg->secsz = DISK_SECTOR_SIZE;
+      msg->lba = lba + l;
+      msg->dlen = n * DISK_SECTOR_SIZE;
+      msg->data = buffer + l * DISK_SECTOR_SIZE;
+      //HWSerial.printf("%%IPC MSC Signalling SSH id=%u\r\n", msg->id);
+      ipc_submit(msg);
+      pending[(head + inflight++) % IPC_SLOTS] = msg;
+      l += n;
+      continue;
+    }
+    if (!inflight) continue;
+
+    // Retire the oldest request.
+    msg = pending[head];
+    head = (head + 1) % IPC_SLOTS;
+    inflight--;
+    //HWSerial.printf("%%IPC MSC Wait for SSH id=%u\r\n", msg->id);
+    ipc_wait(msg);
+    //HWSerial.printf("%%IPC MSC id=%u bytes=%u copied=%u\r\n", msg->id,
+    //  msg->dlen, msg->copied);
+    if (msg->status) rc = -1;
+    ipc_free(msg);
+  }
+  return rc;
+}
+
+static int32_t onWrite(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize){
   digitalWrite(ledPins[4], HIGH);
   //HWSerial.printf("%%MSC-WRITE lba=%u offset=%u bufsize=%u\r\n", lba, offset, bufsize);
   assert(!offset);
@@ -52,33 +104,36 @@ static int32_t onWrite(uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t
   //  heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT),
   //  xPortGetMinimumEverFreeHeapSize(), ESP.getFreePsram());
 
-  size_t b, r, total = 0; 
-  while (total < bufsize)
+  uint32_t start = micros(), remote = 0;
+  int32_t rc = bufsize;
+  fat_pin_observe(lun, lba, bufsize/DISK_SECTOR_SIZE);
+  // The host is told of a failed write, and the cache keeps what it had.
+  if (writeback_enabled())
   {
-    if (bufsize - total > sizeof msg.data) b = sizeof msg.data;
-    else b = bufsize - total;
-    msg.host_cmd = USB_WRITE;
-    msg.secsz = DISK_SECTOR_SIZE;
-    msg.lba = lba;
-    msg.dlen = b;
-    memcpy(msg.data, buffer + total, b);
-    //HWSerial.printf("%%IPC MSC Signalling SSH\r\n");
-    xMessageBufferSend(usb_to_ssh, &msg, sizeof msg, portMAX_DELAY);
-    //HWSerial.printf("%%IPC MSC Wait for SSH signal start %d\r\n", ipc_num);
-    r = xMessageBufferReceive(ssh_to_usb, &msg, sizeof msg, portMAX_DELAY);
-    //HWSerial.printf("%%IPC MSC Wait for SSH signal finish %d, sz=%d\r\n", ipc_num++, r); ipc_num++;
-
-    total += b;
+    if (wb_write(lun, lba, buffer, bufsize)) rc = -1;
   }
+  else if (remote_io(lun, USB_WRITE, lba, buffer, bufsize, NULL))
+  {
+    remote = micros() - start;
+    rc = -1;
+  }
+  else
+  {
+    remote = micros() - start;
 
-  for (int l = bufsize/DISK_SECTOR_SIZE - 1; l >= 0; l--)
-    put_cache_block(lba + l, buffer + DISK_SECTOR_SIZE * l);
+    for (int l = bufsize/DISK_SECTOR_SIZE - 1; l >= 0; l--)
+      put_cache_block(lun, lba + l, buffer + DISK_SECTOR_SIZE * l);
+  }
+  trace_add(lun, TRACE_WRITE, lba, bufsize/DISK_SECTOR_SIZE,
+    writeback_enabled() ? TRACE_F_WB : TRACE_F_MISS, start, remote);
+  perf_usb_write_bytes += bufsize;
+  perf_add(PERF_USB_WRITE, start);
 
   digitalWrite(ledPins[4], LOW);
-  return bufsize;
+  return rc;
 }
 
-static int32_t onRead(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize){
+static int32_t onRead(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize){
   digitalWrite(ledPins[4], HIGH);
   //HWSerial.printf("%%MSC-READ lba=%u offset=%u bufsize=%u\r\n", lba, offset, bufsize);
   assert(!offset);
@@ -89,47 +144,66 @@ static int32_t onRead(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufs
   //  heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT),
   //  xPortGetMinimumEverFreeHeapSize(), ESP.getFreePsram());
 
-  bool allCached = true; void *data = NULL;
-  for (int l = 0; l < bufsize/DISK_SECTOR_SIZE; l++)
-  {
-    data = get_cache_block(lba + l);
-    if (!data) allCached = false;
-    else memcpy(buffer + l * DISK_SECTOR_SIZE, data, DISK_SECTOR_SIZE);
-  }
+  uint32_t start = micros(), remote = 0;
+  int32_t rc = bufsize;
+  prefetch_observe(lun, lba, bufsize/DISK_SECTOR_SIZE);
 
-  size_t b, r, total = 0; 
-  while (total < bufsize)
-  {
-    if (bufsize - total > sizeof msg.data) b = sizeof msg.data;
-    else b = bufsize - total;
+  int sectors = bufsize/DISK_SECTOR_SIZE, misses = 0;
+  bool cached[sectors];
+  uint32_t lookup = perf_now();
+  for (int l = 0; l < sectors; l++)
+    if (!(cached[l] = read_cache_block(lun, lba + l,
+      (uint8_t*)buffer + l * DISK_SECTOR_SIZE)))
+      misses++;
+  perf_add(PERF_CACHE, lookup);
 
-    if (!allCached)
-    {
-      msg.host_cmd = USB_READ;
-      msg.secsz = DISK_SECTOR_SIZE;
-      msg.lba = lba;
-      msg.dlen = b;
-      //HWSerial.printf("%%IPC MSC Signalling SSH\r\n");
-      xMessageBufferSend(usb_to_ssh, &msg, sizeof msg, portMAX_DELAY);
-      //HWSerial.printf("%%IPC MSC Wait for SSH signal start %d\r\n", ipc_num);
-      r = xMessageBufferReceive(ssh_to_usb, &msg, sizeof msg, portMAX_DELAY);
-      //HWSerial.printf("%%IPC MSC Wait for SSH signal finish %d, sz=%d\r\n", ipc_num++, r); ipc_num++;
-      memcpy(buffer + total, msg.data, b);
-    }
-    total += b;
+  // Fetch just the runs of sectors that were missing.
+  if (misses)
+  {
+    uint32_t fetch = micros();
+    if (remote_io(lun, USB_READ, lba, (uint8_t*)buffer, bufsize, cached))
+      rc = -1;
+    remote = micros() - fetch;
+    for (int l = sectors - 1; rc > 0 && l >= 0; l--)
+      if (!cached[l])
+        put_cache_block(lun, lba + l,
+          (uint8_t*)buffer + DISK_SECTOR_SIZE * l);
   }
-
-  if (!allCached)
-    for (int l = bufsize/DISK_SECTOR_SIZE - 1; l >= 0; l--)
-      if (!get_cache_block(lba + l))
-        put_cache_block(lba + l, buffer + DISK_SECTOR_SIZE * l);
+  trace_add(lun, TRACE_READ, lba, sectors,
+    (misses < sectors ? TRACE_F_HIT : 0) | (misses ? TRACE_F_MISS : 0),
+    start, remote);
+  perf_usb_read_bytes += bufsize;
+  perf_add(PERF_USB_READ, start);
 
   digitalWrite(ledPins[4], LOW);
-  return bufsize;
+  return rc;
 }
 
+// USBMSC does not say which LUN a callback is for, so each LUN is given
+// its own, passing its number on.
+#define MSC_CALLBACKS(lun) \
+  static int32_t onRead##lun(uint32_t lba, uint32_t offset, void* buffer, \
+    uint32_t bufsize) { return onRead(lun, lba, offset, buffer, bufsize); } \
+  static int32_t onWrite##lun(uint32_t lba, uint32_t offset, \
+    uint8_t* buffer, uint32_t bufsize) \
+    { return onWrite(lun, lba, offset, buffer, bufsize); }
+MSC_CALLBACKS(0)
+MSC_CALLBACKS(1)
+MSC_CALLBACKS(2)
+static const msc_read_cb onReadLun[] = { onRead0, onRead1, onRead2 };
+static const msc_write_cb onWriteLun[] = { onWrite0, onWrite1, onWrite2 };
+static_assert(DISK_LUNS <= sizeof onReadLun / sizeof onReadLun[0] &&
+  DISK_LUNS <= sizeof onWriteLun / sizeof onWriteLun[0],
+  "Add MSC_CALLBACKS for every configured LUN");
+static_assert(IPC_LUNS <= sizeof onReadLun / sizeof onReadLun[0] &&
+  IPC_LUNS <= sizeof onWriteLun / sizeof onWriteLun[0],
+  "Add MSC_CALLBACKS for every LUN IPC allows");
+
+// Ejecting any LUN flushes every one, since the host may be about to power
+// the device off.
 static bool onStartStop(uint8_t power_condition, bool start, bool load_eject){
   HWSerial.printf("%%MSC-START/STOP power=%u start=%u eject=%u\r\n", power_condition, start, load_eject);
+  if (load_eject && !start) wb_flush();
   return true;
 }
 
@@ -159,30 +233,60 @@ static void usbEventCallback(void* arg, esp_event_base_t event_base, int32_t eve
   }
 }
 
-void init_comms_and_sync(void)
+// Start the SSH tasks, which bring up WiFi and the sessions in the
+// background.
+void init_comms(void)
 {
-  init_ipc();
-
-  ssh_exec_setup();
-  //HWSerial.printf("%%IPC MSC Wait for SSH signal start %d\r\n", ipc_num);
-  char dummy;
-  xMessageBufferReceive(ssh_to_usb, &dummy, 1, portMAX_DELAY);
-  //HWSerial.printf("%%IPC MSC Wait for SSH signal finish %d\r\n", ipc_num++); ipc_num++;
+  init_ipc(DISK_LUNS);
+  ssh_exec_setup(DISK_LUNS);
+}
 
+// Ask the SSH task of a LUN, once ready, to create the backing file if
+// missing.  Requests are served in order, so later ones may be queued behind
+// this one before it is waited for and freed.
+struct ipc_msg* sync_backing_file(uint8_t lun)
+{
   // Create backing file.
-  msg.host_cmd = CREATE_BACKING_FILE;
-  msg.lba = DISK_SECTOR_COUNT;
-  msg.secsz = DISK_SECTOR_SIZE;
-  //HWSerial.printf("%%IPC MSC Signalling SSH\r\n");
-  xMessageBufferSend(usb_to_ssh, &msg, sizeof msg, portMAX_DELAY);
-  //HWSerial.printf("%%IPC MSC Wait for SSH signal start %d\r\n", ipc_num);
-  xMessageBufferReceive(ssh_to_usb, &msg, sizeof msg, portMAX_DELAY);
-  //HWSerial.printf("%%IPC MSC Wait for SSH signal finish %d\r\n", ipc_num++); ipc_num++;
+  struct ipc_msg *msg = ipc_alloc(lun, portMAX_DELAY);
+  msg->host_cmd = CREATE_BACKING_FILE;
+  msg->lba = DISK_SECTOR_COUNT[lun];
+  msg->secsz = DISK_SECTOR_SIZE;
+  msg->dlen = 0;
+  //HWSerial.printf("%%IPC MSC Signalling SSH id=%u\r\n", msg->id);
+  ipc_submit(msg);
+  return msg;
+}
+
+static uint32_t cached_sectors = 0;
+
+// Bring a LUN's medium in once its remote host is ready.  Each LUN is
+// checked on its own from loop(), so one whose remote host cannot be reached
+// holds up neither the others nor the diagnostics.  Returns true once in.
+static bool bring_up(uint8_t lun)
+{
+  static bool up[DISK_LUNS];
+  if (up[lun]) return true;
+  if (!ipc_wait_ready(lun, 0)) return false;
+
+  struct ipc_msg *sync = sync_backing_file(lun);
+  // Pin filesystem metadata, leaving most of the cache for data.
+  init_fat_pinning(lun, DISK_SECTOR_SIZE,
+    min(DISK_PIN_METADATA, cached_sectors / 4 / DISK_LUNS));
+  // Warm the cache from flash before the host first mounts the disk.
+  init_flash_cache(lun, DISK_SECTOR_SIZE,
+    min(DISK_FLASH_CACHE, cached_sectors));
+  ipc_wait(sync);
+  if (sync->status)
+    HWSerial.printf("%%SSH Backing file not created lun=%u\r\n", lun);
+  ipc_free(sync);
+  MSC[lun].mediaPresent(true);
+  perf_boot("media");
+  return up[lun] = true;
 }
 
 void setup()
 {
-  for (short pin = 0; pin < sizeof ledPins / sizeof ledPins[0]; pin++)
+  for (unsigned pin = 0; pin < sizeof ledPins / sizeof ledPins[0]; pin++)
   {
     digitalWrite(ledPins[pin], HIGH);
     pinMode(ledPins[pin], OUTPUT);
@@ -192,34 +296,103 @@ void setup()
   HWSerial.setDebugOutput(true);
 
   if (psramInit()) HWSerial.println("%CFG PSRAM found and enabled");
-  init_comms_and_sync();
-  uint16_t cached_sectors = init_cache(DISK_SECTOR_SIZE, DISK_SECTOR_COUNT);
+  init_perf();
+  perf_boot("start");
+
+  // Enumerate straight away, with no medium in the drive as a card reader
+  // would have, so the host is not kept waiting while the network comes up.
+  USB.onEvent(usbEventCallback);
+  uint32_t disk_sectors = 0;
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+  {
+    MSC[lun].vendorID("Ewan.CC");//max 8 chars
+    MSC[lun].productID("WiFi.MSC");//max 16 chars
+    MSC[lun].productRevision("000C");//max 4 chars
+    MSC[lun].onStartStop(onStartStop);
+    MSC[lun].onRead(onReadLun[lun]);
+    MSC[lun].onWrite(onWriteLun[lun]);
+    MSC[lun].mediaPresent(false);
+    MSC[lun].begin(DISK_SECTOR_COUNT[lun], DISK_SECTOR_SIZE);
+    disk_sectors += min(DISK_SECTOR_COUNT[lun], UINT32_MAX - disk_sectors);
+  }
+  USBSerial.begin();
+  USB.begin();
+  perf_boot("usb");
+
+  // Set up the cache while WiFi associates.
+  init_comms();
+  // Before the cache takes what PSRAM is left.
+  init_trace(DISK_TRACE_RECORDS);
+  cached_sectors = init_cache(DISK_SECTOR_SIZE, disk_sectors, DISK_LUNS);
   if (cached_sectors)
-    HWSerial.printf("%%MEM-CACHE sectors=%u bytes=%u\r\n", cached_sectors,
-      cached_sectors * DISK_SECTOR_SIZE);
+    HWSerial.printf("%%MEM-CACHE sectors=%u bytes=%u luns=%u\r\n",
+      cached_sectors, cached_sectors * DISK_SECTOR_SIZE, DISK_LUNS);
+  init_prefetch(DISK_SECTOR_SIZE, DISK_SECTOR_COUNT, DISK_LUNS,
+    cached_sectors);
+  // Keep at least half of the cache for clean sectors.
+  init_writeback(DISK_SECTOR_SIZE, min(DISK_WRITE_BACK, cached_sectors / 2),
+    DISK_LUNS);
+  if (writeback_enabled())
+    HWSerial.printf("%%CFG Write-back cache enabled\r\n");
+  perf_boot("cache");
   HWSerial.printf(
     "%%MEM fheap=%u lrg=%u lwm=%u fps=%u\r\n", xPortGetFreeHeapSize(),
     heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT),
     xPortGetMinimumEverFreeHeapSize(), ESP.getFreePsram());
-
-  USB.onEvent(usbEventCallback);
-  MSC.vendorID("Ewan.CC");//max 8 chars
-  MSC.productID("WiFi.MSC");//max 16 chars
-  MSC.productRevision("000C");//max 4 chars
-  MSC.onStartStop(onStartStop);
-  MSC.onRead(onRead);
-  MSC.onWrite(onWrite);
-  MSC.mediaPresent(true);
-  MSC.begin(DISK_SECTOR_COUNT, DISK_SECTOR_SIZE);
-  USBSerial.begin();
-  USB.begin();
   digitalWrite(ledPins[2], LOW);
 }
 
 void loop()
 {
-  // Nothing to do here since controlTask has taken over.
-  vTaskDelay(60000 / portTICK_PERIOD_MS);
+  // Nothing much to do here since controlTask has taken over, apart from
+  // bringing in media, diagnostics and a few commands typed on the serial
+  // console.
+  static uint32_t last_moved = 0, last_report = 0;
+  bool all_up = true;
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+    if (!bring_up(lun)) all_up = false;
+
+  while (HWSerial.available())
+    switch (HWSerial.read())
+    {
+      case 't':
+        trace_dump();
+        break;
+      case 'p':
+        perf_dump();
+        break;
+    }
+
+  if (millis() - last_report >= 60000 && ipc_bytes_moved != last_moved)
+  {
+    last_report = millis();
+    last_moved = ipc_bytes_moved;
+    HWSerial.printf("%%IPC reqs=%u bytes=%u copied=%u\r\n", ipc_requests,
+      ipc_bytes_moved, ipc_bytes_copied);
+    HWSerial.printf(
+      "%%MEM-CACHE hits=%u misses=%u pf-hits=%u pf-wasted-bytes=%u "
+      "pinned=%u\r\n", cache_hits, cache_misses, cache_prefetch_hits,
+      cache_prefetch_wasted * DISK_SECTOR_SIZE, pinned_cache_blocks);
+    for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+    {
+      HWSerial.printf("%%SSH lun=%u payload=%u wire=%u crc-errors=%u\r\n",
+        lun, blk_payload_bytes[lun], blk_wire_bytes[lun], blk_crc_errors[lun]);
+      HWSerial.printf("%%MEM-XFER lun=%u size=%u srtt-ms=%u rate=%u\r\n",
+        lun, ipc_xfer_size(lun), ipc_srtt_ms[lun], ipc_rate[lun]);
+      if (cache_luns)
+        HWSerial.printf("%%MEM-CACHE-LUN lun=%u sectors=%u share=%u "
+          "hits=%u misses=%u pf-window=%u\r\n", lun,
+          cache_luns[lun].blocks, cache_luns[lun].share, cache_luns[lun].hits,
+          cache_luns[lun].misses, prefetch_window(lun));
+    }
+    perf_report();
+    flash_cache_save();
+    HWSerial.printf("%%FLASH-CACHE restored=%u stale=%u saved=%u\r\n",
+      flash_cache_restored, flash_cache_stale, flash_cache_saved);
+  }
+  fat_pin_poll();
+  // Look for remote hosts becoming ready more often.
+  vTaskDelay((all_up ? 1000 : 100) / portTICK_PERIOD_MS);
 }
 
 #endif /* ARDUINO_USB_MODE */
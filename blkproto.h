@@ -0,0 +1,101 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Framed block protocol spoken with the remote block server.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// This header is shared by the firmware and the host-side block server
+// (see host/blockd.cpp) so it must not depend on Arduino or FreeRTOS.
+// All fields are little-endian, which is native on both the ESP32 and
+// the usual x86/ARM servers.
+
+#ifndef BLKPROTO_H
+#define BLKPROTO_H
+
+#include <stdint.h>
+
+// "WMSC" sent by the server as soon as it has opened the backing file.
+#define BLK_MAGIC 0x43534d57
+#define BLK_VERSION 1
+
+// BLK_DISCARD zeroes count sectors without sending them, punching a hole in
+// the backing file where it can.  BLK_CSUM returns the CRC-32C of each of
+// count sectors (see crc32c.h) as count uint32_t values instead of the data.
+enum blk_ops { BLK_READ = 1, BLK_WRITE = 2, BLK_DISCARD = 3, BLK_CSUM = 4 };
+
+// BLK_ECRC refuses a write whose data did not match its checksum, leaving
+// the backing file untouched so that the write can be sent again.
+enum blk_status { BLK_OK = 0, BLK_EIO = 1, BLK_EINVAL = 2, BLK_ECRC = 3 };
+
+// Server features advertised in blk_hello.
+#define BLK_FEAT_LZ 0x0001
+#define BLK_FEAT_ZERO 0x0002
+#define BLK_FEAT_CSUM 0x0004
+#define BLK_FEAT_CRC 0x0008
+
+// Request and response flags.  With BLK_F_LZ or BLK_F_ZERO on a request the
+// payload of a write, or of the response to a read, is sent as a series of
+// chunks, each a blk_chunk header followed by the chunk's encoded bytes.
+// Each chunk decodes to BLK_CHUNK_SIZE bytes, except the last which may be
+// shorter.  BLK_F_LZ allows compressed chunks and BLK_F_ZERO allows chunks
+// of zeros sent with no bytes at all.
+#define BLK_F_LZ 0x01
+#define BLK_F_ZERO 0x02
+#define BLK_CHUNK_SIZE 4096
+// With BLK_F_CRC on a read or write request, the payload, however it is
+// sent, is followed by the CRC-32C of its count * secsz decoded bytes (see
+// crc32c.h) as a uint32_t.  The response to a read then has BLK_F_CRC set
+// too, and the trailing checksum is not counted in its dlen.
+#define BLK_F_CRC 0x04
+
+enum blk_chunk_types
+{
+  BLK_CHUNK_RAW = 0, BLK_CHUNK_LZ = 1, BLK_CHUNK_ZERO = 2
+};
+
+struct blk_chunk
+{
+  uint16_t len;         // Encoded bytes following.
+  uint8_t type;
+  uint8_t reserved;
+} __attribute__((packed));
+
+struct blk_hello
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t features;
+  uint64_t size;        // Backing file size in bytes.
+} __attribute__((packed));
+
+// Request header, followed by count * secsz bytes of payload for BLK_WRITE,
+// or by chunks if BLK_F_LZ or BLK_F_ZERO is set.
+struct blk_req
+{
+  uint8_t op;
+  uint8_t flags;
+  uint16_t secsz;
+  uint32_t count;       // Sectors.
+  uint64_t lba;
+} __attribute__((packed));
+
+// Response header, followed by dlen bytes of payload for BLK_READ, which are
+// chunks if BLK_F_LZ or BLK_F_ZERO is set, or for BLK_CSUM.
+struct blk_rsp
+{
+  uint8_t op;
+  uint8_t status;
+  uint16_t flags;
+  uint32_t dlen;
+} __attribute__((packed));
+
+// True if len bytes are all zero, as sent in a BLK_CHUNK_ZERO chunk.
+static inline bool blk_is_zero(const uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+    if (data[i]) return false;
+  return true;
+}
+
+#endif /* BLKPROTO_H */
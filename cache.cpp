@@ -14,136 +14,685 @@
 #define HWSerial Serial
 #endif
 
-uint16_t blocks = 0;
-struct cache_list list;
-void *block_list = 0;
+uint32_t blocks = 0;
+uint32_t dirty_blocks = 0;
+SemaphoreHandle_t cache_lock;
+uint32_t cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+uint32_t cache_prefetch_hits = 0, cache_prefetch_wasted = 0;
+struct cache_lun *cache_luns = 0;
+
+// The queues of one LUN: Am, A1in and pinned blocks.  Demand counts hits
+// and ghost hits since shares were last worked out.
+struct cache_part
+{
+  struct cache_list am, a1in, pinned;
+  uint32_t a1in_blocks, a1in_max;
+  uint32_t demand;
+};
+struct cache_part *parts = 0;
+uint8_t _luns = 0;
+// Entries not yet used.
+struct cache_list unused;
+uint32_t pinned_cache_blocks = 0;
+struct cache_chain *entries = 0;
+uint8_t *block_list = 0;
 uint16_t _block_size = 0;
+// New entries taken since shares were last worked out, and how many to take
+// before working them out again.
+uint32_t share_fills = 0, share_period = 0;
+
+// Open-addressed hash indexes from LUN and block number to cache entry, and
+// to ghost, using linear probing.  Each slot holds an index plus one, with
+// zero meaning empty.
+struct block_index
+{
+  uint32_t *slots;
+  uint8_t bits;
+  uint32_t mask;
+  uint64_t (*key)(uint32_t ix);
+};
+
+static inline uint64_t _key(uint8_t lun, uint32_t block)
+{
+  return (uint64_t)lun << 32 | block;
+}
+
+// A1out, a FIFO of the keys of the entries last dropped from A1in.  Ghosts
+// taken out of the middle are left as GHOST_NONE.
+#define GHOST_NONE UINT64_MAX
+uint64_t *ghosts = 0;
+uint32_t ghost_max = 0, ghost_head = 0, ghost_count = 0;
+
+static uint64_t _entry_key(uint32_t ix)
+{
+  return _key(entries[ix].data.lun, entries[ix].data.block);
+}
+
+static uint64_t _ghost_key(uint32_t ix)
+{
+  return ghosts[ix];
+}
+
+struct block_index hash = { 0, 0, 0, _entry_key };
+struct block_index ghost_hash = { 0, 0, 0, _ghost_key };
+
+static inline uint32_t _hash(const struct block_index *index, uint64_t key)
+{
+  return ((uint32_t)key * 0x9E3779B1u ^ (uint32_t)(key >> 32) * 0x85EBCA77u)
+    >> (32 - index->bits);
+}
+
+// Size an index at most half full.
+static void index_alloc(struct block_index *index, uint32_t items)
+{
+  for (index->bits = 1; (1UL << index->bits) < 2UL * items; index->bits++);
+  index->mask = (1UL << index->bits) - 1;
+  index->slots = (uint32_t*)malloc(sizeof *index->slots << index->bits);
+  bzero(index->slots, sizeof *index->slots << index->bits);
+}
+
+// Returns the index of key plus one, or zero if absent.
+static uint32_t index_find(const struct block_index *index, uint64_t key)
+{
+  for (uint32_t s = _hash(index, key); index->slots[s];
+    s = (s + 1) & index->mask)
+    if (index->key(index->slots[s] - 1) == key) return index->slots[s];
+  return 0;
+}
+
+static void index_insert(struct block_index *index, uint32_t ix)
+{
+  uint32_t s = _hash(index, index->key(ix));
+  while (index->slots[s]) s = (s + 1) & index->mask;
+  index->slots[s] = ix + 1;
+}
+
+static void index_remove(struct block_index *index, uint32_t ix)
+{
+  uint32_t s = _hash(index, index->key(ix));
+  while (index->slots[s] != ix + 1) s = (s + 1) & index->mask;
+
+  // Shift back any later entries in the probe run so that no tombstones are
+  // needed and lookups stay short.
+  uint32_t gap = s;
+  for (s = (s + 1) & index->mask; index->slots[s]; s = (s + 1) & index->mask)
+  {
+    uint32_t home = _hash(index, index->key(index->slots[s] - 1));
+    if (((s - home) & index->mask) >= ((s - gap) & index->mask))
+    {
+      index->slots[gap] = index->slots[s];
+      gap = s;
+    }
+  }
+  index->slots[gap] = 0;
+}
+
+static struct cache_chain *hash_find(uint8_t lun, uint32_t block)
+{
+  uint32_t ix = index_find(&hash, _key(lun, block));
+  return ix ? entries + ix - 1 : NULL;
+}
+
+static void hash_insert(struct cache_chain *ent)
+{
+  index_insert(&hash, ent->data.block_ix);
+}
+
+static void hash_remove(struct cache_chain *ent)
+{
+  index_remove(&hash, ent->data.block_ix);
+}
 
-void _dump_cache_chain()
+static void ghost_add(uint64_t key)
 {
-  struct cache_chain * ent = list.next;
-  HWSerial.printf("&HEAD=%u\r\n", ent);
+  if (!ghost_max) return;
+  if (ghost_count == ghost_max)
+  {
+    if (ghosts[ghost_head] != GHOST_NONE) index_remove(&ghost_hash, ghost_head);
+    ghost_head = (ghost_head + 1) % ghost_max;
+    ghost_count--;
+  }
+  uint32_t ix = (ghost_head + ghost_count++) % ghost_max;
+  ghosts[ix] = key;
+  index_insert(&ghost_hash, ix);
+}
+
+// Forget a ghost, returning true if there was one for key.
+static bool ghost_take(uint64_t key)
+{
+  if (!ghost_max) return false;
+  uint32_t ix = index_find(&ghost_hash, key);
+  if (!ix) return false;
+  index_remove(&ghost_hash, ix - 1);
+  ghosts[ix - 1] = GHOST_NONE;
+  return true;
+}
+
+void _dump_cache_chain(uint8_t lun)
+{
+  struct cache_list *list = &parts[lun].am;
+  struct cache_chain * ent = list->next;
+  HWSerial.printf("&HEAD=%p\r\n", ent);
   while (ent)
   {
-    HWSerial.printf("  &ENT=%u\r\n", ent);
-    HWSerial.printf("    CHAIN prev=%u next=%u\r\n", ent->chain.prev,
+    HWSerial.printf("  &ENT=%p\r\n", ent);
+    HWSerial.printf("    CHAIN prev=%p next=%p\r\n", ent->chain.prev,
       ent->chain.next);
     HWSerial.printf("    DATA: used=%u blk#=%u ix=%u\r\n", ent->data.in_use,
       ent->data.block, ent->data.block_ix);
     ent = ent->chain.next;
   }
-  HWSerial.printf("&TAIL=%u\r\n", list.prev);
+  HWSerial.printf("&TAIL=%p\r\n", list->prev);
 }
 
-void allocate_cache(uint16_t block_size, uint16_t blocks)
+void allocate_cache(uint16_t block_size, uint32_t blocks)
 {
   // Allocate memory.
   int entsz = sizeof (struct cache_chain);
-  int list_bytes = entsz * blocks;
-  list.next = (struct cache_chain*)malloc(list_bytes);
-  list.prev = list.next + blocks - 1;
-  bzero(list.next, list_bytes);
-  block_list = malloc(block_size * blocks);
-  bzero(block_list, block_size * blocks);
+  size_t list_bytes = (size_t)entsz * blocks;
+  entries = (struct cache_chain*)malloc(list_bytes);
+  unused.next = entries;
+  unused.prev = unused.next + blocks - 1;
+  bzero(unused.next, list_bytes);
+  block_list = (uint8_t*)malloc((size_t)block_size * blocks);
+  bzero(block_list, (size_t)block_size * blocks);
+
+  index_alloc(&hash, blocks);
+
+  // A1out remembers half as many blocks again as the cache holds, as
+  // suggested for 2Q.
+  ghost_max = blocks / 2;
+  if (ghost_max)
+  {
+    ghosts = (uint64_t*)malloc(ghost_max * sizeof *ghosts);
+    index_alloc(&ghost_hash, ghost_max);
+  }
 
   // Link memory.
-  void *tmp = list.next;
+  uint8_t *tmp = (uint8_t*)unused.next;
   struct cache_chain *ent = NULL;
-  for (uint16_t b = 0; b < blocks; b++)
+  for (uint32_t b = 0; b < blocks; b++)
   {
     ent = (struct cache_chain *)tmp;
     if (b) ent->chain.prev = (struct cache_chain *)(tmp - entsz);
     if (b != blocks - 1) ent->chain.next = (struct cache_chain *)(tmp + entsz);
+    ent->data.queue = CACHE_UNUSED;
     ent->data.block_ix = b;
     tmp += entsz;
   }
-  //_dump_cache_chain();
+  //_dump_cache_chain(0);
+}
+
+// Share out the entries not pinned between the LUNs in proportion to their
+// demand, after a small part split evenly so that an idle LUN keeps some.
+// Demand is then halved, so that it reflects recent use.  A1in may take a
+// quarter of each share, as suggested for 2Q.
+static void _share_out(void)
+{
+  uint32_t spare = blocks - pinned_cache_blocks;
+  uint32_t even = _luns > 1 ? spare / (8 * _luns) : 0;
+  uint32_t rest = spare - even * _luns;
+  uint64_t total = 0;
+  for (uint8_t l = 0; l < _luns; l++) total += parts[l].demand;
+  for (uint8_t l = 0; l < _luns; l++)
+  {
+    cache_luns[l].share = even + (total ?
+      (uint32_t)((uint64_t)rest * parts[l].demand / total) : rest / _luns);
+    parts[l].a1in_max = cache_luns[l].share / 4;
+    parts[l].demand /= 2;
+  }
+  share_fills = 0;
 }
 
-uint16_t init_cache(uint16_t block_size, uint32_t max_blocks)
+uint32_t init_cache(uint16_t block_size, uint32_t max_blocks, uint8_t luns)
 {
   int free = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
   if (free >= 1024 * 1024)
   {
-    // Allocate as much cache as we can, leaving 0.5 MB free RAM.
-    int entry_size = sizeof (struct cache_chain) + block_size;
+    // Allocate as much cache as we can, leaving 0.5 MB free RAM.  Allow for
+    // up to four hash slots per entry, and half a ghost with its slots.
+    int entry_size = sizeof (struct cache_chain) + block_size +
+      4 * sizeof (uint32_t) + 3 * sizeof (uint32_t);
     blocks = (free - 512 * 1024)/entry_size;
     if (blocks < 2) blocks = 0;
     else if (blocks > max_blocks) blocks = max_blocks;
     if (blocks) allocate_cache(block_size, blocks);
   }
+  _luns = luns;
+  parts = (struct cache_part*)calloc(luns, sizeof *parts);
+  cache_luns = (struct cache_lun*)calloc(luns, sizeof *cache_luns);
+  // Share out again each time an eighth of the cache has been refilled.
+  share_period = blocks / 8 > 16 ? blocks / 8 : 16;
+  if (blocks) _share_out();
+  cache_lock = xSemaphoreCreateMutex();
   _block_size = block_size;
   return blocks;
 }
 
-void* get_cache_block(uint16_t block)
+static struct cache_list *_queue(uint8_t lun, uint8_t queue)
+{
+  struct cache_part *p = &parts[lun];
+  switch (queue)
+  {
+    case CACHE_AM: return &p->am;
+    case CACHE_A1IN: return &p->a1in;
+    case CACHE_PINNED: return &p->pinned;
+    default: return &unused;
+  }
+}
+
+static void _unlink(struct cache_chain *ent)
+{
+  uint8_t lun = ent->data.lun, queue = ent->data.queue;
+  struct cache_list *l = _queue(lun, queue);
+  if (ent->chain.prev) ent->chain.prev->chain.next = ent->chain.next;
+  else l->next = ent->chain.next;
+  if (ent->chain.next) ent->chain.next->chain.prev = ent->chain.prev;
+  else l->prev = ent->chain.prev;
+  if (queue == CACHE_AM || queue == CACHE_A1IN) cache_luns[lun].blocks--;
+  if (queue == CACHE_A1IN) parts[lun].a1in_blocks--;
+  if (queue == CACHE_PINNED) pinned_cache_blocks--;
+}
+
+static void _link_head(struct cache_chain *ent, uint8_t queue)
+{
+  uint8_t lun = ent->data.lun;
+  struct cache_list *l = _queue(lun, queue);
+  ent->data.queue = queue;
+  ent->chain.prev = NULL;
+  ent->chain.next = l->next;
+  if (l->next) l->next->chain.prev = ent;
+  else l->prev = ent;
+  l->next = ent;
+  if (queue == CACHE_AM || queue == CACHE_A1IN) cache_luns[lun].blocks++;
+  if (queue == CACHE_A1IN) parts[lun].a1in_blocks++;
+  if (queue == CACHE_PINNED) pinned_cache_blocks++;
+}
+
+// A block used again is only promoted if in Am.  Repeated use while in
+// A1in is taken as one burst of activity, as 2Q does.
+static void _touch(struct cache_chain *ent)
+{
+  if (ent->data.queue == CACHE_AM && ent != parts[ent->data.lun].am.next)
+  {
+    //HWSerial.printf("%%MEM-CACHE-PROMOTE block=%u\r\n", ent->data.block);
+    _unlink(ent);
+    _link_head(ent, CACHE_AM);
+  }
+}
+
+bool read_cache_block(uint8_t lun, uint32_t block, void* block_data)
+{
+  if (!blocks) return false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent)
+  {
+    _touch(ent);
+    memcpy(block_data, block_list + _block_size * ent->data.block_ix,
+      _block_size);
+    cache_hits++;
+    cache_luns[lun].hits++;
+    parts[lun].demand++;
+    if (ent->data.hits < UINT8_MAX) ent->data.hits++;
+    if (ent->data.prefetched)
+    {
+      ent->data.prefetched = false;
+      cache_prefetch_hits++;
+      cache_luns[lun].prefetch_hits++;
+    }
+  }
+  else
+  {
+    cache_misses++;
+    cache_luns[lun].misses++;
+  }
+  xSemaphoreGive(cache_lock);
+  return ent != NULL;
+}
+
+bool peek_cache_block(uint8_t lun, uint32_t block, void* block_data)
+{
+  if (!blocks) return false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent)
+    memcpy(block_data, block_list + _block_size * ent->data.block_ix,
+      _block_size);
+  xSemaphoreGive(cache_lock);
+  return ent != NULL;
+}
+
+// The least recently used entry in a queue that can be dropped.
+static struct cache_chain *_evictable(struct cache_list *l)
 {
-  if (!blocks) return 0;
+  for (struct cache_chain *ent = l->prev; ent; ent = ent->chain.prev)
+    if (!ent->data.dirty && !ent->data.flushing) return ent;
+  return NULL;
+}
 
-  // Search from MRU head.
-  bool hit = 0;
-  struct cache_chain * ent = list.next;
-  while (ent && !hit)
+// Within one LUN, drop the oldest block from A1in while it holds more than
+// its share, else the least recently used block from Am.
+static struct cache_chain *_victim(struct cache_part *p)
+{
+  struct cache_chain *ent = NULL;
+  if (p->a1in_blocks > p->a1in_max) ent = _evictable(&p->a1in);
+  if (!ent) ent = _evictable(&p->am);
+  if (!ent) ent = _evictable(&p->a1in);
+  return ent;
+}
+
+// Choose a block to drop from the LUN furthest over its share, or failing
+// that from whichever LUN is next furthest.
+static struct cache_chain *_evict(void)
+{
+  struct cache_chain *ent = NULL;
+  uint32_t tried = 0;
+  while (!ent)
   {
-    if (ent->data.in_use && ent->data.block == block) hit = 1;
-    else ent = ent->chain.next;
+    int best = -1;
+    int64_t over = 0;
+    for (uint8_t l = 0; l < _luns; l++)
+    {
+      int64_t o = (int64_t)cache_luns[l].blocks - cache_luns[l].share;
+      if (!(tried & 1 << l) && cache_luns[l].blocks && (best < 0 || o > over))
+      {
+        best = l;
+        over = o;
+      }
+    }
+    if (best < 0) break;
+    tried |= 1 << best;
+    ent = _victim(&parts[best]);
   }
+  return ent;
+}
 
-  // Re-link to MRU head of list.
-  if (hit && ent != list.next)
+// Find or make an entry for block, with the cache locked.  A new entry goes
+// into Am if hot, or if the block left A1in recently, otherwise into A1in.
+// Returns NULL if every entry holds data not yet written to the remote host.
+static struct cache_chain *_put_cache_entry(uint8_t lun, uint32_t block,
+  bool hot)
+{
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent) return ent;
+
+  // Block not in cache so take an unused entry, else drop another block.
+  if (!(ent = unused.prev) && !(ent = _evict())) return NULL;
+  _unlink(ent);
+  //if (ent->data.in_use)
+  //  HWSerial.printf("%%MEM-CACHE-EVICT lun=%u block=%u\r\n", ent->data.lun,
+  //    ent->data.block);
+  if (ent->data.in_use)
+  {
+    hash_remove(ent);
+    cache_evictions++;
+    if (ent->data.queue == CACHE_A1IN)
+      ghost_add(_key(ent->data.lun, ent->data.block));
+  }
+  if (ent->data.prefetched)
   {
-    //HWSerial.printf("%%MEM-CACHE-PROMOTE block=%u\r\n", block);
-    ent->chain.prev->chain.next = ent->chain.next;
-    if (ent->chain.next) ent->chain.next->chain.prev = ent->chain.prev;
-    else list.prev = ent->chain.prev;
-    ent->chain.prev = 0;
-    ent->chain.next = list.next;
-    list.next->chain.prev = ent;
-    list.next = ent;
+    cache_prefetch_wasted++;
+    cache_luns[ent->data.lun].prefetch_wasted++;
   }
-  //_dump_cache_chain();
 
-  //HWSerial.printf("%%MEM-CACHE-GET block=%u hit=%d\r\n", block, hit);
-  if (hit) return block_list + _block_size * ent->data.block_ix;
-  else return NULL;
+  // Update cache.
+  ent->data.in_use = true;
+  ent->data.prefetched = false;
+  ent->data.persisted = false;
+  ent->data.hits = 0;
+  ent->data.lun = lun;
+  ent->data.block = block;
+  hash_insert(ent);
+  if (!hot && ghost_take(_key(lun, block)))
+  {
+    parts[lun].demand++;
+    hot = true;
+  }
+  _link_head(ent, hot ? CACHE_AM : CACHE_A1IN);
+  if (++share_fills >= share_period) _share_out();
+  return ent;
 }
 
-void put_cache_block(uint16_t block, void* block_data)
+void put_cache_block(uint8_t lun, uint32_t block, void* block_data)
 {
   if (!blocks) return;
 
-  // Search from MRU head.
-  bool hit = 0;
-  struct cache_chain * ent = list.next;
-  while (ent && !hit)
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = _put_cache_entry(lun, block, false);
+  // Never overwrite data the remote host has not seen yet.
+  if (ent && !ent->data.dirty && !ent->data.flushing)
   {
-    if (ent->data.in_use && ent->data.block == block) hit = 1;
-    else ent = ent->chain.next;
+    memcpy(block_list + _block_size * ent->data.block_ix, block_data,
+      _block_size);
+    ent->data.persisted = false;
   }
+  //_dump_cache_chain(lun);
+  xSemaphoreGive(cache_lock);
+
+  //HWSerial.printf("%%MEM-CACHE-PUT lun=%u block=%u\r\n", lun, block);
+}
 
-  if (!hit)
+bool put_dirty_cache_block(uint8_t lun, uint32_t block, void* block_data)
+{
+  if (!blocks) return false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = _put_cache_entry(lun, block, false);
+  if (ent)
   {
-    // Block not in cache so unlink LRU at tail and link at head with our block.
-    ent = list.prev;
-    ent->chain.next = list.next;
-    list.next->chain.prev = ent;
-    list.next = ent;
-    list.prev = ent->chain.prev;
-    ent->chain.prev = NULL;
-    list.prev->chain.next = NULL;
-    //if (ent->data.in_use)
-    //  HWSerial.printf("%%MEM-CACHE-EVICT block=%u\r\n", ent->data.block);
+    memcpy(block_list + _block_size * ent->data.block_ix, block_data,
+      _block_size);
+    if (!ent->data.dirty && !ent->data.flushing)
+    {
+      dirty_blocks++;
+      cache_luns[lun].dirty++;
+      ent->data.dirtied = millis();
+    }
+    ent->data.dirty = true;
+    ent->data.persisted = false;
+  }
+  xSemaphoreGive(cache_lock);
 
-    // Update cache.
-    ent->data.in_use = true;
-    ent->data.block = block;
+  //HWSerial.printf("%%MEM-CACHE-DIRTY lun=%u block=%u\r\n", lun, block);
+  return ent != NULL;
+}
+
+bool put_prefetch_cache_block(uint8_t lun, uint32_t block, void* block_data)
+{
+  if (!blocks) return false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = NULL;
+  if (!hash_find(lun, block) && (ent = _put_cache_entry(lun, block, false)))
+  {
+    memcpy(block_list + _block_size * ent->data.block_ix, block_data,
+      _block_size);
+    ent->data.prefetched = true;
   }
-  else
+  xSemaphoreGive(cache_lock);
+  return ent != NULL;
+}
+
+uint32_t dirty_cache_blocks(void)
+{
+  return dirty_blocks;
+}
+
+uint32_t get_dirty_cache_blocks(uint8_t lun, uint32_t *block_nums,
+  uint32_t max, uint32_t *oldest)
+{
+  uint32_t n = 0, now = millis();
+  *oldest = now;
+  // The flusher asks every LUN often, and most have nothing dirty.
+  if (!cache_luns || !cache_luns[lun].dirty) return 0;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  for (uint32_t b = 0; b < blocks && n < max; b++)
+    if (entries[b].data.dirty && entries[b].data.lun == lun)
+    {
+      block_nums[n++] = entries[b].data.block;
+      if (now - entries[b].data.dirtied > now - *oldest)
+        *oldest = entries[b].data.dirtied;
+    }
+  xSemaphoreGive(cache_lock);
+  return n;
+}
+
+bool clean_cache_block(uint8_t lun, uint32_t block, void *block_data)
+{
+  bool dirty = false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent && ent->data.dirty)
   {
-    // Block in cache, update just the data.
+    memcpy(block_data, block_list + _block_size * ent->data.block_ix,
+      _block_size);
+    ent->data.dirty = false;
+    ent->data.flushing = true;
+    dirty = true;
   }
-  memcpy(block_list + _block_size * ent->data.block_ix, block_data, _block_size);
-  //_dump_cache_chain();
+  xSemaphoreGive(cache_lock);
+  return dirty;
+}
 
-  //HWSerial.printf("%%MEM-CACHE-PUT block=%u overwrite=%d\r\n", block, hit);
+bool hold_cache_block(uint8_t lun, uint32_t block, void *block_data)
+{
+  bool held = false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent && !ent->data.dirty && !ent->data.flushing)
+  {
+    memcpy(block_data, block_list + _block_size * ent->data.block_ix,
+      _block_size);
+    ent->data.flushing = true;
+    dirty_blocks++;
+    cache_luns[lun].dirty++;
+    held = true;
+  }
+  xSemaphoreGive(cache_lock);
+  return held;
+}
+
+void flushed_cache_block(uint8_t lun, uint32_t block, bool written)
+{
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent && ent->data.flushing)
+  {
+    ent->data.flushing = false;
+    if (!written && !ent->data.dirty)
+    {
+      ent->data.dirty = true;
+      ent->data.dirtied = millis();
+    }
+    else if (!ent->data.dirty)
+    {
+      dirty_blocks--;
+      cache_luns[lun].dirty--;
+    }
+  }
+  xSemaphoreGive(cache_lock);
+}
+
+uint32_t get_hot_cache_blocks(uint8_t lun, uint32_t *block_nums,
+  uint32_t max, uint8_t min_hits)
+{
+  uint32_t n = 0;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  for (uint32_t b = 0; b < blocks && n < max; b++)
+  {
+    struct cache_data *data = &entries[b].data;
+    if (data->in_use && data->lun == lun && !data->dirty &&
+      !data->flushing && !data->persisted && data->hits >= min_hits)
+      block_nums[n++] = data->block;
+  }
+  xSemaphoreGive(cache_lock);
+  return n;
+}
+
+bool persist_cache_block(uint8_t lun, uint32_t block, void *block_data)
+{
+  if (!blocks) return false;
+  bool hot = false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent && !ent->data.dirty && !ent->data.flushing && !ent->data.persisted)
+  {
+    memcpy(block_data, block_list + _block_size * ent->data.block_ix,
+      _block_size);
+    ent->data.persisted = true;
+    hot = true;
+  }
+  xSemaphoreGive(cache_lock);
+  return hot;
+}
+
+void forget_persisted_cache_blocks(void)
+{
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  for (uint32_t b = 0; b < blocks; b++) entries[b].data.persisted = false;
+  xSemaphoreGive(cache_lock);
+}
+
+bool put_persisted_cache_block(uint8_t lun, uint32_t block, void* block_data)
+{
+  if (!blocks) return false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = NULL;
+  if (!hash_find(lun, block) && (ent = _put_cache_entry(lun, block, true)))
+  {
+    memcpy(block_list + _block_size * ent->data.block_ix, block_data,
+      _block_size);
+    // Count it as read once, since it was worth keeping last time.
+    ent->data.persisted = true;
+    ent->data.hits = 1;
+  }
+  xSemaphoreGive(cache_lock);
+  return ent != NULL;
+}
+
+bool put_pinned_cache_block(uint8_t lun, uint32_t block, void* block_data)
+{
+  if (!blocks) return false;
+  bool pin = false;
+
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  struct cache_chain * ent = hash_find(lun, block);
+  if (ent && ent->data.queue == CACHE_PINNED) pin = true;
+  else if (pinned_cache_blocks + 1 < blocks)
+  {
+    // A block already cached is pinned as it is, since it may have been
+    // written after block_data was fetched.
+    if (!ent && (ent = _put_cache_entry(lun, block, true)))
+      memcpy(block_list + _block_size * ent->data.block_ix, block_data,
+        _block_size);
+    if (ent)
+    {
+      _unlink(ent);
+      _link_head(ent, CACHE_PINNED);
+      pin = true;
+    }
+  }
+  xSemaphoreGive(cache_lock);
+  return pin;
+}
+
+void unpin_cache_blocks(uint8_t lun)
+{
+  xSemaphoreTake(cache_lock, portMAX_DELAY);
+  while (parts[lun].pinned.next)
+  {
+    struct cache_chain *ent = parts[lun].pinned.next;
+    _unlink(ent);
+    _link_head(ent, CACHE_AM);
+  }
+  xSemaphoreGive(cache_lock);
 }
@@ -7,9 +7,72 @@
 
 #include <stdint.h>
 
-uint16_t init_cache(uint16_t block_size, uint32_t max_blocks);
-void* get_cache_block(uint16_t block);
-void put_cache_block(uint16_t block, void* block_data);
+// Blocks are those of one of luns logical units, each cached block being
+// known by its LUN and block number.
+uint32_t init_cache(uint16_t block_size, uint32_t max_blocks, uint8_t luns);
+void put_cache_block(uint8_t lun, uint32_t block, void* block_data);
+// Copy out a cached block, promoting it and counting the hit or miss.  The
+// copy is taken under the cache lock, so another task evicting the block
+// cannot change it underneath the caller.
+bool read_cache_block(uint8_t lun, uint32_t block, void* block_data);
+// Copy out a cached block without promoting it.
+bool peek_cache_block(uint8_t lun, uint32_t block, void* block_data);
+// Add a block read ahead, unless it is already cached.
+bool put_prefetch_cache_block(uint8_t lun, uint32_t block, void* block_data);
+
+// Counters over all LUNs, in blocks.  Prefetched blocks are wasted if
+// evicted unread.
+extern uint32_t cache_hits, cache_misses, cache_evictions;
+extern uint32_t cache_prefetch_hits, cache_prefetch_wasted;
+
+// Each LUN's part of the cache.  The entries not pinned are shared out in
+// proportion to each LUN's recent demand, counted as cache hits plus
+// misses on blocks dropped only recently, which more room would have kept.
+// Blocks are evicted from whichever LUN holds most over its share.
+struct cache_lun
+{
+  uint32_t blocks;      // Entries held, not counting pinned ones.
+  uint32_t share;       // Entries it should hold.
+  uint32_t dirty;       // Entries dirty or being flushed.
+  uint32_t hits, misses;
+  uint32_t prefetch_hits, prefetch_wasted;
+};
+extern struct cache_lun *cache_luns;
+
+// Write-back support.  Dirty blocks are never evicted.  The flusher takes a
+// copy of each dirty block with clean_cache_block(), which also keeps it
+// from being evicted until flushed_cache_block() says the remote host has
+// it, or that the write failed and the block is dirty again.
+// dirty_cache_blocks() counts blocks in either state, over all LUNs.
+bool put_dirty_cache_block(uint8_t lun, uint32_t block, void* block_data);
+uint32_t dirty_cache_blocks(void);
+uint32_t get_dirty_cache_blocks(uint8_t lun, uint32_t *block_nums,
+  uint32_t max, uint32_t *oldest);
+bool clean_cache_block(uint8_t lun, uint32_t block, void *block_data);
+// Copy out a clean block to be written again alongside dirty ones, holding
+// it as clean_cache_block() does.  A later write then dirties the cached
+// copy rather than going straight to the remote host ahead of this one.
+bool hold_cache_block(uint8_t lun, uint32_t block, void *block_data);
+void flushed_cache_block(uint8_t lun, uint32_t block, bool written);
+
+// Flash cache support.  Clean blocks read at least min_hits times since
+// they were cached, and not yet copied to flash, are hot.  A block stays
+// persisted, and so not hot, until its data is replaced.
+uint32_t get_hot_cache_blocks(uint8_t lun, uint32_t *block_nums,
+  uint32_t max, uint8_t min_hits);
+bool persist_cache_block(uint8_t lun, uint32_t block, void *block_data);
+void forget_persisted_cache_blocks(void);
+// Add a block restored from flash, unless it is already cached.
+bool put_persisted_cache_block(uint8_t lun, uint32_t block, void* block_data);
+
+// Pin a block, such as filesystem metadata, so it is never evicted.  Its
+// data is updated by later writes as usual, and a block already cached
+// keeps its data rather than take block_data.  Returns false if there is
+// no room, since at least one entry must be left unpinned.
+bool put_pinned_cache_block(uint8_t lun, uint32_t block, void* block_data);
+// Unpinned blocks of the LUN return to its LRU list.
+void unpin_cache_blocks(uint8_t lun);
+extern uint32_t pinned_cache_blocks;
 
 struct cache_list
 {
@@ -17,11 +80,27 @@ struct cache_list
   struct cache_chain *prev;
 };
 
+// Replacement queues, after 2Q.  Blocks enter A1in, a FIFO, and are only
+// moved to Am, an LRU list, if they are fetched again soon after leaving
+// A1in, so a long sequential read cannot push out the blocks in Am.  Pinned
+// blocks are kept apart and never evicted.  Each LUN has its own queues, and
+// entries not yet used are kept on a list of their own.
+enum cache_queues { CACHE_AM = 0, CACHE_A1IN = 1, CACHE_PINNED = 2,
+  CACHE_UNUSED = 3 };
+
 struct cache_data
 {
   bool in_use;
+  uint8_t lun;
+  uint8_t queue;
+  bool dirty;
+  bool flushing;
+  bool prefetched;
+  bool persisted;
+  uint8_t hits;
   uint32_t block;
-  uint16_t block_ix;
+  uint32_t block_ix;
+  uint32_t dirtied;
   //int reads, writes;
 };
 
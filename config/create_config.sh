@@ -3,99 +3,166 @@
 # Ewan Parker, created 8th February 2018.
 # Configure the SSH keys and other secrets for the firmware.
 # Copyright (C) 2018, 2023 Ewan Parker.
+#
+# Usage: create_config.sh [PROFILE...]
+# Each profile is served as one LUN, in the order given.  The first profile
+# also holds the settings for the device as a whole: WiFi, write-back, flash
+# cache, tracing and FAT metadata pinning.
 
 if [ $# -eq 0 ]; then
-  PROFILE=0
-else
-  PROFILE="$1"
+  set -- 0
 fi
+if [ $# -gt 3 ]; then
+  echo "At most 3 profiles may be served, one per LUN." >&2
+  exit 1
+fi
+PROFILES="$*"
 
 umask 077
-mkdir -p $(dirname $0)/data/$PROFILE
-cd $(dirname $0)/data/$PROFILE
+CONFIG_DIR=$(cd $(dirname $0) && pwd)
 
-if [ ! -f DEV_ID ]; then
-  cat /dev/random | xxd -g0 -c8 -l8 -p -u >DEV_ID
-fi
+for PROFILE in $PROFILES; do
+  mkdir -p $CONFIG_DIR/data/$PROFILE
+  cd $CONFIG_DIR/data/$PROFILE
 
-if [ ! -f DISK_SECTOR_SIZE ]; then
-  echo "512" >DISK_SECTOR_SIZE
-fi
+  if [ ! -f DEV_ID ]; then
+    cat /dev/random | xxd -g0 -c8 -l8 -p -u >DEV_ID
+  fi
 
-if [ ! -f DISK_SECTOR_COUNT ]; then
-  echo "(2 * 1024 * 32)" >DISK_SECTOR_COUNT
-fi
+  if [ ! -f DISK_SECTOR_SIZE ]; then
+    echo "512" >DISK_SECTOR_SIZE
+  fi
 
-if [ ! -f SSID ]; then
-  echo "YourWiFiSSID" >SSID
-  echo "YourWiFiPSK" >PSK
-fi
+  if [ ! -f DISK_SECTOR_COUNT ]; then
+    echo "(2 * 1024 * 32)" >DISK_SECTOR_COUNT
+  fi
 
-if [ ! -f SERVER ]; then
-  echo "ssh-server.example.com" >SERVER
-  echo "sshuser" >USER_NAME
-  rm -f SERVER_HASH
-fi
+  if [ ! -f DISK_WRITE_BACK ]; then
+    echo "0" >DISK_WRITE_BACK
+  fi
+
+  if [ ! -f DISK_FLASH_CACHE ]; then
+    echo "0" >DISK_FLASH_CACHE
+  fi
 
-if [ -f SERVER_HASH ]; then
-  if [ $(date -r SERVER_HASH +%s) -lt $(date -r SERVER +%s) ]; then
+  if [ ! -f DISK_TRACE_RECORDS ]; then
+    echo "0" >DISK_TRACE_RECORDS
+  fi
+
+  if [ ! -f DISK_PIN_METADATA ]; then
+    echo "0" >DISK_PIN_METADATA
+  fi
+
+  if [ ! -f SSID ]; then
+    echo "YourWiFiSSID" >SSID
+    echo "YourWiFiPSK" >PSK
+  fi
+
+  if [ ! -f SERVER ]; then
+    echo "ssh-server.example.com" >SERVER
+    echo "sshuser" >USER_NAME
     rm -f SERVER_HASH
   fi
-fi
 
+  if [ -f SERVER_HASH ]; then
+    if [ $(date -r SERVER_HASH +%s) -lt $(date -r SERVER +%s) ]; then
+      rm -f SERVER_HASH
+    fi
+  fi
 
-if [ ! -f BACKING_FILE ]; then
-  DEV_ID=$(cat DEV_ID)
-  echo "/var/tmp/WiFiMSC.$DEV_ID" >BACKING_FILE
-fi
 
-if [ ! -f ID ]; then
-  DEV_USER=WiFiMSC
-  DEV_ID=$(cat DEV_ID)
-  USER_NAME=$(cat USER_NAME)
-  SERVER=$(cat SERVER)
-  KEYNAME="${DEV_USER}@$DEV_ID"
-  echo "Generating key $KEYNAME" >&2
-  ssh-keygen -C "$KEYNAME" -t ed25519 -f ID
-  echo "To transfer key $KEYNAME to ${USER_NAME}@$SERVER please run" >&2
-  echo "  ssh-copy-id -i $(dirname $0)/data/$PROFILE/ID.pub ${USER_NAME}@$SERVER" >&2
-fi
+  if [ ! -f BACKING_FILE ]; then
+    DEV_ID=$(cat DEV_ID)
+    echo "/var/tmp/WiFiMSC.$DEV_ID" >BACKING_FILE
+  fi
 
-if [ ! -f SERVER_HASH ]; then
-  SERVER=$(cat SERVER)
-  ssh-keyscan $SERVER >SERVER_HASH 2>/dev/null
-fi
+  if [ ! -f BLOCK_SERVER ]; then
+    echo "wifimsc-blockd" >BLOCK_SERVER
+  fi
+
+  if [ ! -f ID ]; then
+    DEV_USER=WiFiMSC
+    DEV_ID=$(cat DEV_ID)
+    USER_NAME=$(cat USER_NAME)
+    SERVER=$(cat SERVER)
+    KEYNAME="${DEV_USER}@$DEV_ID"
+    echo "Generating key $KEYNAME" >&2
+    ssh-keygen -C "$KEYNAME" -t ed25519 -f ID
+    echo "To transfer key $KEYNAME to ${USER_NAME}@$SERVER please run" >&2
+    echo "  ssh-copy-id -i $CONFIG_DIR/data/$PROFILE/ID.pub ${USER_NAME}@$SERVER" >&2
+  fi
+
+  if [ ! -f SERVER_HASH ]; then
+    SERVER=$(cat SERVER)
+    ssh-keyscan $SERVER >SERVER_HASH 2>/dev/null
+  fi
 
-for CONF in DEV_ID SSID PSK SERVER USER_NAME BACKING_FILE ID.pub SERVER_HASH;
-do
-  grep -qPz "\n" $CONF && cat $CONF | tr "\n" "\0" >$CONF$$ && mv $CONF$$ $CONF
+  for CONF in DEV_ID SSID PSK SERVER USER_NAME BACKING_FILE BLOCK_SERVER \
+    ID.pub SERVER_HASH;
+  do
+    grep -qPz "\n" $CONF && cat $CONF | tr "\n" "\0" >$CONF$$ && mv $CONF$$ $CONF
+  done
 done
 
+# The USB host is told one sector size for every LUN.
+set -- $PROFILES
+DISK_SECTOR_SIZE=$(cat $CONFIG_DIR/data/$1/DISK_SECTOR_SIZE)
+for PROFILE in $PROFILES; do
+  if [ "$(cat $CONFIG_DIR/data/$PROFILE/DISK_SECTOR_SIZE)" != \
+    "$DISK_SECTOR_SIZE" ]; then
+    echo "Profile $PROFILE has a different DISK_SECTOR_SIZE to $1." >&2
+    exit 1
+  fi
+done
+cd $CONFIG_DIR/data/$1
+
 
-exec 1>../../../wifimsc_disk_config.h
+exec 1>$CONFIG_DIR/../wifimsc_disk_config.h
 
 echo "// Target-specific mass storage configuration for WiFiMSC."
 echo "// Copyright (C) 2018, 2023 Ewan Parker."
 echo "// Generated: `date`"
-echo "// Command line: $0 $*"
-echo "// Profile: $PROFILE"
+echo "// Command line: $0 $PROFILES"
+echo "// Profiles: $PROFILES"
 echo "// Configuration script version: `git describe --always --dirty`"
 echo
 
+echo "// Logical units, one per profile."
+echo "static const uint8_t DISK_LUNS = $#;"
+echo
 echo "// Use a sector size of 2048 and count of -1 for maximum size of 8 TByte."
-DISK_SECTOR_SIZE=$(cat DISK_SECTOR_SIZE)
-DISK_SECTOR_COUNT=$(cat DISK_SECTOR_COUNT)
 echo "static const uint16_t DISK_SECTOR_SIZE = $DISK_SECTOR_SIZE;"
-echo "static const uint32_t DISK_SECTOR_COUNT = $DISK_SECTOR_COUNT;"
+echo "static const uint32_t DISK_SECTOR_COUNT[DISK_LUNS] ="
+echo "{"
+for PROFILE in $PROFILES; do
+  echo "  (uint32_t)$(cat $CONFIG_DIR/data/$PROFILE/DISK_SECTOR_COUNT),"
+done
+echo "};"
+echo
+echo "// Most sectors held dirty in the cache for write-back, or 0 to write-through."
+DISK_WRITE_BACK=$(cat DISK_WRITE_BACK)
+echo "static const uint32_t DISK_WRITE_BACK = $DISK_WRITE_BACK;"
+echo
+echo "// Most hot sectors kept in SPIFFS across power cycles, or 0 for none."
+DISK_FLASH_CACHE=$(cat DISK_FLASH_CACHE)
+echo "static const uint32_t DISK_FLASH_CACHE = $DISK_FLASH_CACHE;"
+echo
+echo "// USB requests kept in the trace ring in PSRAM, or 0 for no tracing."
+DISK_TRACE_RECORDS=$(cat DISK_TRACE_RECORDS)
+echo "static const uint32_t DISK_TRACE_RECORDS = $DISK_TRACE_RECORDS;"
+echo
+echo "// Most FAT metadata sectors pinned in the cache per LUN, or 0 for none."
+DISK_PIN_METADATA=$(cat DISK_PIN_METADATA)
+echo "static const uint32_t DISK_PIN_METADATA = $DISK_PIN_METADATA;"
 
 
-exec 1>../../../wifimsc_ssh_config.h
+exec 1>$CONFIG_DIR/../wifimsc_ssh_config.h
 
 echo "// Target-specific SSH keys and other secrets for WiFiMSC."
 echo "// Copyright (C) 2018, 2023 Ewan Parker."
 echo "// Generated: `date`"
-echo "// Command line: $0 $*"
-echo "// Profile: $PROFILE"
+echo "// Command line: $0 $PROFILES"
+echo "// Profiles: $PROFILES"
 echo "// Configuration script version: `git describe --always --dirty`"
 echo
 
@@ -104,15 +171,29 @@ echo ""
 xxd -i -C SSID
 echo ""
 xxd -i -C PSK
+
+# Each profile's host settings, prefixed with its LUN.
+N=0
+for PROFILE in $PROFILES; do
+  cd $CONFIG_DIR/data/$PROFILE
+  for CONF in SERVER USER_NAME SERVER_HASH BACKING_FILE BLOCK_SERVER ID; do
+    echo ""
+    xxd -i -C $CONF | sed "s/^unsigned \([a-z]*\) /unsigned \1 LUN${N}_/"
+  done
+  #echo ""
+  #xxd -i -C ID.pub
+  N=$((N + 1))
+done
+
 echo ""
-xxd -i -C SERVER
-echo ""
-xxd -i -C USER_NAME
-echo ""
-xxd -i -C SERVER_HASH
-echo ""
-xxd -i -C BACKING_FILE
-echo ""
-xxd -i -C ID
-#echo ""
-#xxd -i -C ID.pub
+echo "static const struct lun_ssh_config LUN_SSH_CONFIG[] ="
+echo "{"
+N=0
+for PROFILE in $PROFILES; do
+  L=LUN${N}_
+  echo "  { ${L}SERVER, ${L}USER_NAME, ${L}SERVER_HASH, ${L}SERVER_HASH_LEN,"
+  echo "    ${L}BACKING_FILE, ${L}BACKING_FILE_LEN,"
+  echo "    ${L}BLOCK_SERVER, ${L}BLOCK_SERVER_LEN, ${L}ID, ${L}ID_LEN },"
+  N=$((N + 1))
+done
+echo "};"
@@ -0,0 +1,135 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// CRC-32C (Castagnoli) checksums of sector data.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "crc32c.h"
+#include <string.h>
+
+// Reflected polynomial.
+#define CRC32C_POLY 0x82F63B78
+
+// Slicing by four: table[k][i] is the CRC of byte i followed by k zero
+// bytes, so that a whole word is folded in at each step.  The tables are
+// built by the compiler, so there is nothing to set up before the first
+// call from any task.
+static constexpr uint32_t _crc_bits(uint32_t c, int bits)
+{
+  return bits ? _crc_bits(c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1, bits - 1) :
+    c;
+}
+
+static constexpr uint32_t _crc_entry(int k, uint32_t i)
+{
+  return k ? _crc_bits(_crc_entry(k - 1, i) & 0xff, 8) ^
+    (_crc_entry(k - 1, i) >> 8) : _crc_bits(i, 8);
+}
+
+#define CRC32C_4(k, i) _crc_entry(k, i), _crc_entry(k, i + 1), \
+  _crc_entry(k, i + 2), _crc_entry(k, i + 3)
+#define CRC32C_16(k, i) CRC32C_4(k, i), CRC32C_4(k, i + 4), \
+  CRC32C_4(k, i + 8), CRC32C_4(k, i + 12)
+#define CRC32C_64(k, i) CRC32C_16(k, i), CRC32C_16(k, i + 16), \
+  CRC32C_16(k, i + 32), CRC32C_16(k, i + 48)
+#define CRC32C_256(k) CRC32C_64(k, 0), CRC32C_64(k, 64), \
+  CRC32C_64(k, 128), CRC32C_64(k, 192)
+
+static constexpr uint32_t table[4][256] = { { CRC32C_256(0) },
+  { CRC32C_256(1) }, { CRC32C_256(2) }, { CRC32C_256(3) } };
+
+#if defined __x86_64__ && defined __GNUC__
+// The block server's host can use the CRC32 instruction, where it has one.
+// Each takes three cycles but one can start every cycle, so three streams
+// are run side by side over consecutive thirds of the data, and their CRCs
+// then joined.  shift[k][i] is the CRC register after feeding CRC32C_LANE
+// zero bytes to byte i shifted left by k bytes, so that it moves a stream's
+// CRC past the data of the next.
+#define CRC32C_LANE 4096
+
+// Feeding zero bytes is linear in the CRC register, so the shift of each
+// byte is the sum of the shifts of its bits.  Built by the compiler, as
+// the main table is.
+struct crc32c_shift
+{
+  uint32_t v[4][256];
+};
+
+static constexpr struct crc32c_shift _make_shift(void)
+{
+  uint32_t bit[32] = { 0 };
+  for (int b = 0; b < 32; b++)
+  {
+    uint32_t c = 1u << b;
+    for (int n = 0; n < CRC32C_LANE; n++)
+      c = table[0][c & 0xff] ^ (c >> 8);
+    bit[b] = c;
+  }
+  struct crc32c_shift s = { { { 0 } } };
+  for (int k = 0; k < 4; k++)
+    for (uint32_t i = 0; i < 256; i++)
+      for (int b = 0; b < 8; b++)
+        if (i & 1 << b) s.v[k][i] ^= bit[8 * k + b];
+  return s;
+}
+
+static constexpr struct crc32c_shift shift = _make_shift();
+
+static inline uint32_t _shift(uint32_t c)
+{
+  return shift.v[0][c & 0xff] ^ shift.v[1][(c >> 8) & 0xff] ^
+    shift.v[2][(c >> 16) & 0xff] ^ shift.v[3][c >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+  uint64_t c0 = ~crc, c1, c2, w;
+  for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE,
+    len -= 3 * CRC32C_LANE)
+  {
+    c1 = c2 = 0;
+    for (uint32_t i = 0; i < CRC32C_LANE; i += 8)
+    {
+      memcpy(&w, p + i, sizeof w);
+      c0 = __builtin_ia32_crc32di(c0, w);
+      memcpy(&w, p + CRC32C_LANE + i, sizeof w);
+      c1 = __builtin_ia32_crc32di(c1, w);
+      memcpy(&w, p + 2 * CRC32C_LANE + i, sizeof w);
+      c2 = __builtin_ia32_crc32di(c2, w);
+    }
+    c0 = _shift(_shift(c0) ^ c1) ^ c2;
+  }
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy(&w, p, sizeof w);
+    c0 = __builtin_ia32_crc32di(c0, w);
+  }
+  while (len--) c0 = __builtin_ia32_crc32qi((uint32_t)c0, *p++);
+  return ~(uint32_t)c0;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, uint32_t len)
+{
+  const uint8_t *p = (const uint8_t*)data;
+#if defined __x86_64__ && defined __GNUC__
+  if (__builtin_cpu_supports("sse4.2")) return _crc32c_sse42(crc, p, len);
+#endif
+
+  crc = ~crc;
+  // Both ends of the protocol are little-endian, as is this word order.
+  for (; len && (uintptr_t)p & 3; len--)
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  for (; len >= 4; p += 4, len -= 4)
+  {
+    uint32_t w;
+    memcpy(&w, p, sizeof w);
+    crc ^= w;
+    crc = table[3][crc & 0xff] ^ table[2][(crc >> 8) & 0xff] ^
+      table[1][(crc >> 16) & 0xff] ^ table[0][crc >> 24];
+  }
+  while (len--) crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
@@ -0,0 +1,19 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// CRC-32C (Castagnoli) checksums of sector data.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// Shared by the firmware and the host-side block server, so this must not
+// depend on Arduino or FreeRTOS.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+// Continue a checksum over len more bytes.  Start with crc 0.
+uint32_t crc32c(uint32_t crc, const void *data, uint32_t len);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,207 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Pinning of FAT filesystem metadata in the sector cache.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "fatpin.h"
+#include "cache.h"
+#include "ipc.h"
+#include "Arduino.h"
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+// MBR partition table, and the partition types that hold FAT volumes.
+#define MBR_PARTITIONS 0x1BE
+#define MBR_ENTRIES 4
+static const uint8_t fat_types[] = { 0x01, 0x04, 0x06, 0x0B, 0x0C, 0x0E };
+
+// For each LUN, its quota, the sectors fetched at once while pinning, the
+// sectors holding the partition table and boot sectors, and whether one has
+// been written since they were read.  The USB task checks the boot sectors
+// on every write, so they are only changed while holding boot_lock.
+struct fat_lun
+{
+  uint32_t pin_max, span;
+  SemaphoreHandle_t boot_lock;
+  uint32_t boot_lbas[1 + MBR_ENTRIES], boot_count;
+  volatile bool boot_written;
+};
+
+static uint16_t _block_size = 0;
+static struct fat_lun luns[IPC_LUNS];
+static uint32_t pin_left = 0;
+
+static uint16_t le16(const uint8_t *p)
+{
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+  return le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+// Watch a boot sector for writes, or with lba of -1 forget them all.
+static void watch_boot(struct fat_lun *f, uint32_t lba)
+{
+  xSemaphoreTake(f->boot_lock, portMAX_DELAY);
+  if (lba == (uint32_t)-1) f->boot_count = 0;
+  else f->boot_lbas[f->boot_count++] = lba;
+  xSemaphoreGive(f->boot_lock);
+}
+
+// Fetch count sectors from lba into buf, returning false if the remote host
+// failed to.
+static bool read_sectors(uint8_t lun, uint32_t lba, uint32_t count,
+  uint8_t *buf)
+{
+  struct ipc_msg *msg = ipc_alloc(lun, portMAX_DELAY);
+  msg->host_cmd = USB_READ;
+  msg->secsz = _block_size;
+  msg->lba = lba;
+  msg->dlen = count * _block_size;
+  msg->data = buf;
+  ipc_submit(msg);
+  ipc_wait(msg);
+  bool ok = !msg->status;
+  ipc_free(msg);
+  return ok;
+}
+
+// Fetch and pin count sectors from lba, or as many as the quota allows.
+static void pin_range(uint8_t lun, uint32_t lba, uint32_t count,
+  uint8_t *buf)
+{
+  uint32_t span = luns[lun].span;
+  if (count > pin_left) count = pin_left;
+  for (uint32_t done = 0, n; done < count; done += n)
+  {
+    n = count - done < span ? count - done : span;
+    if (!read_sectors(lun, lba + done, n, buf)) continue;
+    for (uint32_t l = 0; l < n; l++)
+      if (put_pinned_cache_block(lun, lba + done + l, buf + l * _block_size))
+        pin_left--;
+  }
+  //HWSerial.printf("%%FAT-PIN lun=%u lba=%u count=%u\r\n", lun, lba, count);
+}
+
+// True if bs looks like the boot sector of a FAT12, FAT16 or FAT32 volume
+// with our sector size.
+static bool is_fat_boot(const uint8_t *bs)
+{
+  uint8_t spc = bs[0x0D];
+  return (bs[0] == 0xEB || bs[0] == 0xE9) && le16(bs + 0x0B) == _block_size &&
+    spc && !(spc & (spc - 1)) && le16(bs + 0x0E) && bs[0x10] &&
+    (le16(bs + 0x16) || le32(bs + 0x24));
+}
+
+// Pin the metadata of the FAT volume whose boot sector, already in bs, is at
+// lba.  The reserved sectors, FATs and any fixed root directory run on from
+// the boot sector.  A FAT32 root directory is a cluster chain in the data
+// area, of which only the first cluster is pinned.
+static void pin_volume(uint8_t lun, uint32_t lba, const uint8_t *bs,
+  uint8_t *buf)
+{
+  watch_boot(&luns[lun], lba);
+  uint16_t reserved = le16(bs + 0x0E);
+  uint8_t fats = bs[0x10];
+  uint32_t fat_size = le16(bs + 0x16) ? le16(bs + 0x16) : le32(bs + 0x24);
+  uint32_t root_size = (le16(bs + 0x11) * 32 + _block_size - 1) / _block_size;
+  uint32_t meta = reserved + fats * fat_size + root_size;
+
+  HWSerial.printf("%%FAT-PIN volume lun=%u lba=%u metadata=%u\r\n", lun, lba,
+    meta);
+  pin_range(lun, lba, meta, buf);
+  if (!root_size && le32(bs + 0x2C) >= 2)
+    pin_range(lun, lba + meta + (le32(bs + 0x2C) - 2) * bs[0x0D], bs[0x0D],
+      buf);
+}
+
+// Read a boot sector, preferring the cache since with write-back a newly
+// formatted disk may not have reached the remote host yet.  One that cannot
+// be read is taken as blank.
+static void read_boot(uint8_t lun, uint32_t lba, uint8_t *bs)
+{
+  if (!peek_cache_block(lun, lba, bs) && !read_sectors(lun, lba, 1, bs))
+    memset(bs, 0, _block_size);
+}
+
+static uint32_t scan(uint8_t lun)
+{
+  struct fat_lun *f = &luns[lun];
+  // Room for a run of sectors being pinned, as many as the link is currently
+  // fetching at once, then a boot sector.
+  uint32_t xfer = ipc_xfer_size(lun);
+  uint8_t *buf = (uint8_t*)malloc(xfer + _block_size);
+  if (!buf) buf = (uint8_t*)malloc((xfer = IPC_MIN_XFER) + _block_size);
+  if (!buf) return 0;
+  uint8_t *bs = buf + xfer;
+  f->span = xfer / _block_size;
+
+  // Either a volume without a partition table, or an MBR.
+  pin_left = f->pin_max;
+  watch_boot(f, -1);
+  read_boot(lun, 0, bs);
+  if (bs[510] != 0x55 || bs[511] != 0xAA)
+  {
+    watch_boot(f, 0);
+    HWSerial.printf("%%FAT-PIN No boot sector lun=%u\r\n", lun);
+  }
+  else if (is_fat_boot(bs)) pin_volume(lun, 0, bs, buf);
+  else
+  {
+    watch_boot(f, 0);
+    pin_range(lun, 0, 1, buf);
+    uint8_t mbr[MBR_ENTRIES * 16];
+    memcpy(mbr, bs + MBR_PARTITIONS, sizeof mbr);
+    for (int p = 0; p < MBR_ENTRIES && pin_left; p++)
+    {
+      const uint8_t *part = mbr + p * 16;
+      uint32_t lba = le32(part + 8);
+      if (!memchr(fat_types, part[4], sizeof fat_types) || !lba) continue;
+      read_boot(lun, lba, bs);
+      if (is_fat_boot(bs)) pin_volume(lun, lba, bs, buf);
+    }
+  }
+  free(buf);
+
+  HWSerial.printf("%%FAT-PIN lun=%u sectors=%u\r\n", lun,
+    f->pin_max - pin_left);
+  return f->pin_max - pin_left;
+}
+
+uint32_t init_fat_pinning(uint8_t lun, uint16_t block_size,
+  uint32_t max_blocks)
+{
+  _block_size = block_size;
+  if (block_size < 512 || block_size > IPC_MIN_XFER) max_blocks = 0;
+  luns[lun].pin_max = max_blocks;
+  if (!luns[lun].boot_lock) luns[lun].boot_lock = xSemaphoreCreateMutex();
+  return max_blocks ? scan(lun) : 0;
+}
+
+void fat_pin_observe(uint8_t lun, uint32_t lba, uint32_t count)
+{
+  struct fat_lun *f = &luns[lun];
+  xSemaphoreTake(f->boot_lock, portMAX_DELAY);
+  for (uint32_t b = 0; b < f->boot_count; b++)
+    if (f->boot_lbas[b] - lba < count) f->boot_written = true;
+  xSemaphoreGive(f->boot_lock);
+}
+
+void fat_pin_poll(void)
+{
+  for (uint8_t lun = 0; lun < IPC_LUNS; lun++)
+  {
+    if (!luns[lun].boot_written) continue;
+    luns[lun].boot_written = false;
+    unpin_cache_blocks(lun);
+    scan(lun);
+  }
+}
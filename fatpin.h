@@ -0,0 +1,22 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Pinning of FAT filesystem metadata in the sector cache.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+
+// Read the partition table and the boot sector of each FAT volume on a
+// LUN, then fetch and pin up to max_blocks sectors of metadata: the boot
+// sectors, reserved sectors, FATs and root directories.  Must follow
+// init_cache() and the LUN's SSH task being ready.  Returns the sectors
+// pinned.
+uint32_t init_fat_pinning(uint8_t lun, uint16_t block_size,
+  uint32_t max_blocks);
+
+// Called for every USB write.  Notes when the partition table or a boot
+// sector is written, as when the LUN is formatted, so that the metadata is
+// worked out and pinned again by the next fat_pin_poll().
+void fat_pin_observe(uint8_t lun, uint32_t lba, uint32_t count);
+void fat_pin_poll(void);
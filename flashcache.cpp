@@ -0,0 +1,256 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Persistent sector cache in SPIFFS, surviving power cycles.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "flashcache.h"
+#include "cache.h"
+#include "ipc.h"
+#include "crc32c.h"
+#include "Arduino.h"
+#include "SPIFFS.h"
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+// The log lives next to /.ssh/ and holds a header followed by records, each
+// a LUN, sector number and checksum followed by the sector.  Later records
+// for a sector replace earlier ones.  Records are only ever appended, and
+// the log is started again once full.
+#define FC_PATH "/sectors.log"
+#define FC_MAGIC 0x32434657  // "WFC2"
+// Cache hits since a sector was fetched before it is worth keeping.
+#define FC_MIN_HITS 1
+// Most sectors appended per save.
+#define FC_SAVE_BATCH 256
+// Widest run of sectors checked by one request, one checksum each filling
+// the IPC slot buffer.
+#define FC_CSUM_SPAN (IPC_BUF_SIZE / sizeof (uint32_t))
+// Share of the free SPIFFS space the log may take.
+#define FC_SPACE_PERCENT 75
+
+struct fc_header
+{
+  uint32_t magic;
+  uint32_t block_size;
+};
+
+struct fc_rec
+{
+  uint32_t magic;
+  uint32_t block;
+  uint32_t crc;
+  uint8_t lun;
+  uint8_t unused[3];
+};
+
+// A sector found in the log on start-up.
+struct fc_index
+{
+  uint8_t lun;
+  uint32_t block;
+  uint32_t crc;
+  uint32_t pos;
+};
+
+static uint16_t _block_size = 0;
+static uint32_t fc_max_blocks = 0;
+// LUNs whose sectors are saved, having had them checked on start-up.
+static uint32_t fc_luns = 0;
+// Records in the log, and whether it must be started again before appending.
+static uint32_t fc_blocks = 0;
+static bool fc_reset = true;
+static uint8_t *fc_buf;
+
+uint32_t flash_cache_restored = 0, flash_cache_stale = 0, flash_cache_saved = 0;
+
+static int _cmp_index(const void *a, const void *b)
+{
+  const struct fc_index *x = (const struct fc_index*)a;
+  const struct fc_index *y = (const struct fc_index*)b;
+  if (x->lun != y->lun) return x->lun < y->lun ? -1 : 1;
+  if (x->block != y->block) return x->block < y->block ? -1 : 1;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Read the index of the log, returning the number of distinct sectors of
+// the LUN.
+static uint32_t read_index(File &f, uint8_t lun, struct fc_index *index)
+{
+  struct fc_header hdr;
+  struct fc_rec rec;
+  uint32_t n = 0;
+
+  if (f.read((uint8_t*)&hdr, sizeof hdr) != sizeof hdr ||
+    hdr.magic != FC_MAGIC || hdr.block_size != _block_size) return 0;
+  // A short or damaged record marks the end of what was written.
+  while (n < fc_max_blocks &&
+    f.read((uint8_t*)&rec, sizeof rec) == sizeof rec && rec.magic == FC_MAGIC)
+  {
+    index[n].lun = rec.lun;
+    index[n].block = rec.block;
+    index[n].crc = rec.crc;
+    index[n].pos = f.position();
+    n++;
+    if (!f.seek(_block_size, SeekCur)) break;
+  }
+  fc_blocks = n;
+  fc_reset = f.position() != f.size();
+
+  // Keep only the latest record for each sector of the LUN.
+  qsort(index, n, sizeof *index, _cmp_index);
+  uint32_t u = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (index[i].lun != lun) continue;
+    if (u && index[u - 1].block == index[i].block) u--;
+    index[u++] = index[i];
+  }
+  return u;
+}
+
+// Load the sectors still matching the remote host into the cache.  Returns
+// false if the remote host cannot checksum sectors.
+static bool restore(File &f, uint8_t lun, struct fc_index *index, uint32_t n)
+{
+  for (uint32_t i = 0, j; i < n; i = j)
+  {
+    uint32_t first = index[i].block;
+    for (j = i + 1; j < n && index[j].block - first < FC_CSUM_SPAN; j++);
+
+    struct ipc_msg *msg = ipc_alloc(lun, portMAX_DELAY);
+    msg->host_cmd = SECTOR_CHECKSUMS;
+    msg->secsz = _block_size;
+    msg->lba = first;
+    msg->dlen = (index[j - 1].block - first + 1) * sizeof (uint32_t);
+    ipc_submit(msg);
+    ipc_wait(msg);
+    if (!msg->dlen || msg->status)
+    {
+      ipc_free(msg);
+      return false;
+    }
+
+    const uint32_t *crcs = (const uint32_t*)msg->data;
+    for (uint32_t k = i; k < j; k++)
+    {
+      // Check the flash copy too, in case a save was cut short.
+      if (crcs[index[k].block - first] == index[k].crc &&
+        f.seek(index[k].pos) &&
+        f.read(fc_buf, _block_size) == _block_size &&
+        crc32c(0, fc_buf, _block_size) == index[k].crc &&
+        put_persisted_cache_block(lun, index[k].block, fc_buf))
+        flash_cache_restored++;
+      else flash_cache_stale++;
+    }
+    ipc_free(msg);
+  }
+  return true;
+}
+
+uint32_t init_flash_cache(uint8_t lun, uint16_t block_size,
+  uint32_t max_blocks)
+{
+  _block_size = block_size;
+  if (!max_blocks) return 0;
+  uint32_t start = millis();
+  uint32_t restored = flash_cache_restored, stale = flash_cache_stale;
+
+  // Fit in the space left, counting any log already there.
+  File f = SPIFFS.open(FC_PATH, "r");
+  size_t room = SPIFFS.totalBytes() - SPIFFS.usedBytes() + (f ? f.size() : 0);
+  room = room / 100 * FC_SPACE_PERCENT;
+  uint32_t fit = room > sizeof (struct fc_header) ? (room -
+    sizeof (struct fc_header)) / (sizeof (struct fc_rec) + block_size) : 0;
+  fc_max_blocks = max_blocks < fit ? max_blocks : fit;
+
+  if (!fc_buf) fc_buf = (uint8_t*)malloc(block_size);
+  struct fc_index *index =
+    (struct fc_index*)malloc(fc_max_blocks * sizeof *index);
+  fc_luns |= 1 << lun;
+  if (f && fc_buf && index)
+  {
+    uint32_t n = read_index(f, lun, index);
+    if (!restore(f, lun, index, n))
+    {
+      // Nothing can be trusted without checksums, so leave this LUN out.
+      HWSerial.printf("%%FLASH-CACHE Remote host cannot checksum, lun=%u "
+        "disabled\r\n", lun);
+      fc_luns &= ~(1 << lun);
+    }
+  }
+  if (f) f.close();
+  free(index);
+  if (!fc_buf) fc_max_blocks = 0;
+
+  restored = flash_cache_restored - restored;
+  HWSerial.printf("%%FLASH-CACHE lun=%u sectors=%u restored=%u stale=%u "
+    "ms=%u\r\n", lun, fc_max_blocks, restored, flash_cache_stale - stale,
+    millis() - start);
+  return restored;
+}
+
+static bool reset_log(void)
+{
+  struct fc_header hdr = { FC_MAGIC, _block_size };
+
+  SPIFFS.remove(FC_PATH);
+  forget_persisted_cache_blocks();
+  fc_blocks = 0;
+  File f = SPIFFS.open(FC_PATH, "w");
+  if (!f) return false;
+  bool ok = f.write((uint8_t*)&hdr, sizeof hdr) == sizeof hdr;
+  f.close();
+  fc_reset = !ok;
+  return ok;
+}
+
+// Append the newly hot sectors of one LUN.
+static void save_lun(uint8_t lun)
+{
+  static uint32_t block_nums[FC_SAVE_BATCH];
+
+  uint32_t n = get_hot_cache_blocks(lun, block_nums, FC_SAVE_BATCH,
+    FC_MIN_HITS);
+  if (!n) return;
+  if (fc_reset || fc_blocks + n > fc_max_blocks)
+  {
+    if (!reset_log()) return;
+    n = get_hot_cache_blocks(lun, block_nums, FC_SAVE_BATCH, FC_MIN_HITS);
+  }
+
+  File f = SPIFFS.open(FC_PATH, "a");
+  if (!f) return;
+  uint32_t saved = 0;
+  for (uint32_t i = 0; i < n && fc_blocks < fc_max_blocks; i++)
+  {
+    if (!persist_cache_block(lun, block_nums[i], fc_buf)) continue;
+    struct fc_rec rec = { FC_MAGIC, block_nums[i],
+      crc32c(0, fc_buf, _block_size), lun };
+    if (f.write((uint8_t*)&rec, sizeof rec) != sizeof rec ||
+      f.write(fc_buf, _block_size) != _block_size)
+    {
+      // The rest of the log cannot be found again, so start afresh.
+      fc_reset = true;
+      break;
+    }
+    fc_blocks++;
+    saved++;
+  }
+  f.close();
+  flash_cache_saved += saved;
+  //HWSerial.printf("%%FLASH-CACHE lun=%u saved=%u log=%u\r\n", lun, saved,
+  //  fc_blocks);
+}
+
+void flash_cache_save(void)
+{
+  if (!fc_max_blocks) return;
+  for (uint8_t lun = 0; lun < IPC_LUNS; lun++)
+    if (fc_luns & 1 << lun) save_lun(lun);
+}
@@ -0,0 +1,22 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Persistent sector cache in SPIFFS, surviving power cycles.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+
+// Keep up to max_blocks hot sectors in flash, or none if zero, over all
+// LUNs.  Called for each LUN in turn, once its SSH task is ready and after
+// init_cache(), to check the sectors of the LUN saved last time against its
+// remote host and load them into the cache.  Returns the number of sectors
+// restored.
+uint32_t init_flash_cache(uint8_t lun, uint16_t block_size,
+  uint32_t max_blocks);
+
+// Append any newly hot sectors to flash.
+void flash_cache_save(void);
+
+// Totals, in sectors.
+extern uint32_t flash_cache_restored, flash_cache_stale, flash_cache_saved;
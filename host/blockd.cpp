@@ -0,0 +1,842 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host-side block server, run by the device over a single SSH channel.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+//
+// Build and install on the SSH server with:
+//   g++ -O2 -Wall -pthread -o wifimsc-blockd host/blockd.cpp lzblk.cpp crc32c.cpp
+//   install -m 755 wifimsc-blockd /usr/local/bin/
+// Usage: wifimsc-blockd [-f POLICY] [-s SOCKET] BACKING_FILE
+//        wifimsc-blockd -d SOCKET [-c MB] [-f POLICY]
+// Requests are read from stdin and responses written to stdout using the
+// framing in blkproto.h.  It can be tried locally against any file, e.g.
+//   truncate --size 32M /tmp/disk && wifimsc-blockd /tmp/disk
+//
+// With -d it runs as a daemon serving many devices over a unix socket, one
+// thread per channel, with an extent cache of MB megabytes shared by every
+// channel to the same backing file.  With -s each SSH channel opens its
+// backing file, hands it to the daemon over the socket and relays the
+// channel to it, or serves the file itself as above if the daemon is not
+// running.  The daemon only uses files opened by the SSH user, so it needs
+// no access of its own to them.
+//
+// POLICY says when written data is flushed to disk: none, leaving it to the
+// kernel; always, before each write is acknowledged; batch, whenever a
+// channel has no more requests waiting; or a period in milliseconds, for
+// the daemon to flush every file written to since the last period.
+
+#include "../blkproto.h"
+#include "../lzblk.h"
+#include "../crc32c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Largest request accepted, in bytes.
+#define MAX_XFER (16 * 1024 * 1024)
+// Room for chunk headers when a payload is sent in chunks.
+#define MAX_WIRE \
+  (MAX_XFER + MAX_XFER / BLK_CHUNK_SIZE * sizeof (struct blk_chunk))
+// Default daemon extent cache size in megabytes.
+#define CACHE_MB 64
+
+enum sync_policies { SYNC_NONE, SYNC_ALWAYS, SYNC_BATCH, SYNC_TIMER };
+static enum sync_policies sync_policy = SYNC_NONE;
+static unsigned sync_ms = 0;
+
+// A backing file in use by one or more channels.  Files are told apart by
+// device and inode, however they were opened, so that the channels of one
+// device share its cached extents.  Each keeps its own descriptor for the
+// sync timer.
+struct backing
+{
+  dev_t dev;
+  ino_t ino;
+  int fd;
+  uint32_t id;          // Cache key, never reused.
+  uint32_t writes;      // Bumped whenever cached extents are dropped.
+  int refs;
+  bool dirty;
+  struct backing *next;
+};
+
+static struct backing *backings = NULL;
+static uint32_t backing_ids = 0;
+static pthread_mutex_t backings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Extent cache of BLK_CHUNK_SIZE pages of backing files, replaced in clock
+// order, with an open-addressed hash index using linear probing.  Each slot
+// holds an extent index plus one, with zero meaning empty.  Writes drop the
+// extents they overlap rather than update them.
+struct extent
+{
+  uint32_t backing;     // Zero if unused.
+  bool referenced;
+  uint64_t page;
+};
+
+static struct extent *extents = NULL;
+static unsigned char *extent_data = NULL;
+static uint32_t extent_count = 0, extent_hand = 0;
+static uint32_t *extent_slots = NULL, extent_mask = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int read_full(int fd, void *buf, size_t len)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    ssize_t r = read(fd, (char*)buf + total, len - total);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    total += r;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    ssize_t w = write(fd, (const char*)buf + total, len - total);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    total += w;
+  }
+  return 0;
+}
+
+// Write several buffers in full, in one system call where the pipe has room,
+// so that the reader is not woken for each part.
+static int writev_full(int fd, struct iovec *iov, int n)
+{
+  while (n)
+  {
+    ssize_t w = writev(fd, iov, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    for (; n && (size_t)w >= iov->iov_len; iov++, n--) w -= iov->iov_len;
+    if (n)
+    {
+      iov->iov_base = (char*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+// Read from the backing file, zero-filling anything past its end.
+static int pread_full(int fd, unsigned char *buf, size_t len, off_t off)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    ssize_t r = pread(fd, buf + total, len - total, off + total);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) return -1;
+    if (r == 0) { memset(buf + total, 0, len - total); break; }
+    total += r;
+  }
+  return 0;
+}
+
+// As pread_full but skip reading the holes in a sparse backing file, which
+// are known to hold zeros.
+static int pread_sparse(int fd, unsigned char *buf, size_t len, off_t off)
+{
+#ifdef SEEK_DATA
+  off_t pos = off, end = off + len;
+  while (pos < end)
+  {
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) data = end;
+    else if (data < 0) return pread_full(fd, buf + (pos - off), end - pos, pos);
+    if (data > end) data = end;
+    memset(buf + (pos - off), 0, data - pos);
+    if ((pos = data) == end) break;
+
+    off_t hole = lseek(fd, pos, SEEK_HOLE);
+    if (hole < 0 || hole > end) hole = end;
+    if (pread_full(fd, buf + (pos - off), hole - pos, pos)) return -1;
+    pos = hole;
+  }
+  return 0;
+#else
+  return pread_full(fd, buf, len, off);
+#endif
+}
+
+static int pwrite_full(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    ssize_t w = pwrite(fd, buf + total, len - total, off + total);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    total += w;
+  }
+  return 0;
+}
+
+// Zero len bytes of the backing file, punching a hole where the filesystem
+// allows so that the file stays sparse.  zeros must hold len zero bytes.
+static int zero_range(int fd, const unsigned char *zeros, size_t len, off_t off)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len))
+    return 0;
+#endif
+  return pwrite_full(fd, zeros, len, off);
+}
+
+// Encode len bytes as chunks for the flags given, sending zero chunks bare
+// and compressing others unless that saves nothing.  Returns the encoded
+// length.
+static size_t encode_chunks(const unsigned char *buf, size_t len,
+  unsigned char *out, uint8_t flags)
+{
+  size_t o = 0;
+  for (size_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    size_t n = len - done < BLK_CHUNK_SIZE ? len - done : BLK_CHUNK_SIZE;
+    struct blk_chunk chunk;
+    unsigned char *data = out + o + sizeof chunk;
+    int clen = 0;
+    memset(&chunk, 0, sizeof chunk);
+    if (flags & BLK_F_ZERO && blk_is_zero(buf + done, n))
+      chunk.type = BLK_CHUNK_ZERO;
+    else if (flags & BLK_F_LZ &&
+      (clen = lz_compress(buf + done, n, data, n - 1)) > 0)
+    {
+      chunk.type = BLK_CHUNK_LZ;
+      chunk.len = clen;
+    }
+    else
+    {
+      chunk.type = BLK_CHUNK_RAW;
+      chunk.len = n;
+      memcpy(data, buf + done, n);
+    }
+    memcpy(out + o, &chunk, sizeof chunk);
+    o += sizeof chunk + chunk.len;
+  }
+  return o;
+}
+
+// Read len bytes sent as chunks from fd, noting which chunks were zeros.
+static int read_chunks(int fd, unsigned char *buf, size_t len, bool *zero)
+{
+  unsigned char data[BLK_CHUNK_SIZE];
+  for (size_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    size_t n = len - done < BLK_CHUNK_SIZE ? len - done : BLK_CHUNK_SIZE;
+    struct blk_chunk chunk;
+    if (read_full(fd, &chunk, sizeof chunk)) return -1;
+    zero[done / BLK_CHUNK_SIZE] = chunk.type == BLK_CHUNK_ZERO;
+    if (chunk.type == BLK_CHUNK_ZERO && chunk.len == 0)
+      memset(buf + done, 0, n);
+    else if (chunk.type == BLK_CHUNK_RAW && chunk.len == n)
+    {
+      if (read_full(fd, buf + done, n)) return -1;
+    }
+    else if (chunk.type == BLK_CHUNK_LZ && chunk.len <= sizeof data)
+    {
+      if (read_full(fd, data, chunk.len)) return -1;
+      if (lz_decompress(data, chunk.len, buf + done, n) != (int)n) return -1;
+    }
+    else return -1;
+  }
+  return 0;
+}
+
+// Write len bytes, punching holes for the runs of chunks marked zero.
+static int write_chunks(int fd, const unsigned char *buf, size_t len,
+  off_t off, const bool *zero)
+{
+  size_t start = 0;
+  while (start < len)
+  {
+    size_t c = start / BLK_CHUNK_SIZE, end = start;
+    while (end < len && zero[end / BLK_CHUNK_SIZE] == zero[c])
+      end += BLK_CHUNK_SIZE;
+    if (end > len) end = len;
+    if (zero[c] ? zero_range(fd, buf + start, end - start, off + start) :
+      pwrite_full(fd, buf + start, end - start, off + start)) return -1;
+    start = end;
+  }
+  return 0;
+}
+
+static void cache_init(size_t bytes)
+{
+  uint32_t bits;
+  extent_count = bytes / BLK_CHUNK_SIZE;
+  if (!extent_count) return;
+  // Keep the hash index at most half full.
+  for (bits = 1; (1UL << bits) < 2UL * extent_count; bits++);
+  extent_mask = (1UL << bits) - 1;
+  extents = (struct extent*)calloc(extent_count, sizeof *extents);
+  extent_data = (unsigned char*)malloc((size_t)extent_count * BLK_CHUNK_SIZE);
+  extent_slots = (uint32_t*)calloc(extent_mask + 1, sizeof *extent_slots);
+  if (!extents || !extent_data || !extent_slots) extent_count = 0;
+}
+
+static uint32_t extent_hash(uint32_t backing, uint64_t page)
+{
+  return (uint32_t)((page * 0x9E3779B97F4A7C15ULL + backing) >> 32) &
+    extent_mask;
+}
+
+// Returns the slot holding the extent, or the empty slot where it would go.
+static uint32_t extent_slot(uint32_t backing, uint64_t page)
+{
+  uint32_t s = extent_hash(backing, page);
+  for (; extent_slots[s]; s = (s + 1) & extent_mask)
+  {
+    const struct extent *e = &extents[extent_slots[s] - 1];
+    if (e->backing == backing && e->page == page) break;
+  }
+  return s;
+}
+
+static void extent_remove(uint32_t s)
+{
+  extents[extent_slots[s] - 1].backing = 0;
+
+  // Shift back any later entries in the probe run so that no tombstones are
+  // needed and lookups stay short.
+  uint32_t gap = s;
+  for (s = (s + 1) & extent_mask; extent_slots[s]; s = (s + 1) & extent_mask)
+  {
+    const struct extent *e = &extents[extent_slots[s] - 1];
+    uint32_t home = extent_hash(e->backing, e->page);
+    if (((s - home) & extent_mask) >= ((s - gap) & extent_mask))
+    {
+      extent_slots[gap] = extent_slots[s];
+      gap = s;
+    }
+  }
+  extent_slots[gap] = 0;
+}
+
+// Cache a page just read, unless the file was written since.  Called with
+// the cache locked.
+static void extent_add(struct backing *b, uint64_t page,
+  const unsigned char *data, uint32_t writes)
+{
+  uint32_t s = extent_slot(b->id, page);
+  if (extent_slots[s] || b->writes != writes) return;
+
+  // Give each referenced extent a second chance before replacing it.
+  struct extent *e;
+  while ((e = &extents[extent_hand])->backing && e->referenced)
+  {
+    e->referenced = false;
+    extent_hand = (extent_hand + 1) % extent_count;
+  }
+  uint32_t x = extent_hand;
+  extent_hand = (extent_hand + 1) % extent_count;
+  if (e->backing) extent_remove(extent_slot(e->backing, e->page));
+  s = extent_slot(b->id, page);
+  e->backing = b->id;
+  e->page = page;
+  e->referenced = false;
+  memcpy(extent_data + (size_t)x * BLK_CHUNK_SIZE, data, BLK_CHUNK_SIZE);
+  extent_slots[s] = x + 1;
+}
+
+// Copy into buf the part of a page's data within the len bytes at off.
+static void page_copy(unsigned char *buf, size_t len, off_t off,
+  uint64_t page, const unsigned char *data)
+{
+  off_t start = page * BLK_CHUNK_SIZE, end = start + BLK_CHUNK_SIZE;
+  if (start < off) start = off;
+  if (end > off + (off_t)len) end = off + len;
+  memcpy(buf + (start - off), data + (start - page * BLK_CHUNK_SIZE),
+    end - start);
+}
+
+// As pread_sparse, but through the extent cache if there is one.  Cached
+// pages are copied out, and the rest noted, under one lock, and only the
+// pages noted are read from the file.
+static int cache_read(struct backing *b, int fd, unsigned char *buf,
+  size_t len, off_t off)
+{
+  if (!extent_count) return pread_sparse(fd, buf, len, off);
+  if (!len) return 0;
+
+  uint64_t first = off / BLK_CHUNK_SIZE;
+  size_t pages = (off + len - 1) / BLK_CHUNK_SIZE - first + 1;
+  bool missed[pages];
+  pthread_mutex_lock(&cache_lock);
+  uint32_t writes = b->writes;
+  for (size_t p = 0; p < pages; p++)
+  {
+    uint32_t s = extent_slot(b->id, first + p);
+    if ((missed[p] = !extent_slots[s])) continue;
+    uint32_t x = extent_slots[s] - 1;
+    extents[x].referenced = true;
+    page_copy(buf, len, off, first + p,
+      extent_data + (size_t)x * BLK_CHUNK_SIZE);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  unsigned char page_buf[BLK_CHUNK_SIZE];
+  for (size_t p = 0; p < pages; p++)
+  {
+    if (!missed[p]) continue;
+    if (pread_sparse(fd, page_buf, BLK_CHUNK_SIZE,
+      (first + p) * BLK_CHUNK_SIZE)) return -1;
+    page_copy(buf, len, off, first + p, page_buf);
+    pthread_mutex_lock(&cache_lock);
+    extent_add(b, first + p, page_buf, writes);
+    pthread_mutex_unlock(&cache_lock);
+  }
+  return 0;
+}
+
+// Drop cached extents overlapping a write, before it is acknowledged.
+static void cache_forget(struct backing *b, off_t off, size_t len)
+{
+  if (!extent_count || !len) return;
+
+  pthread_mutex_lock(&cache_lock);
+  b->writes++;
+  for (uint64_t page = off / BLK_CHUNK_SIZE;
+    page <= (off + len - 1) / BLK_CHUNK_SIZE; page++)
+  {
+    uint32_t s = extent_slot(b->id, page);
+    if (extent_slots[s]) extent_remove(s);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// Note that a write has landed, so it is flushed later and any cache fill
+// that may have read the old data meanwhile is refused.
+static void backing_written(struct backing *b)
+{
+  if (extent_count)
+  {
+    pthread_mutex_lock(&cache_lock);
+    b->writes++;
+    pthread_mutex_unlock(&cache_lock);
+  }
+  __atomic_store_n(&b->dirty, true, __ATOMIC_RELEASE);
+}
+
+// Find or add the backing file open on fd.
+static struct backing *backing_get(int fd)
+{
+  struct stat st;
+  struct backing *b;
+  if (fstat(fd, &st)) return NULL;
+
+  pthread_mutex_lock(&backings_lock);
+  for (b = backings; b; b = b->next)
+    if (b->dev == st.st_dev && b->ino == st.st_ino) break;
+  if (!b && (b = (struct backing*)calloc(1, sizeof *b)))
+  {
+    b->dev = st.st_dev;
+    b->ino = st.st_ino;
+    b->id = ++backing_ids;
+    b->fd = dup(fd);
+    b->next = backings;
+    backings = b;
+  }
+  if (b) b->refs++;
+  pthread_mutex_unlock(&backings_lock);
+  return b;
+}
+
+static void backing_put(struct backing *b)
+{
+  pthread_mutex_lock(&backings_lock);
+  if (!--b->refs)
+  {
+    struct backing **p = &backings;
+    while (*p != b) p = &(*p)->next;
+    *p = b->next;
+    if (b->dirty && sync_policy != SYNC_NONE) fdatasync(b->fd);
+    close(b->fd);
+    free(b);
+  }
+  pthread_mutex_unlock(&backings_lock);
+}
+
+// Flush the backing file if written since last flushed.
+static int backing_sync(struct backing *b, int fd)
+{
+  if (!__atomic_exchange_n(&b->dirty, false, __ATOMIC_ACQ_REL)) return 0;
+  return fdatasync(fd);
+}
+
+static void *sync_timer(void *)
+{
+  while (1)
+  {
+    usleep(sync_ms * 1000);
+    pthread_mutex_lock(&backings_lock);
+    for (struct backing *b = backings; b; b = b->next) backing_sync(b, b->fd);
+    pthread_mutex_unlock(&backings_lock);
+  }
+  return NULL;
+}
+
+// Flush the backing file once a write has landed, if the policy says to
+// before it is acknowledged: always, or in batch mode when no further
+// request is waiting, so that the write ending a batch is only
+// acknowledged once the whole batch is on disk.
+static int write_sync(struct backing *b, int fd, struct pollfd *pending)
+{
+  if (sync_policy == SYNC_ALWAYS ||
+    (sync_policy == SYNC_BATCH && !poll(pending, 1, 0)))
+    return backing_sync(b, fd);
+  return 0;
+}
+
+// Serve one channel's requests from in, responding on out, until either
+// end closes.  Returns non-zero on a failure to set up.
+static int serve(int in, int out, int fd)
+{
+  struct stat st;
+  struct backing *b;
+  if (fstat(fd, &st) || !(b = backing_get(fd))) return 1;
+
+  struct blk_hello hello;
+  memset(&hello, 0, sizeof hello);
+  hello.magic = BLK_MAGIC;
+  hello.version = BLK_VERSION;
+  hello.features = BLK_FEAT_LZ | BLK_FEAT_ZERO | BLK_FEAT_CSUM | BLK_FEAT_CRC;
+  hello.size = st.st_size;
+
+  unsigned char *buf = (unsigned char*)malloc(MAX_XFER);
+  unsigned char *wire = (unsigned char*)malloc(MAX_WIRE);
+  bool *zero = (bool*)calloc(MAX_XFER / BLK_CHUNK_SIZE, sizeof *zero);
+  if (!buf || !wire || !zero || write_full(out, &hello, sizeof hello))
+  {
+    free(zero);
+    free(wire);
+    free(buf);
+    backing_put(b);
+    return 1;
+  }
+
+  struct blk_req req;
+  struct pollfd pending = { in, POLLIN, 0 };
+  bool sync_failed = false;
+  while (1)
+  {
+    // A batch ending in a read is flushed once no further request is
+    // waiting.  Its writes were acknowledged already, so a failure is
+    // reported on the next write instead.
+    if (sync_policy == SYNC_BATCH && __atomic_load_n(&b->dirty,
+      __ATOMIC_ACQUIRE) && !poll(&pending, 1, 0) && backing_sync(b, fd))
+      sync_failed = true;
+    if (read_full(in, &req, sizeof req)) break;
+
+    struct blk_rsp rsp;
+    memset(&rsp, 0, sizeof rsp);
+    rsp.op = req.op;
+
+    size_t len = (size_t)req.count * req.secsz;
+    off_t off = (off_t)req.lba * req.secsz;
+    if (!req.secsz || len > MAX_XFER) rsp.status = BLK_EINVAL;
+
+    if (req.op == BLK_READ)
+    {
+      unsigned char *payload = buf;
+      uint8_t chunked = req.flags & (BLK_F_LZ | BLK_F_ZERO);
+      if (!rsp.status && cache_read(b, fd, buf, len, off)) rsp.status = BLK_EIO;
+      if (!rsp.status) rsp.dlen = len;
+      if (!rsp.status && chunked)
+      {
+        rsp.flags = chunked;
+        rsp.dlen = encode_chunks(buf, len, wire, chunked);
+        payload = wire;
+      }
+      uint32_t crc = 0;
+      if (!rsp.status && req.flags & BLK_F_CRC)
+      {
+        rsp.flags |= BLK_F_CRC;
+        crc = crc32c(0, buf, len);
+      }
+      struct iovec iov[3] = { { &rsp, sizeof rsp }, { payload, rsp.dlen },
+        { &crc, rsp.flags & BLK_F_CRC ? sizeof crc : 0 } };
+      if (writev_full(out, iov, 3)) break;
+    }
+    else if (req.op == BLK_WRITE)
+    {
+      // A refused payload cannot be skipped reliably, so hang up instead.
+      if (rsp.status) break;
+      bool chunked = req.flags & (BLK_F_LZ | BLK_F_ZERO);
+      if (chunked ? read_chunks(in, buf, len, zero) : read_full(in, buf, len))
+        break;
+      uint32_t crc;
+      if (req.flags & BLK_F_CRC)
+      {
+        if (read_full(in, &crc, sizeof crc)) break;
+        if (crc != crc32c(0, buf, len)) rsp.status = BLK_ECRC;
+      }
+      if (!rsp.status)
+      {
+        cache_forget(b, off, len);
+        if (chunked ? write_chunks(fd, buf, len, off, zero) :
+          pwrite_full(fd, buf, len, off)) rsp.status = BLK_EIO;
+        backing_written(b);
+      }
+      if (!rsp.status && (write_sync(b, fd, &pending) || sync_failed))
+      {
+        rsp.status = BLK_EIO;
+        sync_failed = false;
+      }
+      if (write_full(out, &rsp, sizeof rsp)) break;
+    }
+    else if (req.op == BLK_DISCARD)
+    {
+      if (!rsp.status)
+      {
+        memset(buf, 0, len);
+        cache_forget(b, off, len);
+        if (zero_range(fd, buf, len, off)) rsp.status = BLK_EIO;
+        backing_written(b);
+      }
+      if (!rsp.status && (write_sync(b, fd, &pending) || sync_failed))
+      {
+        rsp.status = BLK_EIO;
+        sync_failed = false;
+      }
+      if (write_full(out, &rsp, sizeof rsp)) break;
+    }
+    else if (req.op == BLK_CSUM)
+    {
+      if (!rsp.status && cache_read(b, fd, buf, len, off)) rsp.status = BLK_EIO;
+      if (!rsp.status)
+      {
+        uint32_t *crcs = (uint32_t*)wire;
+        for (uint32_t s = 0; s < req.count; s++)
+          crcs[s] = crc32c(0, buf + (size_t)s * req.secsz, req.secsz);
+        rsp.dlen = req.count * sizeof *crcs;
+      }
+      if (write_full(out, &rsp, sizeof rsp)) break;
+      if (rsp.dlen && write_full(out, wire, rsp.dlen)) break;
+    }
+    else
+    {
+      rsp.status = BLK_EINVAL;
+      if (write_full(out, &rsp, sizeof rsp)) break;
+    }
+  }
+
+  free(zero);
+  free(wire);
+  free(buf);
+  backing_put(b);
+  return 0;
+}
+
+// Send or receive a descriptor over a unix socket.
+static int send_fd(int sock, int fd)
+{
+  char byte = 0, control[CMSG_SPACE(sizeof fd)];
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  memset(control, 0, sizeof control);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+  return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock)
+{
+  char byte, control[CMSG_SPACE(sizeof (int))];
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg;
+  int fd = -1;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  if (recvmsg(sock, &msg, 0) != 1) return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+    cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof fd))
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+  return fd;
+}
+
+static void *serve_client(void *arg)
+{
+  int sock = (int)(intptr_t)arg, fd = recv_fd(sock);
+  if (fd >= 0)
+  {
+    serve(sock, sock, fd);
+    close(fd);
+  }
+  close(sock);
+  return NULL;
+}
+
+static int run_daemon(const char *path, const char *prog)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path)
+  {
+    fprintf(stderr, "%s: %s: Socket path too long\n", prog, path);
+    return 2;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof addr) ||
+    listen(sock, 16))
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    return 1;
+  }
+
+  pthread_t thread;
+  if (sync_policy == SYNC_TIMER)
+    pthread_create(&thread, NULL, sync_timer, NULL);
+  while (1)
+  {
+    int client = accept(sock, NULL, NULL);
+    if (client < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+      return 1;
+    }
+    if (pthread_create(&thread, NULL, serve_client, (void*)(intptr_t)client))
+      close(client);
+    else pthread_detach(thread);
+  }
+}
+
+// Hand fd to the daemon and relay stdin and stdout to it until both
+// directions are done.  Returns non-zero, having sent nothing, if the daemon
+// cannot be reached.
+static int relay(const char *path, int fd)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) return -1;
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+  if (connect(sock, (struct sockaddr*)&addr, sizeof addr) || send_fd(sock, fd))
+  {
+    close(sock);
+    return -1;
+  }
+
+  static unsigned char data[65536];
+  struct pollfd fds[2] = { { 0, POLLIN, 0 }, { sock, POLLIN, 0 } };
+  while (fds[1].fd >= 0 && poll(fds, 2, -1) >= 0)
+    for (int i = 0; i < 2; i++)
+    {
+      if (fds[i].fd < 0 || !fds[i].revents) continue;
+      ssize_t r = read(fds[i].fd, data, sizeof data);
+      if (r < 0 && errno == EINTR) continue;
+      if (r > 0 && !write_full(i ? 1 : sock, data, r)) continue;
+      // Pass on the end of the requests, and stop at the end of responses.
+      if (!i) shutdown(sock, SHUT_WR);
+      fds[i].fd = -1;
+    }
+  close(sock);
+  return 0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-f POLICY] [-s SOCKET] BACKING_FILE\n"
+    "       %s -d SOCKET [-c MB] [-f POLICY]\n"
+    "POLICY is none, always, batch or a period in milliseconds.\n",
+    prog, prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *daemon_path = NULL, *relay_path = NULL;
+  size_t cache_mb = CACHE_MB;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:d:f:s:")) != -1)
+    switch (opt)
+    {
+      case 'c':
+        cache_mb = strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        daemon_path = optarg;
+        break;
+      case 'f':
+        if (!strcmp(optarg, "none")) sync_policy = SYNC_NONE;
+        else if (!strcmp(optarg, "always")) sync_policy = SYNC_ALWAYS;
+        else if (!strcmp(optarg, "batch")) sync_policy = SYNC_BATCH;
+        else if ((sync_ms = strtoul(optarg, NULL, 10)))
+          sync_policy = SYNC_TIMER;
+        else usage(argv[0]);
+        break;
+      case 's':
+        relay_path = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  signal(SIGPIPE, SIG_IGN);
+
+  if (daemon_path)
+  {
+    if (optind != argc || relay_path) usage(argv[0]);
+    cache_init(cache_mb * 1024 * 1024);
+    return run_daemon(daemon_path, argv[0]);
+  }
+  // The timer needs the daemon, so serving alone the nearest is a batch.
+  if (optind != argc - 1) usage(argv[0]);
+  if (sync_policy == SYNC_TIMER) sync_policy = SYNC_BATCH;
+
+  int fd = open(argv[optind], O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+    return 1;
+  }
+  if (relay_path && !relay(relay_path, fd)) return 0;
+  if (serve(0, 1, fd))
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,465 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Load generator for the block server, standing in for many devices.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+//
+// Built by make in this directory.
+// Usage: wifimsc-loadgen [-n DEVICES] [-c CHANNELS] [-q DEPTH] [-k KB]
+//          [-w PERCENT] [-m MB] [-t SECONDS] SERVER [ARG...]
+// Each device has a backing file of MB megabytes of its own, in a new
+// directory under /tmp, and CHANNELS channels to it.  Each channel runs
+// SERVER ARG... BACKING_FILE, as the device does over SSH, and keeps DEPTH
+// requests of KB kilobytes in flight to random places in its own part of
+// the disk, PERCENT of them writes.  Requests carry checksums, and are
+// compressed and zero-suppressed, as the device sends them.  Every read is
+// checked against what was last written there.  To load the daemon, e.g.
+//   wifimsc-blockd -d /tmp/wifimsc.sock -c 64 &
+//   wifimsc-loadgen -n 16 wifimsc-blockd -s /tmp/wifimsc.sock
+// Throughput, latency and errors are reported for each device and in
+// total, and the exit status is non-zero if any read was wrong.
+
+#include "../blkproto.h"
+#include "../lzblk.h"
+#include "../crc32c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define SECTOR_SIZE 512
+#define MAX_DEPTH 16
+
+// One request in flight, with the data a read should return.
+struct inflight
+{
+  struct blk_req req;
+  uint64_t sent_us;
+  unsigned char *expect;
+};
+
+struct channel
+{
+  int dev, to, from;
+  pid_t pid;
+  uint64_t first_lba, sectors;
+  unsigned char *model;         // What its part of the disk should hold.
+  uint64_t rng;
+
+  // Requests sent and not yet answered, oldest first.
+  struct inflight q[MAX_DEPTH];
+  int head, queued;
+  bool done;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  uint64_t reads, writes, read_bytes, write_bytes, errors;
+  std::vector<uint32_t> latency_us;
+};
+
+static int devices = 1, channels = 2, depth = 4, xfer_kb = 64,
+  write_pc = 30, disk_mb = 16, seconds = 5;
+static char **server_argv;
+static int server_argc;
+static uint64_t deadline_us;
+
+static uint64_t now_us(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static uint64_t rand64(uint64_t *s)
+{
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    ssize_t r = read(fd, (char*)buf + total, len - total);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    total += r;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    ssize_t w = write(fd, (const char*)buf + total, len - total);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    total += w;
+  }
+  return 0;
+}
+
+// Sector data such as a disk holds: chunks of zeros, of text that
+// compresses, and of random bytes that do not.
+static void fill(uint64_t *rng, unsigned char *buf, size_t len)
+{
+  for (size_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    uint64_t kind = rand64(rng) % 4;
+    for (size_t i = done; i < len && i < done + BLK_CHUNK_SIZE; i++)
+      buf[i] = kind == 0 ? 0 : kind == 1 ? "wifi msc "[i % 9] :
+        rand64(rng);
+  }
+}
+
+// Encode a write payload as chunks, followed by its checksum.
+static size_t encode(const unsigned char *buf, size_t len, unsigned char *out)
+{
+  size_t o = 0;
+  for (size_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    size_t n = std::min(len - done, (size_t)BLK_CHUNK_SIZE);
+    struct blk_chunk chunk = { 0, 0, 0 };
+    unsigned char *data = out + o + sizeof chunk;
+    int clen = 0;
+    if (blk_is_zero(buf + done, n)) chunk.type = BLK_CHUNK_ZERO;
+    else if ((clen = lz_compress(buf + done, n, data, n - 1)) > 0)
+    {
+      chunk.type = BLK_CHUNK_LZ;
+      chunk.len = clen;
+    }
+    else
+    {
+      chunk.type = BLK_CHUNK_RAW;
+      chunk.len = n;
+      memcpy(data, buf + done, n);
+    }
+    memcpy(out + o, &chunk, sizeof chunk);
+    o += sizeof chunk + chunk.len;
+  }
+  uint32_t crc = crc32c(0, buf, len);
+  memcpy(out + o, &crc, sizeof crc);
+  return o + sizeof crc;
+}
+
+static int decode(int fd, unsigned char *buf, size_t len)
+{
+  unsigned char data[BLK_CHUNK_SIZE];
+  for (size_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    size_t n = std::min(len - done, (size_t)BLK_CHUNK_SIZE);
+    struct blk_chunk chunk;
+    if (read_full(fd, &chunk, sizeof chunk)) return -1;
+    if (chunk.type == BLK_CHUNK_ZERO && !chunk.len) memset(buf + done, 0, n);
+    else if (chunk.type == BLK_CHUNK_RAW && chunk.len == n)
+    {
+      if (read_full(fd, buf + done, n)) return -1;
+    }
+    else if (chunk.type == BLK_CHUNK_LZ && chunk.len <= sizeof data)
+    {
+      if (read_full(fd, data, chunk.len) ||
+        lz_decompress(data, chunk.len, buf + done, n) != (int)n) return -1;
+    }
+    else return -1;
+  }
+  return 0;
+}
+
+// Start the server for a channel on pipes, as the device would over SSH.
+static int start_server(struct channel *c, const char *backing_file)
+{
+  int to[2], from[2];
+  // Other channels' servers must not hold this one's pipes open.
+  if (pipe2(to, O_CLOEXEC) || pipe2(from, O_CLOEXEC)) return -1;
+  if (!(c->pid = fork()))
+  {
+    char *argv[server_argc + 2];
+    memcpy(argv, server_argv, server_argc * sizeof *argv);
+    argv[server_argc] = (char*)backing_file;
+    argv[server_argc + 1] = NULL;
+    dup2(to[0], 0);
+    dup2(from[1], 1);
+    close(to[0]);
+    close(to[1]);
+    close(from[0]);
+    close(from[1]);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(to[0]);
+  close(from[1]);
+  c->to = to[1];
+  c->from = from[0];
+
+  struct blk_hello hello;
+  if (c->pid < 0 || read_full(c->from, &hello, sizeof hello) ||
+    hello.magic != BLK_MAGIC || hello.version != BLK_VERSION ||
+    (hello.features & (BLK_FEAT_LZ | BLK_FEAT_ZERO | BLK_FEAT_CRC)) !=
+    (BLK_FEAT_LZ | BLK_FEAT_ZERO | BLK_FEAT_CRC)) return -1;
+  return 0;
+}
+
+// Send requests, keeping up to depth in flight, until the deadline.
+static void *sender(void *arg)
+{
+  struct channel *c = (struct channel*)arg;
+  uint32_t count = xfer_kb * 1024 / SECTOR_SIZE;
+  size_t len = (size_t)count * SECTOR_SIZE;
+  unsigned char *data = (unsigned char*)malloc(len);
+  unsigned char *wire = (unsigned char*)malloc(len + len / BLK_CHUNK_SIZE *
+    sizeof (struct blk_chunk) + BLK_CHUNK_SIZE);
+
+  while (now_us() < deadline_us)
+  {
+    pthread_mutex_lock(&c->lock);
+    while (c->queued == depth && !c->done)
+      pthread_cond_wait(&c->changed, &c->lock);
+    bool failed = c->done;
+    struct inflight *f = &c->q[(c->head + c->queued) % depth];
+    pthread_mutex_unlock(&c->lock);
+    if (failed) break;
+
+    struct blk_req *req = &f->req;
+    uint64_t offset = rand64(&c->rng) % (c->sectors / count) * count;
+    unsigned char *model = c->model + offset * SECTOR_SIZE;
+    req->op = rand64(&c->rng) % 100 < (uint64_t)write_pc ? BLK_WRITE :
+      BLK_READ;
+    req->flags = BLK_F_LZ | BLK_F_ZERO | BLK_F_CRC;
+    req->secsz = SECTOR_SIZE;
+    req->count = count;
+    req->lba = c->first_lba + offset;
+    size_t wlen = 0;
+    if (req->op == BLK_WRITE)
+    {
+      fill(&c->rng, data, len);
+      memcpy(model, data, len);
+      wlen = encode(data, len, wire);
+    }
+    else memcpy(f->expect, model, len);
+
+    f->sent_us = now_us();
+    pthread_mutex_lock(&c->lock);
+    c->queued++;
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+    if (write_full(c->to, req, sizeof *req) ||
+      (wlen && write_full(c->to, wire, wlen))) break;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->done = true;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+  free(wire);
+  free(data);
+  return NULL;
+}
+
+// Collect the responses in order and check them.
+static void *receiver(void *arg)
+{
+  struct channel *c = (struct channel*)arg;
+  size_t len = (size_t)xfer_kb * 1024;
+  unsigned char *buf = (unsigned char*)malloc(len);
+
+  while (1)
+  {
+    pthread_mutex_lock(&c->lock);
+    while (!c->queued && !c->done) pthread_cond_wait(&c->changed, &c->lock);
+    bool idle = !c->queued;
+    struct inflight *f = &c->q[c->head];
+    pthread_mutex_unlock(&c->lock);
+    if (idle) break;
+
+    struct blk_rsp rsp;
+    bool ok = !read_full(c->from, &rsp, sizeof rsp) && rsp.op == f->req.op &&
+      rsp.status == BLK_OK;
+    if (ok && f->req.op == BLK_READ)
+    {
+      uint32_t crc = 0;
+      ok = (rsp.flags & (BLK_F_LZ | BLK_F_ZERO) ? !decode(c->from, buf, len) :
+        rsp.dlen == len && !read_full(c->from, buf, len)) &&
+        rsp.flags & BLK_F_CRC && !read_full(c->from, &crc, sizeof crc) &&
+        crc == crc32c(0, buf, len) && !memcmp(buf, f->expect, len);
+      c->reads++;
+      c->read_bytes += len;
+    }
+    else if (ok)
+    {
+      c->writes++;
+      c->write_bytes += len;
+    }
+    c->latency_us.push_back(now_us() - f->sent_us);
+    if (!ok)
+    {
+      fprintf(stderr, "Device %d: %s of lba %llu failed\n", c->dev,
+        f->req.op == BLK_READ ? "read" : "write",
+        (unsigned long long)f->req.lba);
+      c->errors++;
+      // The stream may be out of step, so give up on the channel.
+      close(c->from);
+      c->from = -1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->head = (c->head + 1) % depth;
+    c->queued--;
+    if (!ok) c->done = true;
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+    if (!ok) break;
+  }
+  free(buf);
+  return NULL;
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, int pc)
+{
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[(v.size() - 1) * pc / 100];
+}
+
+static void report(const char *name, struct channel *c, int n, double secs)
+{
+  uint64_t reads = 0, writes = 0, rbytes = 0, wbytes = 0, errors = 0;
+  std::vector<uint32_t> lat;
+  for (int i = 0; i < n; i++)
+  {
+    reads += c[i].reads;
+    writes += c[i].writes;
+    rbytes += c[i].read_bytes;
+    wbytes += c[i].write_bytes;
+    errors += c[i].errors;
+    lat.insert(lat.end(), c[i].latency_us.begin(), c[i].latency_us.end());
+  }
+  printf("%s reads=%llu writes=%llu rd-MBps=%.1f wr-MBps=%.1f "
+    "p50-us=%u p99-us=%u errors=%llu\n", name, (unsigned long long)reads,
+    (unsigned long long)writes, rbytes / secs / 1e6, wbytes / secs / 1e6,
+    percentile(lat, 50), percentile(lat, 99), (unsigned long long)errors);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-n DEVICES] [-c CHANNELS] [-q DEPTH] [-k KB] "
+    "[-w PERCENT]\n         [-m MB] [-t SECONDS] SERVER [ARG...]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "+n:c:q:k:w:m:t:")) != -1)
+    switch (opt)
+    {
+      case 'n': devices = atoi(optarg); break;
+      case 'c': channels = atoi(optarg); break;
+      case 'q': depth = atoi(optarg); break;
+      case 'k': xfer_kb = atoi(optarg); break;
+      case 'w': write_pc = atoi(optarg); break;
+      case 'm': disk_mb = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  uint64_t part = (uint64_t)disk_mb * 1024 * 1024 / SECTOR_SIZE /
+    (channels > 0 ? channels : 1);
+  if (optind == argc || devices < 1 || channels < 1 || depth < 1 ||
+    depth > MAX_DEPTH || xfer_kb < 1 || xfer_kb > 1024 || write_pc < 0 ||
+    write_pc > 100 || part < (uint64_t)xfer_kb * 1024 / SECTOR_SIZE)
+    usage(argv[0]);
+  server_argv = argv + optind;
+  server_argc = argc - optind;
+  signal(SIGPIPE, SIG_IGN);
+
+  char dir[] = "/tmp/wifimsc-loadgen-XXXXXX";
+  if (!mkdtemp(dir))
+  {
+    perror(dir);
+    return 1;
+  }
+  int n = devices * channels;
+  struct channel *chans = new struct channel[n]();
+  std::vector<std::string> files;
+  for (int d = 0; d < devices; d++)
+  {
+    files.push_back(std::string(dir) + "/disk" + std::to_string(d));
+    int fd = open(files[d].c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)disk_mb * 1024 * 1024))
+    {
+      perror(files[d].c_str());
+      return 1;
+    }
+    close(fd);
+  }
+
+  int rc = 0;
+  for (int i = 0; i < n; i++)
+  {
+    struct channel *c = &chans[i];
+    c->dev = i / channels;
+    c->sectors = part;
+    c->first_lba = i % channels * part;
+    c->model = (unsigned char*)calloc(part, SECTOR_SIZE);
+    c->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    for (int q = 0; q < depth; q++)
+      c->q[q].expect = (unsigned char*)malloc(xfer_kb * 1024);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->changed, NULL);
+    if (start_server(c, files[c->dev].c_str()))
+    {
+      fprintf(stderr, "Device %d: Block server did not start\n", c->dev);
+      rc = 1;
+    }
+  }
+
+  std::vector<pthread_t> threads(2 * n);
+  uint64_t start = now_us();
+  deadline_us = start + seconds * 1000000ULL;
+  for (int i = 0; i < n && !rc; i++)
+  {
+    pthread_create(&threads[2 * i], NULL, sender, &chans[i]);
+    pthread_create(&threads[2 * i + 1], NULL, receiver, &chans[i]);
+  }
+  for (int i = 0; i < n && !rc; i++)
+  {
+    pthread_join(threads[2 * i], NULL);
+    pthread_join(threads[2 * i + 1], NULL);
+  }
+  double secs = (now_us() - start) / 1e6;
+
+  for (int i = 0; i < n; i++)
+  {
+    close(chans[i].to);
+    if (chans[i].from >= 0) close(chans[i].from);
+    if (chans[i].pid > 0) waitpid(chans[i].pid, NULL, 0);
+  }
+  uint64_t errors = 0;
+  for (int d = 0; d < devices && !rc; d++)
+  {
+    char name[32];
+    snprintf(name, sizeof name, "device=%d", d);
+    report(name, chans + d * channels, channels, secs);
+    for (int c = 0; c < channels; c++) errors += chans[d * channels + c].errors;
+  }
+  if (!rc) report("total", chans, n, secs);
+  for (int d = 0; d < devices; d++) unlink(files[d].c_str());
+  rmdir(dir);
+  return rc || errors ? 1 : 0;
+}
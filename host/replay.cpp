@@ -0,0 +1,186 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Replays USB request streams through the firmware in the simulator.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+//
+// Built by make in this directory.
+// Usage: wifimsc-replay [-w WORKLOAD | -f LOG] [-s MB] [-c SECTORS]
+//          [-W SECTORS] [-P SECTORS] [-r RTT_US] [-b KBPS] [-t] [-v]
+// Plays the USB host with a made-up WORKLOAD (fat32-copy, boot or
+// random4k) on a disk of MB megabytes, or with the trace dumped by typing
+// t on the device's serial console, saved in LOG.  The firmware has a cache
+// of SECTORS, write-back and metadata pinning as DISK_WRITE_BACK and
+// DISK_PIN_METADATA would set, and a remote host RTT_US away over a link of
+// KBPS kilobytes per second, serving a backing file under /tmp.  With -t a
+// trace is replayed at its own pace, otherwise as fast as it will go, and
+// -v shows the serial console.  Throughput, latency, cache hit ratios and
+// the requests the remote host served are reported.
+
+#include "sim.h"
+#include "workload.h"
+#include "cache.h"
+#include "Arduino.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+static uint32_t percentile(std::vector<uint32_t> &v, int pc)
+{
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[(v.size() - 1) * pc / 100];
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-w WORKLOAD | -f LOG] [-s MB] [-c SECTORS] "
+    "[-W SECTORS]\n         [-P SECTORS] [-r RTT_US] [-b KBPS] [-t] [-v]\n",
+    prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *workload = "fat32-copy", *log = NULL;
+  uint32_t disk_mb = 128, cache = 8192, rtt_us = 2000, kbps = 1000;
+  bool paced = false;
+  int opt;
+  sim_serial = NULL;
+  while ((opt = getopt(argc, argv, "w:f:s:c:W:P:r:b:tv")) != -1)
+    switch (opt)
+    {
+      case 'w': workload = optarg; break;
+      case 'f': log = optarg; break;
+      case 's': disk_mb = atoi(optarg); break;
+      case 'c': cache = atoi(optarg); break;
+      case 'W': DISK_WRITE_BACK = atoi(optarg); break;
+      case 'P': DISK_PIN_METADATA = atoi(optarg); break;
+      case 'r': rtt_us = atoi(optarg); break;
+      case 'b': kbps = atoi(optarg); break;
+      case 't': paced = true; break;
+      case 'v': sim_serial = stdout; break;
+      default: usage(argv[0]);
+    }
+  if (optind != argc || !disk_mb || !cache) usage(argv[0]);
+
+  struct trace_rec *recs;
+  uint32_t n, sectors = disk_mb * 1024 * 1024 / DISK_SECTOR_SIZE;
+  if (log)
+  {
+    FILE *f = fopen(log, "r");
+    if (!f)
+    {
+      perror(log);
+      return 1;
+    }
+    n = workload_read_trace(f, &recs);
+    fclose(f);
+  }
+  else n = workload_make(workload, sectors, 1, &recs);
+  if (!n)
+  {
+    fprintf(stderr, "No requests to replay\n");
+    return 1;
+  }
+
+  // Each LUN in the trace gets a disk big enough for it.
+  char files[DISK_LUNS][32];
+  bool used[DISK_LUNS] = { false };
+  uint32_t skipped = 0, max_count = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (recs[i].lun >= DISK_LUNS)
+    {
+      skipped++;
+      continue;
+    }
+    used[recs[i].lun] = true;
+    if (recs[i].lba + recs[i].count > DISK_SECTOR_COUNT[recs[i].lun])
+      DISK_SECTOR_COUNT[recs[i].lun] = recs[i].lba + recs[i].count;
+    if (recs[i].count > max_count) max_count = recs[i].count;
+  }
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+  {
+    if (!used[lun]) continue;
+    if (DISK_SECTOR_COUNT[lun] < sectors) DISK_SECTOR_COUNT[lun] = sectors;
+    snprintf(files[lun], sizeof files[lun], "/tmp/wifimsc-replay-XXXXXX");
+    close(mkstemp(files[lun]));
+    sim_links[lun].backing_file = files[lun];
+    sim_links[lun].rtt_us = rtt_us;
+    sim_links[lun].bytes_per_s = kbps * 1000;
+  }
+  sim_heap_bytes = sim_heap_for(cache, DISK_SECTOR_SIZE);
+  sim_start();
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+    if (used[lun] && !sim_wait_media(lun, 10000))
+    {
+      fprintf(stderr, "LUN %u did not come up\n", lun);
+      return 1;
+    }
+
+  uint8_t *buf = (uint8_t*)malloc(max_count * DISK_SECTOR_SIZE);
+  std::vector<uint32_t> lat;
+  uint64_t read_bytes = 0, write_bytes = 0, errors = 0;
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < n; i++)
+  {
+    struct trace_rec *r = &recs[i];
+    if (r->lun >= DISK_LUNS) continue;
+    if (paced)
+    {
+      int32_t wait = (r->start_us - recs[0].start_us) - (micros() - start);
+      if (wait > 0) usleep(wait);
+    }
+    uint32_t bytes = r->count * DISK_SECTOR_SIZE, t = micros();
+    if (r->op == TRACE_WRITE)
+    {
+      memset(buf, i, bytes);
+      if (sim_write(r->lun, r->lba, buf, bytes) != (int32_t)bytes) errors++;
+      write_bytes += bytes;
+    }
+    else
+    {
+      if (sim_read(r->lun, r->lba, buf, bytes) != (int32_t)bytes) errors++;
+      read_bytes += bytes;
+    }
+    lat.push_back(micros() - t);
+  }
+  double secs = (micros() - start) / 1e6;
+  // What write-back still holds goes out on eject, as it would on the
+  // device, and is timed apart from the requests.
+  uint32_t flush = millis();
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+    if (used[lun]) sim_eject(lun);
+  flush = millis() - flush;
+
+  struct sim_remote rem = { 0 };
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+  {
+    rem.reads += sim_remotes[lun].reads;
+    rem.writes += sim_remotes[lun].writes;
+    rem.read_bytes += sim_remotes[lun].read_bytes;
+    rem.write_bytes += sim_remotes[lun].write_bytes;
+  }
+  uint32_t lookups = cache_hits + cache_misses;
+  printf("%s requests=%u skipped=%u rd-MB=%.1f wr-MB=%.1f MBps=%.2f "
+    "p50-us=%u p99-us=%u max-us=%u flush-ms=%u errors=%llu\n",
+    log ? log : workload, n - skipped, skipped, read_bytes / 1e6,
+    write_bytes / 1e6, (read_bytes + write_bytes) / secs / 1e6,
+    percentile(lat, 50), percentile(lat, 99), percentile(lat, 100), flush,
+    (unsigned long long)errors);
+  printf("cache sectors=%u hit-ratio=%.3f pf-hits=%u pf-wasted=%u "
+    "pinned=%u\n", cache, lookups ? (double)cache_hits / lookups : 0.0,
+    cache_prefetch_hits, cache_prefetch_wasted, pinned_cache_blocks);
+  printf("remote reads=%u writes=%u other=%u rd-MB=%.1f wr-MB=%.1f\n",
+    rem.reads, rem.writes, rem.other, rem.read_bytes / 1e6,
+    rem.write_bytes / 1e6);
+
+  for (uint8_t lun = 0; lun < DISK_LUNS; lun++)
+    if (used[lun]) unlink(files[lun]);
+  return errors ? 1 : 0;
+}
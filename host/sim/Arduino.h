@@ -0,0 +1,70 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: the parts of the Arduino core used by the sketch.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <algorithm>
+#include "FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+using std::min;
+using std::max;
+
+typedef bool boolean;
+typedef const char *esp_event_base_t;
+
+// GPIO writes go nowhere.
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 3
+static inline void pinMode(int pin, int mode) {}
+static inline void digitalWrite(int pin, int value) {}
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+
+// Memory is plentiful, so the free heap reported is whatever the simulator
+// was told to offer the cache.  PSRAM is ordinary heap.
+#define MALLOC_CAP_DEFAULT 1
+size_t heap_caps_get_largest_free_block(int caps);
+size_t xPortGetFreeHeapSize(void);
+size_t xPortGetMinimumEverFreeHeapSize(void);
+bool psramFound(void);
+void *ps_malloc(size_t size);
+class EspClass
+{
+public:
+  size_t getFreePsram(void);
+};
+extern EspClass ESP;
+
+// Serial output goes to sim_serial, if set, and input comes from
+// sim_serial_input().
+class HardwareSerial
+{
+public:
+  void begin(unsigned long baud) {}
+  void setDebugOutput(bool on) {}
+  int available(void);
+  int read(void);
+  int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  size_t print(const char *s);
+  size_t println(const char *s);
+};
+extern HardwareSerial Serial, Serial0;
+
+#endif /* SIM_ARDUINO_H */
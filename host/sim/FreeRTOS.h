@@ -0,0 +1,37 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: the FreeRTOS types and constants used by the sketch.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// Tasks are POSIX threads, ticks are milliseconds, and queues and
+// semaphores are one kind of object, as they are in FreeRTOS itself.  Core
+// affinity and priorities are ignored.
+
+#ifndef SIM_FREERTOS_H
+#define SIM_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void (*TaskFunction_t)(void*);
+typedef struct sim_task *TaskHandle_t;
+typedef struct sim_queue *QueueHandle_t;
+typedef struct sim_queue *SemaphoreHandle_t;
+
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (ms)
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define tskIDLE_PRIORITY 0
+#define configMAX_PRIORITIES 25
+#define portNUM_PROCESSORS 2
+
+#endif /* SIM_FREERTOS_H */
@@ -0,0 +1,37 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: SPIFFS, as a directory named by sim_spiffs_dir.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "Arduino.h"
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File
+{
+public:
+  File(FILE *f = NULL) : f(f) {}
+  size_t read(uint8_t *buf, size_t len);
+  size_t write(const uint8_t *buf, size_t len);
+  bool seek(uint32_t pos, SeekMode mode = SeekSet);
+  size_t position(void);
+  size_t size(void);
+  void flush(void);
+  void close(void);
+  operator bool() const { return f != NULL; }
+private:
+  FILE *f;
+};
+
+// Open fails, and the file system looks full, unless sim_spiffs_dir is set.
+class SPIFFSFS
+{
+public:
+  File open(const char *path, const char *mode);
+  bool remove(const char *path);
+  size_t totalBytes(void);
+  size_t usedBytes(void);
+};
+extern SPIFFSFS SPIFFS;
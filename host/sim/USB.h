@@ -0,0 +1,35 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: the USB device stack, which never enumerates.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "Arduino.h"
+
+extern esp_event_base_t const ARDUINO_USB_EVENTS;
+enum arduino_usb_event_t
+{
+  ARDUINO_USB_STARTED_EVENT, ARDUINO_USB_STOPPED_EVENT,
+  ARDUINO_USB_SUSPEND_EVENT, ARDUINO_USB_RESUME_EVENT
+};
+typedef union
+{
+  struct { bool remote_wakeup_en; } suspend;
+} arduino_usb_event_data_t;
+typedef void (*esp_event_handler_t)(void *arg, esp_event_base_t base,
+  int32_t id, void *data);
+
+class ESPUSB
+{
+public:
+  void onEvent(esp_event_handler_t cb) {}
+  bool begin(void) { return true; }
+};
+extern ESPUSB USB;
+
+class USBCDC : public HardwareSerial
+{
+public:
+  void begin(void) {}
+};
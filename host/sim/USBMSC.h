@@ -0,0 +1,42 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: mass storage LUNs, driven by sim_read() and sim_write().
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef SIM_USBMSC_H
+#define SIM_USBMSC_H
+
+#include <stdint.h>
+
+typedef int32_t (*msc_read_cb)(uint32_t lba, uint32_t offset, void* buffer,
+  uint32_t bufsize);
+typedef int32_t (*msc_write_cb)(uint32_t lba, uint32_t offset,
+  uint8_t* buffer, uint32_t bufsize);
+typedef bool (*msc_start_stop_cb)(uint8_t power_condition, bool start,
+  bool load_eject);
+
+// Each LUN is numbered in the order constructed, as by TinyUSB.
+class USBMSC
+{
+public:
+  USBMSC(void);
+  bool begin(uint32_t block_count, uint16_t block_size);
+  void vendorID(const char *vid) {}
+  void productID(const char *pid) {}
+  void productRevision(const char *rev) {}
+  void onStartStop(msc_start_stop_cb cb) { start_stop = cb; }
+  void onRead(msc_read_cb cb) { read = cb; }
+  void onWrite(msc_write_cb cb) { write = cb; }
+  void mediaPresent(bool present) { media = present; }
+
+  msc_read_cb read;
+  msc_write_cb write;
+  msc_start_stop_cb start_stop;
+  volatile bool media;
+  uint32_t block_count;
+  uint16_t block_size;
+};
+
+#endif /* SIM_USBMSC_H */
@@ -0,0 +1,8 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: PSRAM start-up.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+bool psramInit(void);
@@ -0,0 +1,10 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: idle hooks, which are never called.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+typedef bool (*esp_freertos_idle_cb_t)(void);
+int esp_register_freertos_idle_hook_for_cpu(esp_freertos_idle_cb_t cb,
+  unsigned core);
@@ -0,0 +1,18 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: FreeRTOS queues.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef SIM_QUEUE_H
+#define SIM_QUEUE_H
+
+#include "../FreeRTOS.h"
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+
+#endif /* SIM_QUEUE_H */
@@ -0,0 +1,20 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: FreeRTOS semaphores, as queues of empty items.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef SIM_SEMPHR_H
+#define SIM_SEMPHR_H
+
+#include "queue.h"
+
+// A mutex starts given and a binary semaphore taken.  The mutex does not
+// track its holder, so it has no priority inheritance and is not recursive.
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+
+#endif /* SIM_SEMPHR_H */
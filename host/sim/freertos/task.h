@@ -0,0 +1,20 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: FreeRTOS tasks, as detached threads.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef SIM_TASK_H
+#define SIM_TASK_H
+
+#include "../FreeRTOS.h"
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+  uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *task,
+  BaseType_t core);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xPortGetCoreID(void);
+
+#endif /* SIM_TASK_H */
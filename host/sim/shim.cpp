@@ -0,0 +1,482 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: Arduino, FreeRTOS, USBMSC and SPIFFS over POSIX.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "Arduino.h"
+#include "USB.h"
+#include "USBMSC.h"
+#include "SPIFFS.h"
+#include "esp32-hal-psram.h"
+#include "esp_freertos_hooks.h"
+#include "cache.h"
+#include "wifimsc_disk_config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+size_t sim_heap_bytes = 4 * 1024 * 1024;
+bool sim_psram = true;
+FILE *sim_serial = stdout;
+const char *sim_spiffs_dir = NULL;
+uint32_t sim_usb_xfer = 4096;
+
+uint32_t DISK_SECTOR_COUNT[DISK_LUNS];
+uint32_t DISK_WRITE_BACK = 0;
+uint32_t DISK_FLASH_CACHE = 0;
+uint32_t DISK_TRACE_RECORDS = 0;
+uint32_t DISK_PIN_METADATA = 0;
+
+static std::string serial_input;
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+
+HardwareSerial Serial, Serial0;
+EspClass ESP;
+ESPUSB USB;
+esp_event_base_t const ARDUINO_USB_EVENTS = "ARDUINO_USB_EVENTS";
+SPIFFSFS SPIFFS;
+
+// Time.
+
+static uint64_t _now_us(void)
+{
+  static struct timespec t0;
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  if (!t0.tv_sec) t0 = t;
+  return (t.tv_sec - t0.tv_sec) * 1000000ULL + t.tv_nsec / 1000 -
+    t0.tv_nsec / 1000;
+}
+
+unsigned long millis(void)
+{
+  return (uint32_t)(_now_us() / 1000);
+}
+
+unsigned long micros(void)
+{
+  return (uint32_t)_now_us();
+}
+
+void delay(unsigned long ms)
+{
+  usleep(ms * 1000);
+}
+
+// Memory.
+
+size_t heap_caps_get_largest_free_block(int caps)
+{
+  return sim_heap_bytes;
+}
+
+size_t xPortGetFreeHeapSize(void)
+{
+  return sim_heap_bytes;
+}
+
+size_t xPortGetMinimumEverFreeHeapSize(void)
+{
+  return sim_heap_bytes;
+}
+
+bool psramFound(void)
+{
+  return sim_psram;
+}
+
+bool psramInit(void)
+{
+  return sim_psram;
+}
+
+void *ps_malloc(size_t size)
+{
+  return sim_psram ? malloc(size) : NULL;
+}
+
+size_t EspClass::getFreePsram(void)
+{
+  return sim_psram ? sim_heap_bytes : 0;
+}
+
+// As allocated by init_cache() for each entry, and what it keeps back.
+size_t sim_heap_for(uint32_t sectors, uint16_t sector_size)
+{
+  return 512 * 1024 + (size_t)sectors * (sizeof (struct cache_chain) +
+    sector_size + 7 * sizeof (uint32_t));
+}
+
+int esp_register_freertos_idle_hook_for_cpu(esp_freertos_idle_cb_t cb,
+  unsigned core)
+{
+  return 0;
+}
+
+// Serial console.
+
+int HardwareSerial::printf(const char *fmt, ...)
+{
+  if (!sim_serial) return 0;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vfprintf(sim_serial, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+size_t HardwareSerial::print(const char *s)
+{
+  if (!sim_serial) return 0;
+  fputs(s, sim_serial);
+  return strlen(s);
+}
+
+size_t HardwareSerial::println(const char *s)
+{
+  return print(s) + print("\r\n");
+}
+
+void sim_serial_input(const char *s)
+{
+  pthread_mutex_lock(&serial_lock);
+  serial_input += s;
+  pthread_mutex_unlock(&serial_lock);
+}
+
+int HardwareSerial::available(void)
+{
+  pthread_mutex_lock(&serial_lock);
+  int n = serial_input.size();
+  pthread_mutex_unlock(&serial_lock);
+  return n;
+}
+
+int HardwareSerial::read(void)
+{
+  int c = -1;
+  pthread_mutex_lock(&serial_lock);
+  if (!serial_input.empty())
+  {
+    c = (uint8_t)serial_input[0];
+    serial_input.erase(0, 1);
+  }
+  pthread_mutex_unlock(&serial_lock);
+  return c;
+}
+
+// Queues, which are also semaphores when their items are empty.
+
+struct sim_queue
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint8_t *items;
+  UBaseType_t length, item_size, head, count;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  struct sim_queue *q = (struct sim_queue*)calloc(1, sizeof *q);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, &attr);
+  q->items = (uint8_t*)malloc(length * item_size + 1);
+  q->length = length;
+  q->item_size = item_size;
+  return q;
+}
+
+// Wait with the queue locked until ready() or the ticks have passed.
+static bool _wait(struct sim_queue *q, TickType_t wait,
+  bool (*ready)(const struct sim_queue*))
+{
+  struct timespec until;
+  clock_gettime(CLOCK_MONOTONIC, &until);
+  until.tv_sec += wait / 1000;
+  until.tv_nsec += wait % 1000 * 1000000L;
+  if (until.tv_nsec >= 1000000000L)
+  {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  while (!ready(q))
+    if (!wait) return false;
+    else if (wait == portMAX_DELAY) pthread_cond_wait(&q->changed, &q->lock);
+    else if (pthread_cond_timedwait(&q->changed, &q->lock, &until) ==
+      ETIMEDOUT) return ready(q);
+  return true;
+}
+
+static bool _has_room(const struct sim_queue *q)
+{
+  return q->count < q->length;
+}
+
+static bool _has_item(const struct sim_queue *q)
+{
+  return q->count > 0;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+  pthread_mutex_lock(&q->lock);
+  bool ok = _wait(q, wait, _has_room);
+  if (ok)
+  {
+    memcpy(q->items + (q->head + q->count) % q->length * q->item_size, item,
+      q->item_size);
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+  pthread_mutex_lock(&q->lock);
+  bool ok = _wait(q, wait, _has_item);
+  if (ok)
+  {
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok ? pdTRUE : pdFALSE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  UBaseType_t n = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+  return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  SemaphoreHandle_t s = xQueueCreate(1, 0);
+  xSemaphoreGive(s);
+  return s;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait)
+{
+  return xQueueReceive(s, NULL, wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+  return xQueueSend(s, NULL, 0);
+}
+
+// Tasks.
+
+struct sim_task
+{
+  TaskFunction_t fn;
+  void *arg;
+};
+
+static void *_task(void *arg)
+{
+  struct sim_task t = *(struct sim_task*)arg;
+  free(arg);
+  t.fn(t.arg);
+  return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+  uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *task,
+  BaseType_t core)
+{
+  struct sim_task *t = (struct sim_task*)malloc(sizeof *t);
+  pthread_t thread;
+  t->fn = fn;
+  t->arg = arg;
+  if (pthread_create(&thread, NULL, _task, t))
+  {
+    free(t);
+    return pdFAIL;
+  }
+  pthread_detach(thread);
+  if (task) *task = NULL;
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  usleep(ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  return millis();
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+  return 0;
+}
+
+// USB mass storage.
+
+static USBMSC *mscs[IPC_LUNS];
+static uint8_t msc_count = 0;
+
+USBMSC::USBMSC(void) : read(NULL), write(NULL), start_stop(NULL),
+  media(false), block_count(0), block_size(0)
+{
+  assert(msc_count < IPC_LUNS);
+  mscs[msc_count++] = this;
+}
+
+bool USBMSC::begin(uint32_t count, uint16_t size)
+{
+  block_count = count;
+  block_size = size;
+  return true;
+}
+
+bool sim_media_present(uint8_t lun)
+{
+  return lun < msc_count && mscs[lun]->media;
+}
+
+bool sim_wait_media(uint8_t lun, uint32_t ms)
+{
+  uint32_t start = millis();
+  while (!sim_media_present(lun))
+  {
+    if (millis() - start >= ms) return false;
+    delay(1);
+  }
+  return true;
+}
+
+static void loopTask(void *pvParameter)
+{
+  while (1) loop();
+}
+
+void sim_start(void)
+{
+  setup();
+  xTaskCreatePinnedToCore(loopTask, "loopTask", 8192, NULL, 1, NULL, 1);
+}
+
+int32_t sim_read(uint8_t lun, uint32_t lba, void *buf, uint32_t bytes)
+{
+  USBMSC *m = mscs[lun];
+  for (uint32_t done = 0, n; done < bytes; done += n)
+  {
+    n = min(bytes - done, sim_usb_xfer);
+    if (m->read(lba + done / m->block_size, 0, (uint8_t*)buf + done, n) !=
+      (int32_t)n) return -1;
+  }
+  return bytes;
+}
+
+int32_t sim_write(uint8_t lun, uint32_t lba, const void *buf, uint32_t bytes)
+{
+  USBMSC *m = mscs[lun];
+  for (uint32_t done = 0, n; done < bytes; done += n)
+  {
+    n = min(bytes - done, sim_usb_xfer);
+    // The USB stack hands over its own buffer, which the sketch may change.
+    uint8_t copy[n];
+    memcpy(copy, (const uint8_t*)buf + done, n);
+    if (m->write(lba + done / m->block_size, 0, copy, n) != (int32_t)n)
+      return -1;
+  }
+  return bytes;
+}
+
+bool sim_eject(uint8_t lun)
+{
+  return mscs[lun]->start_stop(0, false, true);
+}
+
+// SPIFFS.
+
+size_t File::read(uint8_t *buf, size_t len)
+{
+  return fread(buf, 1, len, f);
+}
+
+size_t File::write(const uint8_t *buf, size_t len)
+{
+  return fwrite(buf, 1, len, f);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode)
+{
+  return !fseek(f, pos, mode == SeekSet ? SEEK_SET :
+    mode == SeekCur ? SEEK_CUR : SEEK_END);
+}
+
+size_t File::position(void)
+{
+  return ftell(f);
+}
+
+size_t File::size(void)
+{
+  struct stat st;
+  fflush(f);
+  return fstat(fileno(f), &st) ? 0 : st.st_size;
+}
+
+void File::flush(void)
+{
+  fflush(f);
+}
+
+void File::close(void)
+{
+  if (f) fclose(f);
+  f = NULL;
+}
+
+static std::string _spiffs_path(const char *path)
+{
+  return std::string(sim_spiffs_dir) + path;
+}
+
+File SPIFFSFS::open(const char *path, const char *mode)
+{
+  if (!sim_spiffs_dir) return File();
+  return File(fopen(_spiffs_path(path).c_str(), mode));
+}
+
+bool SPIFFSFS::remove(const char *path)
+{
+  return sim_spiffs_dir && !unlink(_spiffs_path(path).c_str());
+}
+
+size_t SPIFFSFS::totalBytes(void)
+{
+  return sim_spiffs_dir ? 1024 * 1024 : 0;
+}
+
+size_t SPIFFSFS::usedBytes(void)
+{
+  return 0;
+}
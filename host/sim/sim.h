@@ -0,0 +1,85 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: driving the sketch off-target.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// The sketch, cache, IPC, read-ahead, write-back and the rest are built
+// unchanged against shims for Arduino, FreeRTOS and USBMSC.  Only the SSH
+// tasks are replaced, by ones serving each LUN from a local backing file
+// over a modelled link.  A tool sets the knobs below and the disk
+// configuration in wifimsc_disk_config.h, calls sim_start(), and then plays
+// the USB host with sim_read() and sim_write().
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ipc.h"
+#include "wifimsc_disk_config.h"
+
+// Free heap offered to init_cache(), which keeps 0.5 MB of it back.  See
+// sim_heap_for() to size it for a given number of cached sectors.
+extern size_t sim_heap_bytes;
+extern bool sim_psram;
+// Serial console output, or NULL to discard it.
+extern FILE *sim_serial;
+// Directory standing in for SPIFFS, or NULL for none.
+extern const char *sim_spiffs_dir;
+// Largest transfer the USB stack hands to onRead() or onWrite().
+extern uint32_t sim_usb_xfer;
+
+// The remote host of each LUN: its backing file, and a link taking rtt_us
+// plus the payload at bytes_per_s, if not zero, for each request.  A LUN
+// without a backing file has a remote host that is never reached, and one
+// with connect_ms is reached only after that long.
+struct sim_link
+{
+  const char *backing_file;
+  uint32_t connect_ms;
+  uint32_t rtt_us;
+  uint32_t bytes_per_s;
+  // Reads and writes touching these sectors fail, as on a bad disk.
+  uint32_t bad_lba, bad_count;
+};
+extern struct sim_link sim_links[IPC_LUNS];
+
+// Requests served by each remote host.
+struct sim_remote
+{
+  uint32_t reads, writes, other;
+  uint64_t read_bytes, write_bytes;
+};
+extern struct sim_remote sim_remotes[IPC_LUNS];
+
+// A stand-in for sshd listening on the Unix socket sock, through which the
+// SSH tasks of session.cpp reach every LUN's remote host at sim_sshd_path.
+// Each command run is appended to log.  sim_sshd_stop() kills the daemon and
+// everything it runs.
+extern const char *sim_sshd_path;
+pid_t sim_sshd_start(const char *sock, const char *log);
+void sim_sshd_stop(pid_t pid);
+
+size_t sim_heap_for(uint32_t sectors, uint16_t sector_size);
+void sim_serial_input(const char *s);
+
+// The USB host's side.  Transfers are split as the USB stack would split
+// them, and return bytes done, or -1 as soon as a callback fails.
+bool sim_media_present(uint8_t lun);
+// Wait up to ms for the medium of a LUN to come in.
+bool sim_wait_media(uint8_t lun, uint32_t ms);
+int32_t sim_read(uint8_t lun, uint32_t lba, void *buf, uint32_t bytes);
+int32_t sim_write(uint8_t lun, uint32_t lba, const void *buf,
+  uint32_t bytes);
+bool sim_eject(uint8_t lun);
+
+// The sketch.  sim_start() calls setup() and then keeps calling loop() in a
+// task of its own, as the Arduino core does.
+void setup(void);
+void loop(void);
+void sim_start(void);
+
+#endif /* SIM_H */
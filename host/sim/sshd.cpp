@@ -0,0 +1,351 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: a stand-in for sshd, and the transport of session.cpp.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// The daemon listens on a Unix socket.  A session is a connection sending
+// an empty line and then nothing, held open until either end goes.  Each
+// channel is a connection of its own, sending its command on the first
+// line.  The command is run by the shell with its input and output on a
+// socketpair, and its output is relayed back in frames, the last one
+// carrying its exit status.  Killing the daemon's process group drops
+// every session and channel at once, and whatever they were running, as
+// sshd being restarted would.
+
+#include "sim.h"
+#include "session.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+const char *sim_sshd_path;
+
+// Output of a channel's command, or its exit status, which ends it.
+struct sshd_frame
+{
+  uint8_t type;
+  uint32_t len;
+} __attribute__((packed));
+#define SSHD_DATA 'd'
+#define SSHD_EXIT 'x'
+
+struct ssh_link
+{
+  int fd;
+};
+
+struct ssh_chan
+{
+  int fd;
+  uint32_t left;  // Output bytes still to come in the current frame.
+  bool eof;
+  int status;
+};
+
+static int write_full(int fd, const void *buf, uint32_t len)
+{
+  for (uint32_t done = 0; done < len; )
+  {
+    ssize_t n = send(fd, (const char*)buf + done, len - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static int read_full(int fd, void *buf, uint32_t len)
+{
+  for (uint32_t done = 0; done < len; )
+  {
+    ssize_t n = read(fd, (char*)buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static int sshd_connect(const char *line)
+{
+  struct sockaddr_un addr;
+  if (!sim_sshd_path || strlen(sim_sshd_path) >= sizeof addr.sun_path)
+    return -1;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sim_sshd_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof addr) ||
+    write_full(fd, line, strlen(line)) || write_full(fd, "\n", 1))
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// The daemon's side.  Nothing here may allocate, since the process forked
+// from is threaded, and another thread may have held the heap's lock.
+
+// Run one channel's command, relaying its input as it comes and its output
+// in frames.
+static void sshd_exec(int client, const char *cmd)
+{
+  int sp[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp)) return;
+  pid_t pid = fork();
+  if (pid < 0) return;
+  if (!pid)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(sp[1], 0);
+    dup2(sp[1], 1);
+    dup2(null, 2);
+    close(sp[0]);
+    close(sp[1]);
+    close(client);
+    execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+    _exit(127);
+  }
+  close(sp[1]);
+
+  static char buf[65536];
+  struct pollfd fds[2] = { { client, POLLIN, 0 }, { sp[0], POLLIN, 0 } };
+  while (fds[1].fd >= 0)
+  {
+    if (poll(fds, 2, -1) < 0)
+    {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[0].revents)
+    {
+      ssize_t n = read(client, buf, sizeof buf);
+      if (n <= 0)
+      {
+        shutdown(sp[0], SHUT_WR);
+        fds[0].fd = -1;
+      }
+      else if (write_full(sp[0], buf, n)) break;
+    }
+    if (fds[1].revents)
+    {
+      ssize_t n = read(sp[0], buf, sizeof buf);
+      struct sshd_frame f = { SSHD_DATA, (uint32_t)n };
+      if (n <= 0) fds[1].fd = -1;
+      else if (write_full(client, &f, sizeof f) ||
+        write_full(client, buf, n)) break;
+    }
+  }
+  close(sp[0]);
+
+  int wstatus;
+  struct sshd_frame f = { SSHD_EXIT, sizeof (int32_t) };
+  int32_t status = waitpid(pid, &wstatus, 0) == pid &&
+    WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+  if (!write_full(client, &f, sizeof f))
+    write_full(client, &status, sizeof status);
+}
+
+static void sshd_serve(int client, int log)
+{
+  char cmd[4096];
+  uint32_t len = 0;
+  while (len < sizeof cmd - 1 && read(client, cmd + len, 1) == 1 &&
+    cmd[len] != '\n')
+    len++;
+  if (len == sizeof cmd - 1 || cmd[len] != '\n') return;
+  cmd[len] = 0;
+  // A session holds on until the client goes.
+  if (!len)
+  {
+    while (read(client, cmd, sizeof cmd) > 0) ;
+    return;
+  }
+  cmd[len] = '\n';
+  if (write(log, cmd, len + 1) != (ssize_t)len + 1) return;
+  cmd[len] = 0;
+  sshd_exec(client, cmd);
+}
+
+pid_t sim_sshd_start(const char *sock, const char *log)
+{
+  struct sockaddr_un addr;
+  if (strlen(sock) >= sizeof addr.sun_path) return -1;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock);
+  unlink(sock);
+  // Listening before the fork, so that clients can connect as soon as this
+  // returns.
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int logfd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (lfd < 0 || logfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof addr)
+    || listen(lfd, 16))
+  {
+    if (lfd >= 0) close(lfd);
+    if (logfd >= 0) close(logfd);
+    return -1;
+  }
+
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid)
+  {
+    // Set here too, in case the daemon is stopped before it gets going.
+    if (pid > 0) setpgid(pid, pid);
+    close(lfd);
+    close(logfd);
+    return pid;
+  }
+
+  // Only the sockets of this daemon are kept, so that a client closing its
+  // end is seen here.
+  setpgid(0, 0);
+  for (int fd = 3; fd < 1024; fd++)
+    if (fd != lfd && fd != logfd) close(fd);
+  // Nothing waits for the connections served.
+  signal(SIGCHLD, SIG_IGN);
+  while (1)
+  {
+    int client = accept(lfd, NULL, NULL);
+    if (client < 0) continue;
+    if (!fork())
+    {
+      signal(SIGCHLD, SIG_DFL);
+      close(lfd);
+      sshd_serve(client, logfd);
+      _exit(0);
+    }
+    close(client);
+  }
+}
+
+// The listener goes first, so that nothing connects while the rest go.
+void sim_sshd_stop(pid_t pid)
+{
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  kill(-pid, SIGKILL);
+}
+
+// The transport, for session.cpp.
+
+struct ssh_link *link_open(uint8_t lun)
+{
+  int fd = sshd_connect("");
+  if (fd < 0) return NULL;
+  struct ssh_link *link = (struct ssh_link*)malloc(sizeof *link);
+  link->fd = fd;
+  return link;
+}
+
+// Nothing comes on a session, so anything to read is the end of it.
+static bool link_gone(struct ssh_link *link, int timeout_ms)
+{
+  struct pollfd p = { link->fd, POLLIN, 0 };
+  return poll(&p, 1, timeout_ms) != 0;
+}
+
+// The channels of a killed daemon can go a moment before its sessions do, so
+// wait a little for that to show.
+bool link_up(struct ssh_link *link)
+{
+  return !link_gone(link, 100);
+}
+
+void link_close(struct ssh_link *link)
+{
+  close(link->fd);
+  free(link);
+}
+
+// As over SSH, a lost session has no new channels.
+struct ssh_chan *chan_exec(struct ssh_link *link, const char *cmd)
+{
+  if (link_gone(link, 0)) return NULL;
+  int fd = sshd_connect(cmd);
+  if (fd < 0) return NULL;
+  struct ssh_chan *chan = (struct ssh_chan*)malloc(sizeof *chan);
+  chan->fd = fd;
+  chan->left = 0;
+  chan->eof = false;
+  chan->status = -1;
+  return chan;
+}
+
+int chan_read(struct ssh_chan *chan, void *buf, uint32_t len, int timeout_ms)
+{
+  while (!chan->left)
+  {
+    struct sshd_frame f;
+    struct pollfd p = { chan->fd, POLLIN, 0 };
+    if (chan->eof || !len) return 0;
+    if (timeout_ms >= 0 && !poll(&p, 1, timeout_ms)) return 0;
+    if (read_full(chan->fd, &f, sizeof f)) return -1;
+    if (f.type == SSHD_EXIT)
+    {
+      int32_t status;
+      if (f.len != sizeof status || read_full(chan->fd, &status, f.len))
+        return -1;
+      chan->status = status;
+      chan->eof = true;
+    }
+    else if (f.type == SSHD_DATA) chan->left = f.len;
+    else return -1;
+  }
+  ssize_t n = read(chan->fd, buf, len < chan->left ? len : chan->left);
+  if (n <= 0) return -1;
+  chan->left -= n;
+  return n;
+}
+
+int chan_write(struct ssh_chan *chan, const void *buf, uint32_t len)
+{
+  return write_full(chan->fd, buf, len) ? -1 : len;
+}
+
+int chan_select(struct ssh_chan **chans, int n)
+{
+  struct pollfd p[n];
+  for (int c = 0; c < n; c++)
+  {
+    if (chans[c]->left || chans[c]->eof) return c;
+    p[c].fd = chans[c]->fd;
+    p[c].events = POLLIN;
+  }
+  while (poll(p, n, -1) < 0)
+    if (errno != EINTR) return -1;
+  for (int c = 0; c < n; c++)
+    if (p[c].revents) return c;
+  return -1;
+}
+
+void chan_eof(struct ssh_chan *chan)
+{
+  shutdown(chan->fd, SHUT_WR);
+}
+
+int chan_exit_status(struct ssh_chan *chan)
+{
+  char discard[512];
+  while (!chan->eof)
+    if (chan_read(chan, discard, sizeof discard, -1) < 0) return -1;
+  return chan->status;
+}
+
+void chan_close(struct ssh_chan *chan)
+{
+  close(chan->fd);
+  free(chan);
+}
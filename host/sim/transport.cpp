@@ -0,0 +1,126 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: remote hosts served from local backing files.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// Stands in for ssh_exec.cpp.  Each LUN has a task serving its requests one
+// at a time, as a single block server channel would, and taking as long as
+// its modelled link says.
+
+#include "sim.h"
+#include "ssh_exec.h"
+#include "session.h"
+#include "crc32c.h"
+#include "tasks.h"
+#include "Arduino.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+struct sim_link sim_links[IPC_LUNS];
+struct sim_remote sim_remotes[IPC_LUNS];
+
+static uint8_t lun_ids[IPC_LUNS];
+
+// Reads past the end of the backing file return zeros, as from a sparse
+// file.
+static bool serve(int fd, const struct sim_link *link, struct ipc_msg *msg)
+{
+  off_t off = (off_t)msg->lba * msg->secsz;
+  ssize_t n;
+  if ((msg->host_cmd == USB_READ || msg->host_cmd == USB_WRITE) &&
+    link->bad_count && msg->lba < link->bad_lba + link->bad_count &&
+    link->bad_lba < msg->lba + msg->dlen / msg->secsz)
+    return false;
+  switch (msg->host_cmd)
+  {
+    case CREATE_BACKING_FILE:
+      return (off_t)lseek(fd, 0, SEEK_END) >= off || !ftruncate(fd, off);
+    case USB_READ:
+      if ((n = pread(fd, msg->data, msg->dlen, off)) < 0) return false;
+      memset(msg->data + n, 0, msg->dlen - n);
+      return true;
+    case USB_WRITE:
+      return pwrite(fd, msg->data, msg->dlen, off) == msg->dlen;
+    case SECTOR_CHECKSUMS:
+    {
+      uint8_t sector[msg->secsz];
+      uint32_t *crcs = (uint32_t*)msg->data;
+      for (uint32_t s = 0; s < msg->dlen / sizeof *crcs; s++)
+      {
+        if ((n = pread(fd, sector, msg->secsz, off + s * msg->secsz)) < 0)
+          return false;
+        memset(sector + n, 0, msg->secsz - n);
+        crcs[s] = crc32c(0, sector, msg->secsz);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static void remoteTask(void *pvParameter)
+{
+  uint8_t lun = *(uint8_t*)pvParameter;
+  struct sim_link *link = &sim_links[lun];
+  struct sim_remote *r = &sim_remotes[lun];
+  if (!link->backing_file) return;
+  if (link->connect_ms) delay(link->connect_ms);
+  int fd = open(link->backing_file, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    HWSerial.printf("%%SIM Cannot open %s lun=%u\r\n", link->backing_file,
+      lun);
+    return;
+  }
+  ipc_signal_ready(lun);
+
+  while (1)
+  {
+    struct ipc_msg *msg = ipc_next(lun, portMAX_DELAY);
+    msg->sent = millis();
+    uint32_t payload = msg->host_cmd == USB_READ ||
+      msg->host_cmd == USB_WRITE ? msg->dlen : 0;
+    uint64_t us = link->rtt_us;
+    if (link->bytes_per_s) us += payload * 1000000ULL / link->bytes_per_s;
+    if (us) usleep(us);
+    if (!serve(fd, link, msg))
+    {
+      HWSerial.printf("%%SIM Remote I/O failed lun=%u lba=%u\r\n", lun,
+        msg->lba);
+      msg->status = -1;
+    }
+    if (msg->host_cmd == USB_READ)
+    {
+      r->reads++;
+      r->read_bytes += msg->dlen;
+    }
+    else if (msg->host_cmd == USB_WRITE)
+    {
+      r->writes++;
+      r->write_bytes += msg->dlen;
+    }
+    else r->other++;
+    blk_payload_bytes[lun] += payload;
+    blk_wire_bytes[lun] += payload;
+    if (payload) ipc_sample(lun, msg->dlen, millis() - msg->sent);
+    ipc_complete(msg->id);
+  }
+}
+
+void ssh_exec_setup(uint8_t luns)
+{
+  for (uint8_t l = 0; l < luns; l++)
+  {
+    lun_ids[l] = l;
+    xTaskCreatePinnedToCore(remoteTask, "ssh", 8192, &lun_ids[l],
+      TASK_SSH_PRIORITY, NULL, TASK_NET_CORE);
+  }
+}
@@ -0,0 +1,25 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: disk configuration, set by the tool before setup().
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// As generated by config/create_config.sh, except that only the number of
+// LUNs and the sector size are fixed when built.
+#ifndef SIM_DISK_CONFIG_H
+#define SIM_DISK_CONFIG_H
+
+// Two, so that a LUN can be left without a remote host.
+#ifndef SIM_LUNS
+#define SIM_LUNS 2
+#endif
+static const uint8_t DISK_LUNS = SIM_LUNS;
+static const uint16_t DISK_SECTOR_SIZE = 512;
+extern uint32_t DISK_SECTOR_COUNT[DISK_LUNS];
+extern uint32_t DISK_WRITE_BACK;
+extern uint32_t DISK_FLASH_CACHE;
+extern uint32_t DISK_TRACE_RECORDS;
+extern uint32_t DISK_PIN_METADATA;
+
+#endif /* SIM_DISK_CONFIG_H */
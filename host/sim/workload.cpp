@@ -0,0 +1,155 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: USB request streams, made up or from a captured trace.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "workload.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+const char *const workload_names[] = { "fat32-copy", "boot", "random4k",
+  NULL };
+
+// Sectors per 4 kB cluster, and the most the host asks for at once.
+#define CLUSTER 8
+#define HOST_XFER 128
+
+static void add(std::vector<struct trace_rec> &v, uint8_t op, uint32_t lba,
+  uint32_t count)
+{
+  while (count)
+  {
+    uint16_t n = count < HOST_XFER ? count : HOST_XFER;
+    struct trace_rec r;
+    memset(&r, 0, sizeof r);
+    r.lba = lba;
+    r.count = n;
+    r.op = op;
+    v.push_back(r);
+    lba += n;
+    count -= n;
+  }
+}
+
+// A FAT32 volume with 32 reserved sectors, two FATs of 4-byte entries for
+// 4 kB clusters, and the root directory in the first cluster.  A file of a
+// quarter of the disk is copied in 64 kB pieces.  The FAT sectors covering
+// each piece's clusters are read for the source and written to both FATs
+// for the copy, and the directory and FSInfo sectors are updated at the end.
+static void fat32_copy(std::vector<struct trace_rec> &v, uint32_t sectors)
+{
+  uint32_t fat_size = (sectors / CLUSTER * 4 + 511) / 512;
+  uint32_t fat1 = 32, fat2 = fat1 + fat_size, data = fat2 + fat_size;
+  uint32_t file = (sectors - data) / 4 / HOST_XFER * HOST_XFER;
+  uint32_t src = data + CLUSTER, dst = src + file;
+
+  add(v, TRACE_READ, 0, 1);
+  add(v, TRACE_READ, 1, 1);
+  add(v, TRACE_READ, data, CLUSTER);
+  for (uint32_t done = 0; done < file; done += HOST_XFER)
+  {
+    // Each FAT sector maps 128 clusters, 1024 sectors of data.
+    uint32_t fs = (src + done - data) / CLUSTER / 128;
+    uint32_t fd = (dst + done - data) / CLUSTER / 128;
+    if (done % 1024 == 0) add(v, TRACE_READ, fat1 + fs, 1);
+    add(v, TRACE_READ, src + done, HOST_XFER);
+    add(v, TRACE_WRITE, dst + done, HOST_XFER);
+    if ((done + HOST_XFER) % 1024 == 0 || done + HOST_XFER == file)
+    {
+      add(v, TRACE_WRITE, fat1 + fd, 1);
+      add(v, TRACE_WRITE, fat2 + fd, 1);
+    }
+  }
+  add(v, TRACE_WRITE, data, 1);
+  add(v, TRACE_WRITE, 1, 1);
+}
+
+// Files of 4 kB to 256 kB, mostly small, at random places, read in the
+// order a boot might need them.  A fifth of them are read again later.
+static void boot(std::vector<struct trace_rec> &v, uint32_t sectors)
+{
+  uint32_t files = sectors / 512 < 2000 ? sectors / 512 : 2000;
+  std::vector<uint32_t> lba(files), len(files);
+  for (uint32_t f = 0; f < files; f++)
+  {
+    len[f] = CLUSTER << (random() % 100 < 80 ? random() % 3 : random() % 6);
+    lba[f] = random() % ((sectors - len[f]) / CLUSTER) * CLUSTER;
+  }
+  add(v, TRACE_READ, 0, 1);
+  for (uint32_t f = 0; f < files; f++)
+  {
+    // Each file's directory entry first, in the first part of the disk.
+    add(v, TRACE_READ, lba[f] % (sectors / 64) / CLUSTER * CLUSTER, CLUSTER);
+    add(v, TRACE_READ, lba[f], len[f]);
+  }
+  for (uint32_t f = 0; f < files; f += 5) add(v, TRACE_READ, lba[f], len[f]);
+}
+
+static void random4k(std::vector<struct trace_rec> &v, uint32_t sectors)
+{
+  for (int i = 0; i < 20000; i++)
+    add(v, random() % 10 < 3 ? TRACE_WRITE : TRACE_READ,
+      random() % (sectors / CLUSTER) * CLUSTER, CLUSTER);
+}
+
+static uint32_t _give(std::vector<struct trace_rec> &v,
+  struct trace_rec **recs)
+{
+  if (v.empty()) return 0;
+  *recs = (struct trace_rec*)malloc(v.size() * sizeof **recs);
+  if (!*recs) return 0;
+  memcpy(*recs, v.data(), v.size() * sizeof **recs);
+  return v.size();
+}
+
+uint32_t workload_make(const char *name, uint32_t sectors, uint32_t seed,
+  struct trace_rec **recs)
+{
+  std::vector<struct trace_rec> v;
+  if (sectors < 1024) return 0;
+  srandom(seed);
+  if (!strcmp(name, "fat32-copy")) fat32_copy(v, sectors);
+  else if (!strcmp(name, "boot")) boot(v, sectors);
+  else if (!strcmp(name, "random4k")) random4k(v, sectors);
+  return _give(v, recs);
+}
+
+uint32_t workload_read_trace(FILE *f, struct trace_rec **recs)
+{
+  std::vector<struct trace_rec> v;
+  char line[1024];
+  bool in = false;
+  while (fgets(line, sizeof line, f))
+  {
+    const char *p;
+    unsigned size;
+    if ((p = strstr(line, "%TRACE-BEGIN")))
+    {
+      // The dump says how big its records are, in case this tool was built
+      // from another version of trace.h.
+      p = strstr(p, "size=");
+      in = p && sscanf(p, "size=%u", &size) == 1 &&
+        size == sizeof (struct trace_rec);
+      if (!in) fprintf(stderr, "Trace records are not %zu bytes\n",
+        sizeof (struct trace_rec));
+      v.clear();
+    }
+    else if (strstr(line, "%TRACE-END")) in = false;
+    else if (in && (p = strstr(line, "%TRACE-DATA ")))
+      for (p += 12; ; p += 2 * sizeof (struct trace_rec))
+      {
+        uint8_t b[sizeof (struct trace_rec)];
+        unsigned k;
+        for (k = 0; k < sizeof b && sscanf(p + 2 * k, "%2hhx", &b[k]) == 1;
+          k++);
+        if (k < sizeof b) break;
+        struct trace_rec r;
+        memcpy(&r, b, sizeof r);
+        v.push_back(r);
+      }
+  }
+  return _give(v, recs);
+}
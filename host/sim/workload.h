@@ -0,0 +1,33 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Host simulator: USB request streams, made up or from a captured trace.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef SIM_WORKLOAD_H
+#define SIM_WORKLOAD_H
+
+#include <stdio.h>
+#include "trace.h"
+
+// Requests are trace records, as trace_dump() prints them.  Only lun, op,
+// lba, count and start_us are used.  Both functions return the number of
+// records in a new array at *recs, to be freed, or 0 on failure.
+
+// A made-up workload on a disk of the given size, always the same for the
+// same seed:
+//   fat32-copy  copying a large file on a FAT32 volume, with FAT and
+//               directory updates between the data
+//   boot        an operating system booting, reading many small files
+//               spread over the disk, the most used of them twice
+//   random4k    4 kB requests all over the disk, 30% of them writes
+uint32_t workload_make(const char *name, uint32_t sectors, uint32_t seed,
+  struct trace_rec **recs);
+extern const char *const workload_names[];
+
+// The records of a %TRACE-BEGIN ... %TRACE-END dump in a serial console
+// log.  Lines not belonging to the dump are skipped.
+uint32_t workload_read_trace(FILE *f, struct trace_rec **recs);
+
+#endif /* SIM_WORKLOAD_H */
@@ -0,0 +1,151 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Hit ratio of the 2Q sector cache against plain LRU of the same size.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "cache.h"
+#include "sim.h"
+#include "workload.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#define SECTOR 512
+#define CACHE 2048
+#define DISK_SECTORS (64 * 1024 * 1024 / SECTOR)
+
+// The LRU cache the 2Q one replaced, for comparison.
+struct lru
+{
+  std::list<uint32_t> order;
+  std::unordered_map<uint32_t, std::list<uint32_t>::iterator> where;
+
+  bool access(uint32_t block)
+  {
+    auto it = where.find(block);
+    if (it != where.end())
+    {
+      order.splice(order.begin(), order, it->second);
+      return true;
+    }
+    if (order.size() == CACHE)
+    {
+      where.erase(order.back());
+      order.pop_back();
+    }
+    order.push_front(block);
+    where[block] = order.begin();
+    return false;
+  }
+};
+
+// A hot set of metadata read at random among the sectors of files read
+// only once, as when a large file is copied or scanned.
+static std::vector<uint32_t> hot_scan(void)
+{
+  std::vector<uint32_t> v;
+  uint32_t next = 100000;
+  for (int i = 0; i < 200000; i++)
+    v.push_back(i % 4 ? next++ : random() % (CACHE / 4));
+  return v;
+}
+
+// The same, but the hot set and the scans take turns, each scan long
+// enough to push the hot set out of the ghost list as well.
+static std::vector<uint32_t> hot_then_scan(void)
+{
+  std::vector<uint32_t> v;
+  uint32_t next = 100000;
+  for (int round = 0; round < 20; round++)
+  {
+    for (int i = 0; i < 4000; i++) v.push_back(random() % (CACHE / 2));
+    for (int i = 0; i < 4 * CACHE; i++) v.push_back(next++);
+  }
+  return v;
+}
+
+// A file a little larger than the cache read over and over.
+static std::vector<uint32_t> looping(void)
+{
+  std::vector<uint32_t> v;
+  for (int round = 0; round < 20; round++)
+    for (uint32_t b = 0; b < CACHE + CACHE / 2; b++) v.push_back(b);
+  return v;
+}
+
+// Skewed reuse over a disk area many times the size of the cache.
+static std::vector<uint32_t> skewed(void)
+{
+  std::vector<uint32_t> v;
+  for (int i = 0; i < 200000; i++)
+    v.push_back(16 * CACHE * pow(random() / (double)RAND_MAX, 4));
+  return v;
+}
+
+// The sectors read by a made-up workload, in order.
+static std::vector<uint32_t> replayed(const char *name)
+{
+  std::vector<uint32_t> v;
+  struct trace_rec *recs;
+  uint32_t n = workload_make(name, DISK_SECTORS, 1, &recs);
+  for (uint32_t i = 0; i < n; i++)
+    if (recs[i].op == TRACE_READ)
+      for (uint32_t s = 0; s < recs[i].count; s++)
+        v.push_back(recs[i].lba + s);
+  free(recs);
+  return v;
+}
+
+// Blocks missed are put in the cache, as a read from the remote host would.
+static void run(const char *name, const std::vector<uint32_t> &v)
+{
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(CACHE, SECTOR);
+  init_cache(SECTOR, CACHE, 1);
+  struct lru l;
+  static uint8_t buf[SECTOR];
+  uint32_t lru_hits = 0, q_hits = 0;
+  for (uint32_t b : v)
+  {
+    if (l.access(b)) lru_hits++;
+    if (read_cache_block(0, b, buf)) q_hits++;
+    else put_cache_block(0, b, buf);
+  }
+  printf("%-13s %8zu %9.3f %9.3f\n", name, v.size(),
+    (double)lru_hits / v.size(), (double)q_hits / v.size());
+}
+
+int main(void)
+{
+  printf("%-13s %8s %9s %9s\n", "workload", "reads", "lru-hit", "2q-hit");
+  static const char *names[] = { "hot+scan", "hot-then-scan", "loop",
+    "skewed", "fat32-copy", "boot", "random4k" };
+  for (const char *name : names)
+  {
+    // The cache keeps its state in globals, so each workload is run in a
+    // process of its own.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid)
+    {
+      srandom(1);
+      std::vector<uint32_t> v;
+      if (!strcmp(name, "hot+scan")) v = hot_scan();
+      else if (!strcmp(name, "hot-then-scan")) v = hot_then_scan();
+      else if (!strcmp(name, "loop")) v = looping();
+      else if (!strcmp(name, "skewed")) v = skewed();
+      else v = replayed(name);
+      run(name, v);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Cost of cache hits, misses and replacements as the cache grows.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "cache.h"
+#include "sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SECTOR 512
+#define OPS (1 << 20)
+
+static uint8_t buf[SECTOR];
+static uint32_t order[OPS];
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Nanoseconds per call, visiting base plus the blocks in order.
+static double time_reads(uint32_t base)
+{
+  double t = now_s();
+  for (uint32_t i = 0; i < OPS; i++) read_cache_block(0, base + order[i], buf);
+  return (now_s() - t) * 1e9 / OPS;
+}
+
+static double time_puts(uint32_t base)
+{
+  double t = now_s();
+  for (uint32_t i = 0; i < OPS; i++) put_cache_block(0, base + order[i], buf);
+  return (now_s() - t) * 1e9 / OPS;
+}
+
+// The cache keeps its state in globals, so each size is timed in a process
+// of its own.
+static void run(uint32_t sectors)
+{
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(sectors, SECTOR);
+  uint32_t n = init_cache(SECTOR, sectors, 1);
+  for (uint32_t b = 0; b < n; b++) put_cache_block(0, b, buf);
+  srandom(n);
+  for (uint32_t i = 0; i < OPS; i++) order[i] = random() % n;
+
+  // Hits anywhere in the cache, then misses on blocks never cached, then
+  // updates of cached blocks, then new blocks each evicting an old one.
+  double hit = time_reads(0);
+  double miss = time_reads(n);
+  double update = time_puts(0);
+  for (uint32_t i = 0; i < OPS; i++) order[i] = i;
+  double replace = time_puts(n);
+  printf("%8u %8.1f %8.1f %9.1f %10.1f\n", n, hit, miss, update, replace);
+  fflush(stdout);
+}
+
+int main(void)
+{
+  printf("%8s %8s %8s %9s %10s\n", "sectors", "hit-ns", "miss-ns",
+    "update-ns", "replace-ns");
+  fflush(stdout);
+  // From internal RAM alone up to all of a large PSRAM.
+  static const uint32_t sizes[] = { 1024, 4096, 16384, 65536, 262144 };
+  for (uint32_t sectors : sizes)
+  {
+    pid_t pid = fork();
+    if (!pid)
+    {
+      run(sectors);
+      _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Cost of checksumming block server payloads, against copying them.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "crc32c.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TOTAL (256 * 1024 * 1024)
+
+static uint8_t src[256 * 1024], dst[256 * 1024];
+static volatile uint32_t sink;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+  for (uint32_t i = 0; i < sizeof src; i++) src[i] = random();
+  printf("%8s %10s %10s %10s\n", "bytes", "crc-MBps", "copy-MBps",
+    "overhead");
+  // A sector, a chunk, and the request sizes the firmware tunes between.
+  static const uint32_t sizes[] = { 512, 4096, 8192, 32768, 262144 };
+  for (uint32_t size : sizes)
+  {
+    uint32_t rounds = TOTAL / size;
+    double t = now_s();
+    for (uint32_t r = 0; r < rounds; r++) sink = crc32c(0, src, size);
+    double crc_s = now_s() - t;
+    t = now_s();
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+      memcpy(dst, src, size);
+      sink = dst[r % size];
+    }
+    double copy_s = now_s() - t;
+    // How much longer checksumming a payload takes than one more copy of
+    // it, which every payload already costs at least once.
+    printf("%8u %10.0f %10.0f %9.2fx\n", size, TOTAL / 1e6 / crc_s,
+      TOTAL / 1e6 / copy_s, crc_s / copy_s);
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Compression speed against ratio, and the link it pays off on.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "lzblk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHUNK 4096
+#define TOTAL (64 * 1024 * 1024)
+
+static uint8_t src[CHUNK], comp[2 * CHUNK], out[CHUNK];
+static volatile int sink;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Each kind of chunk keeps this many bytes in every 16 random, the rest
+// being zeroes, from an empty block to a compressed file.
+static const struct { const char *name; int random; } kinds[] = {
+  { "zero", 0 }, { "fat", 2 }, { "text", 6 }, { "mixed", 10 },
+  { "random", 16 } };
+
+int main(void)
+{
+  printf("%8s %7s %10s %11s %13s\n", "data", "ratio", "comp-MBps",
+    "decomp-MBps", "pays-below");
+  for (auto &k : kinds)
+  {
+    srandom(1);
+    for (int i = 0; i < CHUNK; i++)
+      src[i] = i % 16 < k.random ? random() : 0;
+    int rounds = TOTAL / CHUNK, c = 0;
+    double t = now_s();
+    for (int r = 0; r < rounds; r++)
+      sink = c = lz_compress(src, CHUNK, comp, CHUNK - 1);
+    double comp_s = now_s() - t;
+    double decomp_s = 0;
+    if (c > 0)
+    {
+      t = now_s();
+      for (int r = 0; r < rounds; r++)
+        sink = lz_decompress(comp, c, out, CHUNK);
+      decomp_s = now_s() - t;
+    }
+
+    // Sending a chunk compressed saves (1 - ratio) of its link time and
+    // costs the time to compress it, so it is worth doing on any link
+    // slower than (1 - ratio) times the compression speed.  The firmware
+    // runs several times slower than this host, so scale these figures
+    // down before comparing them with WiFi.
+    double comp_mbps = TOTAL / 1e6 / comp_s;
+    double ratio = c > 0 ? (double)c / CHUNK : 1;
+    printf("%8s %7.3f %10.0f ", k.name, ratio, comp_mbps);
+    if (c > 0)
+      printf("%11.0f %9.0fMBps\n", TOTAL / 1e6 / decomp_s,
+        (1 - ratio) * comp_mbps);
+    else
+      printf("%11s %13s\n", "-", "never");
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Read-ahead on replayed workloads, over links of different round trips.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "workload.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "Arduino.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define DISK_MB 32
+#define SECTORS (DISK_MB * 1024 * 1024 / 512)
+#define CACHE 8192
+#define LINK_BPS (20 * 1000 * 1000)
+// Enough of each workload to settle the window, without waiting minutes
+// for small random reads over the longest round trip.
+#define MAX_REQUESTS 1000
+
+static char path[] = "/tmp/wifimsc-bench-XXXXXX";
+
+// Only the reads are timed, as only they wait for read-ahead.
+static void run(const char *name, uint32_t rtt_us)
+{
+  struct trace_rec *recs;
+  uint32_t n = workload_make(name, SECTORS, 1, &recs);
+  if (n > MAX_REQUESTS) n = MAX_REQUESTS;
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(CACHE, DISK_SECTOR_SIZE);
+  close(mkstemp(path));
+  sim_links[0].backing_file = path;
+  sim_links[0].rtt_us = rtt_us;
+  sim_links[0].bytes_per_s = LINK_BPS;
+  DISK_SECTOR_COUNT[0] = SECTORS;
+  sim_start();
+  if (!sim_wait_media(0, 5000)) return;
+
+  static uint8_t buf[SECTORS * 512];
+  uint64_t read_bytes = 0, read_us = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    struct trace_rec *r = &recs[i];
+    uint32_t bytes = r->count * 512;
+    if (r->lun || r->lba + r->count > SECTORS) continue;
+    if (r->op == TRACE_WRITE) sim_write(0, r->lba, buf, bytes);
+    else
+    {
+      uint32_t t = micros();
+      sim_read(0, r->lba, buf, bytes);
+      read_us += micros() - t;
+      read_bytes += bytes;
+    }
+  }
+  unlink(path);
+
+  // Sectors the remote host sent beyond those the USB host asked for were
+  // either read ahead and later hit, or wasted.
+  uint32_t lookups = cache_hits + cache_misses;
+  printf("%-10s %6u %8.2f %7.3f %8u %9u %7.2f %9u\n", name, rtt_us,
+    read_us ? read_bytes / (double)read_us : 0.0,
+    lookups ? (double)cache_hits / lookups : 0.0, cache_prefetch_hits,
+    cache_prefetch_wasted,
+    read_bytes ? (double)sim_remotes[0].read_bytes / read_bytes : 0.0,
+    prefetch_window(0) * DISK_SECTOR_SIZE / 1024);
+}
+
+int main(void)
+{
+  printf("%-10s %6s %8s %7s %8s %9s %7s %9s\n", "workload", "rtt-us",
+    "rd-MBps", "hit", "pf-hits", "pf-wasted", "fetched", "window-kB");
+  static const uint32_t rtts[] = { 500, 5000 };
+  for (int w = 0; workload_names[w]; w++)
+    for (uint32_t rtt : rtts)
+    {
+      // Each setup() is once per process, so each run is in a child.
+      fflush(stdout);
+      pid_t pid = fork();
+      if (!pid)
+      {
+        run(workload_names[w], rtt);
+        fflush(stdout);
+        _exit(0);
+      }
+      waitpid(pid, NULL, 0);
+    }
+  return 0;
+}
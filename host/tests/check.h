@@ -0,0 +1,55 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Minimal checks shared by the host tests.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int check_failures = 0;
+
+// Report a failed condition and carry on, so one run shows every failure.
+#define CHECK(cond) \
+  do \
+    if (!(cond)) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+        #cond); \
+      check_failures++; \
+    } \
+  while (0)
+
+// The exit status of a test.
+static inline int check_done(const char *name)
+{
+  printf("%s: %s\n", name, check_failures ? "FAILED" : "ok");
+  return check_failures ? 1 : 0;
+}
+
+static char check_paths[8][32];
+
+static void _check_cleanup(void)
+{
+  for (int i = 0; i < 8; i++)
+    if (*check_paths[i]) unlink(check_paths[i]);
+}
+
+// A new empty file in /tmp, removed when the test exits.
+static inline const char *check_tmpfile(void)
+{
+  static int n = 0;
+  if (!n) atexit(_check_cleanup);
+  if (n == 8) abort();
+  char *path = check_paths[n++];
+  snprintf(path, sizeof check_paths[0], "/tmp/wifimsc-XXXXXX");
+  close(mkstemp(path));
+  return path;
+}
+
+#endif /* CHECK_H */
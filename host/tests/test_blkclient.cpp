@@ -0,0 +1,231 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// The device's block server client, framing and checksums included, against
+// the real block server behind a stand-in for sshd.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "session.h"
+#include "crc32c.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SECTORS 1024
+#define SECTOR 512
+#define BLOCKD "build/wifimsc-blockd"
+
+static const char *sshd_log;
+static struct session sessions[IPC_LUNS];
+static uint8_t model[SECTORS * SECTOR], buf[SECTORS * SECTOR];
+
+// Run as the block server, with blockd behind it, spoiling the last byte of
+// the payload of each read while the budget kept in a file lasts.  The
+// stand-in for sshd hands this its end of a socketpair as stdin and stdout,
+// which blockd reads from directly.
+static int proxy(const char *budget, const char *blockd, const char *file)
+{
+  int out[2];
+  if (pipe(out)) return 1;
+  pid_t pid = fork();
+  if (!pid)
+  {
+    dup2(out[1], 1);
+    close(out[0]);
+    close(out[1]);
+    execl(blockd, blockd, file, (char*)NULL);
+    _exit(127);
+  }
+  close(out[1]);
+  FILE *in = fdopen(out[0], "r");
+
+  struct blk_hello hello;
+  struct blk_rsp rsp;
+  static uint8_t payload[IPC_MAX_XFER + 1024];
+  if (fread(&hello, sizeof hello, 1, in) != 1) return 1;
+  fwrite(&hello, sizeof hello, 1, stdout);
+  fflush(stdout);
+  while (fread(&rsp, sizeof rsp, 1, in) == 1)
+  {
+    uint32_t len = rsp.dlen + (rsp.flags & BLK_F_CRC ? sizeof (uint32_t) : 0);
+    if (rsp.dlen > sizeof payload - 4 || fread(payload, 1, len, in) != len)
+      break;
+    if (rsp.op == BLK_READ && rsp.status == BLK_OK && rsp.dlen)
+    {
+      int fd = open(budget, O_RDWR);
+      char n[16] = { 0 };
+      flock(fd, LOCK_EX);
+      if (pread(fd, n, sizeof n - 1, 0) > 0 && atoi(n) > 0)
+      {
+        payload[rsp.dlen - 1] ^= 0x80;
+        snprintf(n, sizeof n, "%d\n", atoi(n) - 1);
+        if (ftruncate(fd, 0) || pwrite(fd, n, strlen(n), 0) < 0) return 1;
+      }
+      close(fd);
+    }
+    fwrite(&rsp, sizeof rsp, 1, stdout);
+    fwrite(payload, 1, len, stdout);
+    fflush(stdout);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static void *serve(void *arg)
+{
+  session_main((struct session*)arg);
+  return NULL;
+}
+
+static void start_session(uint8_t lun, const char *block_server,
+  const char *backing_file)
+{
+  pthread_t t;
+  sessions[lun].lun = lun;
+  sessions[lun].block_server = block_server;
+  sessions[lun].backing_file = backing_file;
+  pthread_create(&t, NULL, serve, &sessions[lun]);
+  CHECK(ipc_wait_ready(lun, 10000));
+}
+
+// Send one request, lending it data, and return its status.
+static int request(uint8_t lun, enum host_cmds cmd, uint32_t lba,
+  void *data, uint32_t dlen)
+{
+  struct ipc_msg *m = ipc_alloc(lun, portMAX_DELAY);
+  m->host_cmd = cmd;
+  m->secsz = SECTOR;
+  m->lba = lba;
+  m->dlen = dlen;
+  if (data) m->data = (unsigned char*)data;
+  ipc_submit(m);
+  ipc_wait(m);
+  int status = m->status;
+  ipc_free(m);
+  return status;
+}
+
+// Lines of a file starting with prefix.
+static int count_lines(const char *path, const char *prefix)
+{
+  char line[512];
+  int n = 0;
+  FILE *f = fopen(path, "r");
+  if (!f) return 0;
+  while (fgets(line, sizeof line, f))
+    if (!strncmp(line, prefix, strlen(prefix))) n++;
+  fclose(f);
+  return n;
+}
+
+static bool file_is(const char *path, const uint8_t *want, uint32_t len)
+{
+  int fd = open(path, O_RDONLY);
+  bool same = pread(fd, buf, len, 0) == len && !memcmp(buf, want, len);
+  close(fd);
+  return same;
+}
+
+// Writes of random, compressible and zero data across chunk boundaries,
+// each read back, and checksums, all through the block server.  The
+// backing file is created first, with dd.
+static void framing(void)
+{
+  char backing[64];
+  snprintf(backing, sizeof backing, "%s.disk", check_tmpfile());
+  start_session(0, BLOCKD, backing);
+  CHECK(!request(0, CREATE_BACKING_FILE, SECTORS, NULL, 0));
+  struct stat st;
+  CHECK(!stat(backing, &st) && st.st_size == sizeof model);
+
+  static const uint32_t counts[] = { 1, 7, 8, 9, 64, 129, 512 };
+  srandom(5);
+  for (int kind = 0; kind < 3; kind++)
+    for (uint32_t count : counts)
+    {
+      uint32_t lba = random() % (SECTORS - count), len = count * SECTOR;
+      uint8_t *at = model + lba * SECTOR;
+      for (uint32_t b = 0; b < len; b++)
+        at[b] = kind == 0 ? random() : kind == 1 ? b / 64 % 5 : 0;
+      memcpy(buf, at, len);
+      CHECK(!request(0, USB_WRITE, lba, buf, len));
+      memset(buf, 0xA5, len);
+      CHECK(!request(0, USB_READ, lba, buf, len));
+      CHECK(!memcmp(buf, at, len));
+    }
+  // Compressed and zero chunks make up for the chunk headers.
+  CHECK(blk_wire_bytes[0] < blk_payload_bytes[0]);
+
+  uint32_t crcs[SECTORS / 2];
+  CHECK(!request(0, SECTOR_CHECKSUMS, 100, crcs, sizeof crcs));
+  for (uint32_t s = 0; s < sizeof crcs / sizeof *crcs; s++)
+    CHECK(crcs[s] == crc32c(0, model + (100 + s) * SECTOR, SECTOR));
+
+  CHECK(file_is(backing, model, sizeof model));
+  CHECK(count_lines(sshd_log, "test -f ") == 1);
+  CHECK(count_lines(sshd_log, "dd ") == 0);
+  CHECK(blk_crc_errors[0] == 0);
+  unlink(backing);
+}
+
+// A read that does not match its checksum is sent again on fresh channels,
+// and after BLK_CRC_TRIES mismatches in a row is read with dd instead.
+static void corrupted(void)
+{
+  const char *backing = check_tmpfile(), *budget = check_tmpfile();
+  char cmd[128];
+  snprintf(cmd, sizeof cmd, "build/test_blkclient proxy %s %s", budget,
+    BLOCKD);
+  // Random data, so that the last chunk of a read is sent raw.
+  for (uint32_t b = 0; b < sizeof model; b++) model[b] = random();
+  int fd = open(backing, O_WRONLY);
+  CHECK(pwrite(fd, model, sizeof model, 0) == sizeof model);
+  close(fd);
+  start_session(1, cmd, backing);
+
+  FILE *f = fopen(budget, "w");
+  fprintf(f, "1\n");
+  fclose(f);
+  CHECK(!request(1, USB_READ, 16, buf, 8 * SECTOR));
+  CHECK(!memcmp(buf, model + 16 * SECTOR, 8 * SECTOR));
+  CHECK(blk_crc_errors[1] == 1);
+  CHECK(count_lines(sshd_log, "dd ") == 0);
+
+  f = fopen(budget, "w");
+  fprintf(f, "3\n");
+  fclose(f);
+  CHECK(!request(1, USB_READ, 32, buf, 8 * SECTOR));
+  CHECK(!memcmp(buf, model + 32 * SECTOR, 8 * SECTOR));
+  CHECK(blk_crc_errors[1] == 4);
+  char dd[64];
+  snprintf(dd, sizeof dd, "dd if=%s ", backing);
+  CHECK(count_lines(sshd_log, dd) == 1);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 5 && !strcmp(argv[1], "proxy"))
+    return proxy(argv[2], argv[3], argv[4]);
+
+  alarm(120);
+  sim_serial = NULL;
+  const char *sock = check_tmpfile();
+  sshd_log = check_tmpfile();
+  sim_sshd_path = sock;
+  pid_t sshd = sim_sshd_start(sock, sshd_log);
+  CHECK(sshd > 0);
+  init_ipc(IPC_LUNS);
+
+  framing();
+  corrupted();
+
+  sim_sshd_stop(sshd);
+  return check_done("test_blkclient");
+}
@@ -0,0 +1,40 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Each LUN's medium comes in on its own, whatever the others are doing.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "check.h"
+#include <string.h>
+
+int main(void)
+{
+  // LUN 0's remote host is reached late, and LUN 1's straight away.
+  static char console[1 << 16];
+  sim_serial = fmemopen(console, sizeof console, "w");
+  setvbuf(sim_serial, NULL, _IONBF, 0);
+  sim_heap_bytes = sim_heap_for(2048, DISK_SECTOR_SIZE);
+  sim_links[0].backing_file = check_tmpfile();
+  sim_links[0].connect_ms = 1500;
+  sim_links[1].backing_file = check_tmpfile();
+  DISK_SECTOR_COUNT[0] = DISK_SECTOR_COUNT[1] = 4096;
+  DISK_PIN_METADATA = 64;
+  sim_start();
+
+  CHECK(sim_wait_media(1, 1000));
+  CHECK(!sim_media_present(0));
+  uint8_t buf[4096];
+  CHECK(sim_read(1, 0, buf, sizeof buf) == sizeof buf);
+
+  // Serial commands are answered meanwhile.
+  sim_serial_input("p");
+  usleep(300000);
+  CHECK(strstr(console, "%PERF"));
+  CHECK(!sim_media_present(0));
+
+  CHECK(sim_wait_media(0, 3000));
+  CHECK(sim_read(0, 0, buf, sizeof buf) == sizeof buf);
+  return check_done("test_bringup");
+}
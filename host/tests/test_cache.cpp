@@ -0,0 +1,192 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// The sector cache against a model, over every LUN and the whole LBA range.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "cache.h"
+#include "sim.h"
+#include "check.h"
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+#define SECTOR 512
+#define LUNS 3
+// More entries than 16-bit indices could reach.
+#define ENTRIES 70000
+#define OPS 400000
+
+// What a block should read back as, if cached at all.  Dirty blocks must
+// stay cached until flushed.
+struct model
+{
+  uint32_t version;
+  bool dirty;
+};
+static std::unordered_map<uint64_t, struct model> blocks;
+static uint32_t dirty[LUNS], versions;
+
+static uint64_t key(uint8_t lun, uint32_t block)
+{
+  return (uint64_t)lun << 32 | block;
+}
+
+// Every word of a sector says whose it is and which write put it there.
+static void stamp(uint8_t *buf, uint8_t lun, uint32_t block, uint32_t ver)
+{
+  uint32_t *w = (uint32_t*)buf;
+  for (int i = 0; i < SECTOR / 4; i += 4)
+  {
+    w[i] = lun;
+    w[i + 1] = block;
+    w[i + 2] = ver;
+    w[i + 3] = i;
+  }
+}
+
+static bool stamped(const uint8_t *buf, uint8_t lun, uint32_t block,
+  uint32_t ver)
+{
+  uint8_t want[SECTOR];
+  stamp(want, lun, block, ver);
+  return !memcmp(buf, want, SECTOR);
+}
+
+// Block numbers either side of every boundary a narrower type would wrap
+// at, and others from all over the range.
+static std::vector<uint32_t> pool(void)
+{
+  std::vector<uint32_t> p;
+  static const uint32_t edges[] = { 0, 1, 255, 256, 65535, 65536, 65537,
+    0x7FFFFFFF, 0x80000000, 0xFFFFFFFE, 0xFFFFFFFF };
+  for (uint32_t e : edges) p.push_back(e);
+  for (uint32_t i = 0; i < 20000; i++) p.push_back(i * 65536 + i % 7);
+  for (uint32_t i = 0; i < 20000; i++) p.push_back(0xFFFFFFFF - i);
+  while (p.size() < 100000) p.push_back(random() ^ random() << 16);
+  return p;
+}
+
+static void flush(uint8_t lun)
+{
+  static uint32_t nums[ENTRIES];
+  uint8_t buf[SECTOR];
+  uint32_t oldest;
+  uint32_t n = get_dirty_cache_blocks(lun, nums, ENTRIES, &oldest);
+  CHECK(n == dirty[lun]);
+  CHECK(n == cache_luns[lun].dirty);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    auto it = blocks.find(key(lun, nums[i]));
+    CHECK(it != blocks.end() && it->second.dirty);
+    CHECK(clean_cache_block(lun, nums[i], buf));
+    CHECK(it != blocks.end() && stamped(buf, lun, nums[i],
+      it->second.version));
+    // Now and then the remote host refuses, and the block stays dirty.
+    bool written = random() % 16;
+    flushed_cache_block(lun, nums[i], written);
+    if (written && it != blocks.end())
+    {
+      it->second.dirty = false;
+      dirty[lun]--;
+    }
+  }
+}
+
+int main(void)
+{
+  uint8_t buf[SECTOR];
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(ENTRIES, SECTOR);
+  CHECK(init_cache(SECTOR, ENTRIES, LUNS) == ENTRIES);
+
+  // The cache holds as many distinct blocks as it has entries, however far
+  // apart, before dropping any.
+  for (uint32_t i = 0; i < ENTRIES; i++)
+  {
+    stamp(buf, i % LUNS, i * 61357, i);
+    put_cache_block(i % LUNS, i * 61357, buf);
+  }
+  CHECK(cache_evictions == 0);
+  for (uint32_t i = 0; i < ENTRIES; i++)
+  {
+    bool hit = peek_cache_block(i % LUNS, i * 61357, buf);
+    CHECK(hit && stamped(buf, i % LUNS, i * 61357, i));
+  }
+  versions = ENTRIES;
+  for (uint32_t i = 0; i < ENTRIES; i++)
+    blocks[key(i % LUNS, i * 61357)] = { i, false };
+
+  // Random reads, fills and writes, checking every hit, and that no dirty
+  // block is ever missing.
+  srandom(3);
+  std::vector<uint32_t> p = pool();
+  uint32_t hits = 0;
+  for (uint32_t op = 0; op < OPS; op++)
+  {
+    uint8_t lun = random() % LUNS;
+    uint32_t block = p[random() % p.size()];
+    auto it = blocks.find(key(lun, block));
+    switch (random() % 8)
+    {
+      case 0: case 1: case 2: case 3:
+        if (read_cache_block(lun, block, buf))
+        {
+          hits++;
+          CHECK(it != blocks.end() && stamped(buf, lun, block,
+            it->second.version));
+        }
+        else CHECK(it == blocks.end() || !it->second.dirty);
+        break;
+      case 4: case 5: case 6:
+        // A fill from the remote host leaves a dirty block alone.
+        stamp(buf, lun, block, ++versions);
+        put_cache_block(lun, block, buf);
+        if (it == blocks.end()) blocks[key(lun, block)] = { versions, false };
+        else if (!it->second.dirty) it->second.version = versions;
+        break;
+      default:
+        stamp(buf, lun, block, ++versions);
+        if (put_dirty_cache_block(lun, block, buf))
+        {
+          if (it == blocks.end() || !it->second.dirty) dirty[lun]++;
+          blocks[key(lun, block)] = { versions, true };
+        }
+        else CHECK(it == blocks.end() || !it->second.dirty);
+    }
+    if (op % 1000 == 999)
+      for (uint8_t l = 0; l < LUNS; l++) flush(l);
+  }
+  for (uint8_t l = 0; l < LUNS; l++) flush(l);
+  CHECK(hits > OPS / 20);
+
+  // Each LUN's entries add up to the whole cache.
+  uint32_t held = 0;
+  for (uint8_t l = 0; l < LUNS; l++) held += cache_luns[l].blocks;
+  CHECK(held == ENTRIES);
+
+  // A clean block held to fill a gap in a flush outlasts a cache's worth of
+  // new blocks, and a write to it meanwhile is kept for the next flush.
+  uint32_t before = dirty_cache_blocks();
+  stamp(buf, 0, 7, ++versions);
+  put_cache_block(0, 7, buf);
+  CHECK(hold_cache_block(0, 7, buf) && stamped(buf, 0, 7, versions));
+  CHECK(!hold_cache_block(0, 7, buf));
+  CHECK(dirty_cache_blocks() == before + 1);
+  for (uint32_t i = 0; i < ENTRIES; i++)
+  {
+    stamp(buf, 1, i, i);
+    put_cache_block(1, i, buf);
+  }
+  CHECK(peek_cache_block(0, 7, buf) && stamped(buf, 0, 7, versions));
+  stamp(buf, 0, 7, ++versions);
+  CHECK(put_dirty_cache_block(0, 7, buf));
+  flushed_cache_block(0, 7, true);
+  CHECK(dirty_cache_blocks() == before + 1);
+  CHECK(clean_cache_block(0, 7, buf) && stamped(buf, 0, 7, versions));
+  flushed_cache_block(0, 7, true);
+  CHECK(dirty_cache_blocks() == before);
+
+  return check_done("test_cache");
+}
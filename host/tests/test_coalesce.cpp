@@ -0,0 +1,97 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Remote writes issued for a FAT32 file copy, with and without write-back.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "workload.h"
+#include "check.h"
+#include <string.h>
+#include <sys/wait.h>
+
+#define DISK_MB 16
+#define SECTORS (DISK_MB * 1024 * 1024 / 512)
+
+static uint8_t image[DISK_MB * 1024 * 1024], disk[DISK_MB * 1024 * 1024];
+
+// Replay the copy, then eject so that write-back flushes, and check the
+// remote host ends up with every write.
+static struct sim_remote replay(uint32_t write_back)
+{
+  struct trace_rec *recs;
+  uint32_t n = workload_make("fat32-copy", SECTORS, 1, &recs);
+  CHECK(n > 100);
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(4096, DISK_SECTOR_SIZE);
+  sim_links[0].backing_file = check_tmpfile();
+  DISK_SECTOR_COUNT[0] = SECTORS;
+  DISK_WRITE_BACK = write_back;
+  sim_start();
+  CHECK(sim_wait_media(0, 5000));
+
+  static uint8_t buf[DISK_MB * 1024 * 1024];
+  for (uint32_t i = 0; i < n; i++)
+  {
+    struct trace_rec *r = &recs[i];
+    int32_t bytes = r->count * 512;
+    if (r->lun || r->lba + r->count > SECTORS) continue;
+    if (r->op == TRACE_WRITE)
+    {
+      memset(buf, i, bytes);
+      memcpy(image + r->lba * 512, buf, bytes);
+      CHECK(sim_write(0, r->lba, buf, bytes) == bytes);
+    }
+    else
+    {
+      CHECK(sim_read(0, r->lba, buf, bytes) == bytes);
+      CHECK(!memcmp(buf, image + r->lba * 512, bytes));
+    }
+  }
+  CHECK(sim_eject(0));
+  free(recs);
+
+  FILE *f = fopen(sim_links[0].backing_file, "rb");
+  CHECK(f && fread(disk, 1, sizeof disk, f) == sizeof disk);
+  if (f) fclose(f);
+  CHECK(!memcmp(disk, image, sizeof disk));
+  return sim_remotes[0];
+}
+
+int main(void)
+{
+  // Each setup() is once per process, so each run is in a child, which
+  // passes back what the remote host served.
+  struct sim_remote r[2] = { { 0 } };
+  static const uint32_t modes[2] = { 0, 4096 };
+  for (int m = 0; m < 2; m++)
+  {
+    int fds[2];
+    CHECK(!pipe(fds));
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid)
+    {
+      struct sim_remote got = replay(modes[m]);
+      CHECK(write(fds[1], &got, sizeof got) == sizeof got);
+      exit(check_failures ? 1 : 0);
+    }
+    close(fds[1]);
+    CHECK(read(fds[0], &r[m], sizeof r[m]) == sizeof r[m]);
+    close(fds[0]);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+      !WEXITSTATUS(status));
+    printf("write-back=%u remote writes=%u wr-MB=%.1f avg-kB=%.1f\n",
+      modes[m], r[m].writes, r[m].write_bytes / 1e6,
+      r[m].writes ? r[m].write_bytes / 1024.0 / r[m].writes : 0.0);
+  }
+
+  // Coalescing dirty sectors sends the same data in far fewer writes.
+  CHECK(r[0].writes && r[1].writes);
+  CHECK(r[1].writes * 8 < r[0].writes);
+  CHECK(r[1].write_bytes <= r[0].write_bytes + r[0].write_bytes / 8);
+
+  return check_done("test_coalesce");
+}
@@ -0,0 +1,83 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Requests the remote host fails are reported to the USB host, not retried
+// for ever.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "cache.h"
+#include "check.h"
+#include <string.h>
+#include <sys/wait.h>
+
+#define SECTORS 4096
+#define BAD_LBA 1000
+#define BAD_COUNT 8
+
+static uint8_t buf[64 * 512], want[64 * 512];
+
+static void start(uint32_t write_back)
+{
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(2048, DISK_SECTOR_SIZE);
+  sim_links[0].backing_file = check_tmpfile();
+  sim_links[0].bad_lba = BAD_LBA;
+  sim_links[0].bad_count = BAD_COUNT;
+  DISK_SECTOR_COUNT[0] = SECTORS;
+  DISK_WRITE_BACK = write_back;
+  sim_start();
+  CHECK(sim_wait_media(0, 5000));
+  for (uint32_t i = 0; i < sizeof want; i++) want[i] = i * 7 + 1;
+}
+
+// A failed flush leaves the sectors dirty and lets an eject finish, and
+// they reach the remote host once it can take them.
+static void write_back(void)
+{
+  start(256);
+  CHECK(sim_write(0, BAD_LBA, want, 8 * 512) == 8 * 512);
+  CHECK(sim_write(0, 0, want, 8 * 512) == 8 * 512);
+  CHECK(sim_eject(0));
+  CHECK(dirty_cache_blocks() == 8);
+  sim_links[0].bad_count = 0;
+  CHECK(sim_eject(0));
+  CHECK(dirty_cache_blocks() == 0);
+
+  FILE *f = fopen(sim_links[0].backing_file, "rb");
+  CHECK(f && !fseek(f, BAD_LBA * 512, SEEK_SET) &&
+    fread(buf, 1, 8 * 512, f) == 8 * 512 && !memcmp(buf, want, 8 * 512));
+  if (f) fclose(f);
+}
+
+int main(void)
+{
+  // Each setup() is once per process, so write-back runs in a child.
+  pid_t pid = fork();
+  if (!pid)
+  {
+    write_back();
+    exit(check_done("test_errors write-back") ? 1 : 0);
+  }
+
+  start(0);
+  // Reads and writes touching a bad sector fail, and others still work.
+  CHECK(sim_read(0, BAD_LBA, buf, 512) == -1);
+  CHECK(sim_read(0, BAD_LBA - 4, buf, 8 * 512) == -1);
+  CHECK(sim_write(0, BAD_LBA + 4, want, 8 * 512) == -1);
+  CHECK(sim_write(0, 0, want, 64 * 512) == 64 * 512);
+  CHECK(sim_read(0, 0, buf, 64 * 512) == 64 * 512);
+  CHECK(!memcmp(buf, want, 64 * 512));
+
+  // A failed read leaves nothing behind in the cache.
+  sim_links[0].bad_count = 0;
+  CHECK(sim_read(0, BAD_LBA - 4, buf, 8 * 512) == 8 * 512);
+  memset(want, 0, sizeof want);
+  CHECK(!memcmp(buf, want, 8 * 512));
+
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+    !WEXITSTATUS(status));
+  return check_done("test_errors");
+}
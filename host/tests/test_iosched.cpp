@@ -0,0 +1,145 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Routing of conflicting requests and spreading of the rest over channels.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "iosched.h"
+#include "check.h"
+#include <stdint.h>
+
+static int tags[64];
+
+// Pick and push, returning the channel or -1.
+static int send(struct ios *s, uint32_t lba, uint32_t count, bool write,
+  int tag)
+{
+  int c = ios_pick(s, lba, count, write);
+  if (c >= 0) ios_push(s, c, lba, count, write, &tags[tag]);
+  return c;
+}
+
+static void spreading(void)
+{
+  struct ios s;
+  ios_init(&s, 2);
+  // Unrelated requests go to the least busy channel in turn.
+  CHECK(send(&s, 0, 8, false, 0) == 0);
+  CHECK(send(&s, 100, 8, false, 1) == 1);
+  CHECK(send(&s, 200, 8, true, 2) == 0);
+  CHECK(send(&s, 300, 8, true, 3) == 1);
+  CHECK(s.queued == 4);
+  // Reads of the same sectors do not conflict.
+  CHECK(send(&s, 0, 8, false, 4) == 0);
+  CHECK(send(&s, 4, 8, false, 5) == 1);
+  // Nor do requests that only touch.
+  CHECK(send(&s, 208, 8, true, 6) == 0);
+  CHECK(send(&s, 192, 8, true, 7) == 1);
+
+  // Answers come back in order on each channel.
+  CHECK(ios_oldest(&s, 0) == &tags[0]);
+  CHECK(ios_pop(&s, 0) == &tags[0]);
+  CHECK(ios_pop(&s, 0) == &tags[2]);
+  CHECK(ios_pop(&s, 1) == &tags[1]);
+  CHECK(s.queued == 5);
+  // Channel 0 now has fewer waiting.
+  CHECK(send(&s, 500, 8, false, 8) == 0);
+}
+
+static void conflicts(void)
+{
+  struct ios s;
+  ios_init(&s, 3);
+  CHECK(send(&s, 0, 8, false, 0) == 0);
+  CHECK(send(&s, 100, 8, true, 1) == 1);
+  CHECK(send(&s, 200, 8, false, 2) == 2);
+  // A write over a queued read, and a read over a queued write, each follow
+  // it even though another channel is idler.
+  CHECK(send(&s, 4, 1, true, 3) == 0);
+  CHECK(send(&s, 107, 4, false, 4) == 1);
+  CHECK(send(&s, 0, 300, false, 5) == -1);
+  // A write over requests on two channels must wait for one of them.
+  CHECK(send(&s, 0, 150, true, 6) == -1);
+  CHECK(ios_pop(&s, 0) == &tags[0]);
+  CHECK(ios_pop(&s, 0) == &tags[3]);
+  CHECK(send(&s, 0, 150, true, 6) == 1);
+  CHECK(s.queued == 4);
+}
+
+static void full(void)
+{
+  struct ios s;
+  ios_init(&s, 2);
+  for (int i = 0; i < IOS_DEPTH; i++) CHECK(send(&s, 0, 8, true, i) == 0);
+  // A conflicting request waits for its channel, others go elsewhere.
+  CHECK(send(&s, 0, 8, false, 20) == -1);
+  for (int i = 0; i < IOS_DEPTH; i++)
+    CHECK(send(&s, 100 + i * 8, 8, false, 20 + i) == 1);
+  CHECK(send(&s, 1000, 8, false, 40) == -1);
+  CHECK(ios_pop(&s, 1) == &tags[20]);
+  CHECK(send(&s, 1000, 8, false, 40) == 1);
+
+  ios_init(&s, IOS_MAX_CHANNELS + 2);
+  CHECK(s.channels == IOS_MAX_CHANNELS);
+  ios_init(&s, 0);
+  CHECK(send(&s, 0, 8, false, 0) == -1);
+  CHECK(!ios_oldest(&s, 0) && !ios_pop(&s, 0));
+}
+
+// Any two conflicting requests in flight at once must be on one channel,
+// in the order sent, and every channel stays within its depth.
+static void random_load(void)
+{
+  struct sent { uint32_t lba, count; bool write; int seq; };
+  struct ios s;
+  static struct sent reqs[1 << 16];
+  int seq = 0;
+  ios_init(&s, 3);
+  srandom(2);
+  for (int op = 0; op < 20000; op++)
+  {
+    if (random() % 2)
+    {
+      struct sent *r = &reqs[seq % (1 << 16)];
+      r->lba = random() % 256;
+      r->count = 1 + random() % 16;
+      r->write = random() % 3 == 0;
+      r->seq = seq;
+      int c = ios_pick(&s, r->lba, r->count, r->write);
+      if (c < 0) continue;
+      CHECK(c < s.channels && s.chan[c].queued < IOS_DEPTH);
+      ios_push(&s, c, r->lba, r->count, r->write, r);
+      seq++;
+    }
+    else ios_pop(&s, random() % s.channels);
+
+    for (int a = 0; a < s.channels; a++)
+      for (int i = 0; i < s.chan[a].queued; i++)
+      {
+        const struct sent *x = (const struct sent*)
+          s.chan[a].q[(s.chan[a].head + i) % IOS_DEPTH].ctx;
+        for (int b = 0; b < s.channels; b++)
+          for (int j = 0; j < s.chan[b].queued; j++)
+          {
+            const struct sent *y = (const struct sent*)
+              s.chan[b].q[(s.chan[b].head + j) % IOS_DEPTH].ctx;
+            if (x == y || !(x->write || y->write) ||
+              x->lba >= y->lba + y->count || y->lba >= x->lba + x->count)
+              continue;
+            CHECK(a == b);
+            CHECK((i < j) == (x->seq < y->seq));
+          }
+      }
+  }
+  CHECK(seq > 1000);
+}
+
+int main(void)
+{
+  spreading();
+  conflicts();
+  full();
+  random_load();
+  return check_done("test_iosched");
+}
@@ -0,0 +1,220 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// The IPC slot rings, with pthreads standing in for the tasks.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "ipc.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+
+#define REQUESTERS 2
+#define REQUESTS 3000
+#define STOP 0xFFFFFFFF
+
+// What the server puts in the payload for a request.
+static uint32_t answer(uint8_t lun, uint32_t lba)
+{
+  return lba * 2654435761u ^ lun;
+}
+
+static void handshake(void)
+{
+  CHECK(!ipc_wait_ready(0, 0));
+  ipc_signal_ready(0);
+  CHECK(ipc_wait_ready(0, 0));
+  CHECK(!ipc_wait_ready(0, 0));
+  CHECK(!ipc_wait_ready(1, 0));
+}
+
+static void slots(void)
+{
+  // A LUN has IPC_SLOTS slots of its own, and no more.
+  struct ipc_msg *m[IPC_SLOTS];
+  for (int i = 0; i < IPC_SLOTS; i++)
+  {
+    m[i] = ipc_alloc(0, 0);
+    CHECK(m[i] && m[i]->lun == 0 && m[i]->status == 0 && !m[i]->copied);
+    for (int j = 0; j < i; j++) CHECK(m[i] != m[j] && m[i]->id != m[j]->id);
+  }
+  CHECK(!ipc_alloc(0, 0));
+  CHECK(!ipc_alloc(0, 5));
+
+  // Other LUNs are unaffected.
+  struct ipc_msg *other = ipc_alloc(1, 0);
+  CHECK(other && other->lun == 1);
+
+  // A freed slot can be taken again, with a new ID.
+  uint32_t id = m[2]->id;
+  ipc_free(m[2]);
+  m[2] = ipc_alloc(0, 0);
+  CHECK(m[2] && m[2]->id != id);
+
+  for (int i = 0; i < IPC_SLOTS; i++) ipc_free(m[i]);
+  ipc_free(other);
+}
+
+static void ordering(void)
+{
+  // Requests reach the server in the order submitted, and each requester
+  // wakes for its own completion, whatever order they are completed in.
+  struct ipc_msg *m[IPC_SLOTS];
+  for (int i = 0; i < IPC_SLOTS; i++)
+  {
+    m[i] = ipc_alloc(2, 0);
+    m[i]->host_cmd = USB_READ;
+    m[i]->lba = i;
+    ipc_submit(m[i]);
+  }
+  CHECK(!ipc_next(1, 0));
+  struct ipc_msg *got[IPC_SLOTS];
+  for (int i = 0; i < IPC_SLOTS; i++)
+  {
+    got[i] = ipc_next(2, 0);
+    CHECK(got[i] == m[i] && got[i]->lba == (uint32_t)i);
+  }
+  CHECK(!ipc_next(2, 0));
+  static const int order[] = { 3, 1, 0, 2 };
+  for (int i : order) ipc_complete(got[i]->id);
+  for (int i = 0; i < IPC_SLOTS; i++) ipc_wait(m[i]);
+
+  // Payload copies are counted, and totted up when freed.
+  uint32_t requests = ipc_requests, copied = ipc_bytes_copied;
+  uint8_t in[IPC_BUF_SIZE], out[IPC_BUF_SIZE];
+  for (int i = 0; i < IPC_BUF_SIZE; i++) in[i] = i * 7;
+  ipc_copy_in(m[0], in, IPC_BUF_SIZE);
+  ipc_copy_out(m[0], out, 100);
+  CHECK(m[0]->copied == IPC_BUF_SIZE + 100 && !memcmp(in, out, 100));
+  for (int i = 0; i < IPC_SLOTS; i++) ipc_free(m[i]);
+  CHECK(ipc_requests == requests + IPC_SLOTS);
+  CHECK(ipc_bytes_copied == copied + IPC_BUF_SIZE + 100);
+}
+
+// Stands in for an SSH task.  It takes whatever requests are queued, then
+// completes them in reverse, so requests are completed out of order.
+static void *server(void *arg)
+{
+  uint8_t lun = (uintptr_t)arg;
+  uint32_t last[REQUESTERS] = { 0 };
+  for (bool stop = false; !stop; )
+  {
+    struct ipc_msg *batch[IPC_SLOTS];
+    int n = 0;
+    batch[n++] = ipc_next(lun, portMAX_DELAY);
+    while (n < IPC_SLOTS && (batch[n] = ipc_next(lun, 0))) n++;
+    // Each requester's requests arrive in order.
+    for (int i = 0; i < n; i++)
+    {
+      uint32_t who = batch[i]->lba >> 24, seq = batch[i]->lba & 0xFFFFFF;
+      if (batch[i]->lba == STOP) continue;
+      CHECK(who < REQUESTERS && seq > last[who]);
+      if (who < REQUESTERS) last[who] = seq;
+    }
+    for (int i = n - 1; i >= 0; i--)
+    {
+      struct ipc_msg *m = batch[i];
+      if (m->lba == STOP) stop = true;
+      else
+      {
+        CHECK(m->lun == lun);
+        uint32_t a = answer(lun, m->lba);
+        memcpy(m->data, &a, sizeof a);
+      }
+      ipc_complete(m->id);
+    }
+  }
+  return NULL;
+}
+
+struct requester
+{
+  uint8_t lun, who;
+};
+
+// The sequence number of every request allocated by the requesters.
+static uint32_t seqs[IPC_LUNS * REQUESTERS * REQUESTS], nseqs;
+
+// Stands in for the USB task, keeping two requests in flight.
+static void *requester(void *arg)
+{
+  struct requester *r = (struct requester*)arg;
+  struct ipc_msg *prev = NULL;
+  for (uint32_t seq = 1; seq <= REQUESTS + 1; seq++)
+  {
+    struct ipc_msg *m = NULL;
+    if (seq <= REQUESTS)
+    {
+      m = ipc_alloc(r->lun, portMAX_DELAY);
+      seqs[__atomic_fetch_add(&nseqs, 1, __ATOMIC_RELAXED)] = m->id >> 8;
+      m->host_cmd = USB_READ;
+      m->lba = (uint32_t)r->who << 24 | seq;
+      m->dlen = sizeof (uint32_t);
+      ipc_submit(m);
+    }
+    if (prev)
+    {
+      ipc_wait(prev);
+      uint32_t a;
+      memcpy(&a, prev->data, sizeof a);
+      CHECK(a == answer(r->lun, prev->lba));
+      ipc_free(prev);
+    }
+    prev = m;
+  }
+  return NULL;
+}
+
+static void concurrency(void)
+{
+  pthread_t servers[IPC_LUNS], requesters[IPC_LUNS][REQUESTERS];
+  struct requester args[IPC_LUNS][REQUESTERS];
+  uint32_t requests = ipc_requests;
+  for (uintptr_t lun = 0; lun < IPC_LUNS; lun++)
+  {
+    pthread_create(&servers[lun], NULL, server, (void*)lun);
+    for (uint8_t w = 0; w < REQUESTERS; w++)
+    {
+      args[lun][w] = { (uint8_t)lun, w };
+      pthread_create(&requesters[lun][w], NULL, requester, &args[lun][w]);
+    }
+  }
+  for (uint8_t lun = 0; lun < IPC_LUNS; lun++)
+  {
+    for (int w = 0; w < REQUESTERS; w++)
+      pthread_join(requesters[lun][w], NULL);
+    struct ipc_msg *m = ipc_alloc(lun, portMAX_DELAY);
+    m->lba = STOP;
+    ipc_submit(m);
+    ipc_wait(m);
+    ipc_free(m);
+    pthread_join(servers[lun], NULL);
+  }
+  CHECK(ipc_requests == requests + IPC_LUNS * (REQUESTERS * REQUESTS + 1));
+
+  // No two requests were given the same sequence number.
+  CHECK(nseqs == sizeof seqs / sizeof *seqs);
+  std::sort(seqs, seqs + nseqs);
+  CHECK(std::adjacent_find(seqs, seqs + nseqs) == seqs + nseqs);
+
+  // Every slot is free again.
+  for (uint8_t lun = 0; lun < IPC_LUNS; lun++)
+  {
+    struct ipc_msg *m[IPC_SLOTS];
+    for (int i = 0; i < IPC_SLOTS; i++) CHECK((m[i] = ipc_alloc(lun, 0)));
+    CHECK(!ipc_alloc(lun, 0));
+    for (int i = 0; i < IPC_SLOTS; i++) if (m[i]) ipc_free(m[i]);
+  }
+}
+
+int main(void)
+{
+  init_ipc(IPC_LUNS);
+  handshake();
+  slots();
+  ordering();
+  concurrency();
+  return check_done("test_ipc");
+}
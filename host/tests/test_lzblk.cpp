@@ -0,0 +1,121 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// LZ4 block round trips at the lengths and contents the wire carries.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "lzblk.h"
+#include "check.h"
+#include <string.h>
+
+#define MAX LZ_MAX_INPUT
+// The worst case for incompressible input is one token plus a length byte
+// for every 255 literals.
+#define BOUND(n) ((n) + (n) / 255 + 16)
+
+static uint8_t src[MAX], comp[BOUND(MAX)], out[MAX + 1];
+
+enum { RANDOM, ZERO, SECTOR, KINDS };
+static const char *kind_names[] = { "random", "zero", "sector" };
+
+static void fill(int kind, int len, uint32_t seed)
+{
+  srandom(seed);
+  for (int i = 0; i < len; i++)
+    switch (kind)
+    {
+      case RANDOM: src[i] = random(); break;
+      case ZERO: src[i] = 0; break;
+      // Directory entries and FAT runs: short repeats among fresh bytes.
+      default:
+        src[i] = i % 32 < 11 ? "FILE    TXT"[i % 32] :
+          i % 32 < 16 ? 0 : random() % 4;
+    }
+}
+
+// Compress, decompress, and compare, returning the compressed length.
+static int round_trip(int kind, int len)
+{
+  int c = lz_compress(src, len, comp, BOUND(len));
+  CHECK(c > 0);
+  if (c <= 0) return c;
+  memset(out, 0xA5, len + 1);
+  int d = lz_decompress(comp, c, out, len);
+  CHECK(d == len);
+  CHECK(!memcmp(src, out, len));
+  // Nothing is written past the end of the output.
+  CHECK(out[len] == 0xA5);
+  if (d != len || memcmp(src, out, len))
+    fprintf(stderr, "  %s, %d bytes\n", kind_names[kind], len);
+  return c;
+}
+
+int main(void)
+{
+  // Either side of the minimum match, the end-of-block limits, a sector, a
+  // chunk, and the largest input allowed.
+  static const int lens[] = { 0, 1, 4, 5, 11, 12, 13, 16, 17, 255, 256,
+    511, 512, 513, 4095, 4096, 4097, MAX - 1, MAX };
+  for (int kind = 0; kind < KINDS; kind++)
+    for (int len : lens)
+    {
+      fill(kind, len, len);
+      int c = round_trip(kind, len);
+      // Zeroes collapse and sector-like data shrinks once there is room
+      // for a match.
+      if (kind == ZERO && len >= 64) CHECK(c < len / 16);
+      if (kind == SECTOR && len >= 64) CHECK(c < len * 3 / 4);
+    }
+
+  // Random data never fits in one byte less than it came in, which is the
+  // cap the firmware uses to decide whether to send a chunk compressed.
+  for (int len : lens)
+  {
+    fill(RANDOM, len, len + 1);
+    CHECK(lz_compress(src, len, comp, len - 1 > 0 ? len - 1 : 0) == -1);
+  }
+
+  // The exact compressed length is enough; one byte less is not.
+  fill(SECTOR, 4096, 7);
+  int c = lz_compress(src, 4096, comp, sizeof comp);
+  CHECK(lz_compress(src, 4096, comp, c) == c);
+  CHECK(lz_compress(src, 4096, comp, c - 1) == -1);
+  CHECK(lz_decompress(comp, c, out, 4096) == 4096);
+  CHECK(lz_decompress(comp, c, out, 4095) == -1);
+  CHECK(lz_compress(src, MAX + 1, comp, sizeof comp) == -1);
+
+  // Every random length from a mix of the kinds.
+  for (int i = 0; i < 300; i++)
+  {
+    int len = random() % (MAX + 1);
+    fill(i % KINDS, len, i);
+    round_trip(i % KINDS, len);
+  }
+
+  // Damaged input is refused rather than overrunning either buffer.
+  c = lz_compress(src, 4096, comp, sizeof comp);
+  for (int cut = 1; cut < c; cut += 7)
+  {
+    int d = lz_decompress(comp, cut, out, 4096);
+    CHECK(d <= 4096);
+  }
+  static const uint8_t bad_offset[] = { 0x10, 'A', 0x05, 0x00 };
+  CHECK(lz_decompress(bad_offset, sizeof bad_offset, out, 4096) == -1);
+  static const uint8_t zero_offset[] = { 0x10, 'A', 0x00, 0x00 };
+  CHECK(lz_decompress(zero_offset, sizeof zero_offset, out, 4096) == -1);
+  static const uint8_t long_literals[] = { 0xF0, 0xFF, 0xFF };
+  CHECK(lz_decompress(long_literals, sizeof long_literals, out, 4096) == -1);
+  srandom(99);
+  for (int i = 0; i < 2000; i++)
+  {
+    int len = 1 + random() % 64;
+    for (int j = 0; j < len; j++) comp[j] = random();
+    out[512] = 0xA5;
+    int d = lz_decompress(comp, len, out, 512);
+    CHECK(d <= 512);
+    CHECK(out[512] == 0xA5);
+  }
+
+  return check_done("test_lzblk");
+}
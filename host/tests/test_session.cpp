@@ -0,0 +1,218 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// The SSH task riding out sshd being restarted under it, with the real
+// block server behind a stand-in for sshd.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "session.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define SECTORS 2048
+#define SECTOR 512
+#define RESTARTS 3
+
+static const char *sock, *sshd_log;
+static pid_t sshd;
+static struct session sessions[IPC_LUNS];
+static uint8_t model[SECTORS * SECTOR];
+static volatile bool stop;
+static uint32_t requests, replayed;
+
+static void *serve(void *arg)
+{
+  session_main((struct session*)arg);
+  return NULL;
+}
+
+static void start_session(uint8_t lun, const char *block_server,
+  const char *backing_file)
+{
+  pthread_t t;
+  sessions[lun].lun = lun;
+  sessions[lun].block_server = block_server;
+  sessions[lun].backing_file = backing_file;
+  pthread_create(&t, NULL, serve, &sessions[lun]);
+  CHECK(ipc_wait_ready(lun, 10000));
+}
+
+static void restart_sshd(void)
+{
+  sim_sshd_stop(sshd);
+  sshd = sim_sshd_start(sock, sshd_log);
+  CHECK(sshd > 0);
+}
+
+// Lines of a file starting with prefix.
+static int count_lines(const char *path, const char *prefix)
+{
+  char line[256];
+  int n = 0;
+  FILE *f = fopen(path, "r");
+  if (!f) return 0;
+  while (fgets(line, sizeof line, f))
+    if (!strncmp(line, prefix, strlen(prefix))) n++;
+  fclose(f);
+  return n;
+}
+
+static bool wait_lines(const char *path, const char *prefix, int n)
+{
+  for (int ms = 0; ms < 10000; ms += 10)
+  {
+    if (count_lines(path, prefix) >= n) return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+// Batches of reads and writes, each read checked against the writes before
+// it.  Overlapping requests in a batch must stay in order, however often
+// they are sent.
+static void *traffic(void *arg)
+{
+  static uint8_t want[IPC_SLOTS][IPC_BUF_SIZE];
+  while (!stop)
+  {
+    struct ipc_msg *m[IPC_SLOTS];
+    for (int i = 0; i < IPC_SLOTS; i++)
+    {
+      uint32_t count = 1 + random() % (IPC_BUF_SIZE / SECTOR);
+      m[i] = ipc_alloc(0, portMAX_DELAY);
+      m[i]->secsz = SECTOR;
+      m[i]->lba = random() % (SECTORS - count);
+      m[i]->dlen = count * SECTOR;
+      uint8_t *at = model + m[i]->lba * SECTOR;
+      if (random() % 2)
+      {
+        m[i]->host_cmd = USB_WRITE;
+        bool zeros = random() % 8 == 0;
+        for (uint32_t b = 0; b < m[i]->dlen; b++)
+          m[i]->data[b] = zeros ? 0 : random();
+        memcpy(at, m[i]->data, m[i]->dlen);
+      }
+      else
+      {
+        m[i]->host_cmd = USB_READ;
+        memcpy(want[i], at, m[i]->dlen);
+      }
+      ipc_submit(m[i]);
+    }
+    for (int i = 0; i < IPC_SLOTS; i++)
+    {
+      ipc_wait(m[i]);
+      CHECK(m[i]->status == 0);
+      if (m[i]->host_cmd == USB_READ)
+        CHECK(!memcmp(m[i]->data, want[i], m[i]->dlen));
+      if (m[i]->lost) replayed++;
+      requests++;
+      ipc_free(m[i]);
+    }
+  }
+  return NULL;
+}
+
+// Every request outstanding when sshd goes is sent again once reconnected,
+// so the data reads back the same.
+static void replay(const char *serial)
+{
+  const char *backing = check_tmpfile();
+  CHECK(!truncate(backing, sizeof model));
+  start_session(0, "build/wifimsc-blockd", backing);
+
+  pthread_t t;
+  srandom(1);
+  pthread_create(&t, NULL, traffic, NULL);
+  // Each time once reconnected and busy again.
+  for (int r = 1; r <= RESTARTS; r++)
+  {
+    CHECK(wait_lines(serial, "%SSH Block server lun=0", r));
+    usleep(200000);
+    restart_sshd();
+  }
+  CHECK(wait_lines(serial, "%SSH Block server lun=0", RESTARTS + 1));
+  usleep(200000);
+  stop = true;
+  pthread_join(t, NULL);
+  CHECK(requests > 200);
+  CHECK(replayed > 0);
+  CHECK(count_lines(serial, "%SSH Session lost lun=0") >= RESTARTS);
+  CHECK(count_lines(sshd_log, "dd ") == 0);
+
+  uint8_t buf[IPC_BUF_SIZE];
+  for (uint32_t lba = 0; lba < SECTORS; lba += sizeof buf / SECTOR)
+  {
+    struct ipc_msg *m = ipc_alloc(0, portMAX_DELAY);
+    m->host_cmd = USB_READ;
+    m->secsz = SECTOR;
+    m->lba = lba;
+    m->dlen = sizeof buf;
+    ipc_submit(m);
+    ipc_wait(m);
+    CHECK(m->status == 0 &&
+      !memcmp(m->data, model + lba * SECTOR, m->dlen));
+    ipc_free(m);
+  }
+
+  int fd = open(backing, O_RDONLY);
+  for (uint32_t off = 0; off < sizeof model; off += sizeof buf)
+    CHECK(pread(fd, buf, sizeof buf, off) == sizeof buf &&
+      !memcmp(buf, model + off, sizeof buf));
+  close(fd);
+}
+
+// A request outstanding on every session lost, such as a read that never
+// finishes, fails once SSH_REPLAY_TRIES sessions have gone rather than be
+// sent for ever.  With no block server, dd reads from a FIFO with no writer,
+// and so never finishes.
+static void give_up(void)
+{
+  const char *fifo = check_tmpfile();
+  unlink(fifo);
+  CHECK(!mkfifo(fifo, 0600));
+  start_session(1, "false", fifo);
+
+  struct ipc_msg *m = ipc_alloc(1, portMAX_DELAY);
+  m->host_cmd = USB_READ;
+  m->secsz = SECTOR;
+  m->lba = 0;
+  m->dlen = SECTOR;
+  ipc_submit(m);
+  char dd[64];
+  snprintf(dd, sizeof dd, "dd if=%s ", fifo);
+  for (int r = 1; r <= 3; r++)
+  {
+    CHECK(wait_lines(sshd_log, dd, r));
+    restart_sshd();
+  }
+  ipc_wait(m);
+  CHECK(m->status == -1 && m->lost == 3);
+  ipc_free(m);
+}
+
+int main(void)
+{
+  // A hang is a failure too.
+  alarm(120);
+  const char *serial = check_tmpfile();
+  sim_serial = fopen(serial, "w");
+  setvbuf(sim_serial, NULL, _IOLBF, 0);
+  sock = check_tmpfile();
+  sshd_log = check_tmpfile();
+  sim_sshd_path = sock;
+  sshd = sim_sshd_start(sock, sshd_log);
+  CHECK(sshd > 0);
+  init_ipc(IPC_LUNS);
+
+  replay(serial);
+  give_up();
+
+  sim_sshd_stop(sshd);
+  return check_done("test_session");
+}
@@ -0,0 +1,59 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// The whole data path, from USB callbacks to the backing file, in the
+// simulator.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "cache.h"
+#include "check.h"
+#include <string.h>
+
+#define SECTORS 16384
+#define MAX_SECTORS 128
+
+static uint8_t model[SECTORS * 512], buf[MAX_SECTORS * 512];
+
+int main(void)
+{
+  sim_serial = NULL;
+  sim_heap_bytes = sim_heap_for(2048, DISK_SECTOR_SIZE);
+  sim_links[0].backing_file = check_tmpfile();
+  DISK_SECTOR_COUNT[0] = SECTORS;
+  DISK_WRITE_BACK = 512;
+  sim_start();
+  CHECK(sim_wait_media(0, 5000));
+
+  // Random extents written and read back, checked against a model of the
+  // disk.  The disk starts as zeros, as a new sparse file.
+  srandom(1);
+  for (int op = 0; op < 4000; op++)
+  {
+    uint32_t count = 1 + random() % MAX_SECTORS;
+    uint32_t lba = random() % (SECTORS - count);
+    uint8_t *want = model + lba * 512;
+    if (random() % 3 == 0)
+    {
+      for (uint32_t i = 0; i < count * 512; i++) want[i] = random();
+      CHECK(sim_write(0, lba, want, count * 512) == (int32_t)count * 512);
+    }
+    else
+    {
+      CHECK(sim_read(0, lba, buf, count * 512) == (int32_t)count * 512);
+      CHECK(!memcmp(buf, want, count * 512));
+    }
+  }
+  CHECK(cache_hits && cache_misses);
+
+  // Ejecting flushes the write-back cache to the backing file.
+  CHECK(sim_eject(0));
+  CHECK(!dirty_cache_blocks());
+  FILE *f = fopen(sim_links[0].backing_file, "rb");
+  static uint8_t disk[SECTORS * 512];
+  CHECK(f && fread(disk, 1, sizeof disk, f) == sizeof disk);
+  CHECK(!memcmp(disk, model, sizeof disk));
+  if (f) fclose(f);
+  return check_done("test_sim");
+}
@@ -0,0 +1,48 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// A trace dumped on the serial console reads back as the requests made.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "sim.h"
+#include "workload.h"
+#include "check.h"
+#include <string.h>
+
+int main(void)
+{
+  static char console[1 << 16];
+  sim_serial = fmemopen(console, sizeof console, "w");
+  setvbuf(sim_serial, NULL, _IONBF, 0);
+  sim_heap_bytes = sim_heap_for(2048, DISK_SECTOR_SIZE);
+  sim_links[0].backing_file = check_tmpfile();
+  DISK_SECTOR_COUNT[0] = 4096;
+  DISK_TRACE_RECORDS = 16;
+  sim_start();
+  CHECK(sim_wait_media(0, 5000));
+
+  // More requests than the ring holds, so only the latest are dumped.
+  static uint8_t buf[8 * 512];
+  for (uint32_t i = 0; i < 20; i++)
+    if (i % 3) CHECK(sim_read(0, i * 100, buf, (1 + i % 8) * 512) > 0);
+    else CHECK(sim_write(0, i * 100, buf, (1 + i % 8) * 512) > 0);
+  sim_serial_input("t");
+  for (int w = 0; w < 50 && !strstr(console, "%TRACE-END"); w++)
+    usleep(100000);
+
+  struct trace_rec *recs;
+  FILE *f = fmemopen(console, strlen(console), "r");
+  uint32_t n = workload_read_trace(f, &recs);
+  fclose(f);
+  CHECK(n == 16);
+  for (uint32_t r = 0; r < n && r < 16; r++)
+  {
+    uint32_t i = r + 4;
+    CHECK(recs[r].lun == 0 && recs[r].lba == i * 100 &&
+      recs[r].count == 1 + i % 8 &&
+      recs[r].op == (i % 3 ? TRACE_READ : TRACE_WRITE));
+  }
+  if (n) free(recs);
+  return check_done("test_trace");
+}
@@ -0,0 +1,73 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Dispatch of requests across several block server channels.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "iosched.h"
+#include <string.h>
+
+void ios_init(struct ios *s, int channels)
+{
+  memset(s, 0, sizeof *s);
+  s->channels = channels < IOS_MAX_CHANNELS ? channels : IOS_MAX_CHANNELS;
+}
+
+static bool _conflicts(const struct ios_channel *ch, uint32_t lba,
+  uint32_t count, bool write)
+{
+  for (int i = 0; i < ch->queued; i++)
+  {
+    const struct ios_req *r = &ch->q[(ch->head + i) % IOS_DEPTH];
+    if ((write || r->write) && lba < r->lba + r->count && r->lba < lba + count)
+      return true;
+  }
+  return false;
+}
+
+int ios_pick(const struct ios *s, uint32_t lba, uint32_t count, bool write)
+{
+  int pick = -1;
+  for (int c = 0; c < s->channels; c++)
+    if (_conflicts(&s->chan[c], lba, count, write))
+    {
+      if (pick >= 0) return -1;
+      pick = c;
+    }
+  if (pick >= 0) return s->chan[pick].queued < IOS_DEPTH ? pick : -1;
+
+  for (int c = 0; c < s->channels; c++)
+    if (s->chan[c].queued < IOS_DEPTH &&
+      (pick < 0 || s->chan[c].queued < s->chan[pick].queued)) pick = c;
+  return pick;
+}
+
+void ios_push(struct ios *s, int c, uint32_t lba, uint32_t count, bool write,
+  void *ctx)
+{
+  struct ios_channel *ch = &s->chan[c];
+  struct ios_req *r = &ch->q[(ch->head + ch->queued++) % IOS_DEPTH];
+  r->lba = lba;
+  r->count = count;
+  r->write = write;
+  r->ctx = ctx;
+  s->queued++;
+}
+
+void *ios_oldest(const struct ios *s, int c)
+{
+  const struct ios_channel *ch = &s->chan[c];
+  return ch->queued ? ch->q[ch->head].ctx : NULL;
+}
+
+void *ios_pop(struct ios *s, int c)
+{
+  struct ios_channel *ch = &s->chan[c];
+  if (!ch->queued) return NULL;
+  void *ctx = ch->q[ch->head].ctx;
+  ch->head = (ch->head + 1) % IOS_DEPTH;
+  ch->queued--;
+  s->queued--;
+  return ctx;
+}
@@ -0,0 +1,58 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Dispatch of requests across several block server channels.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// This must not depend on Arduino or FreeRTOS so that it can be built and
+// exercised on any host.  Each channel answers its requests in the order
+// sent, so a request is only ever ordered behind another by putting both on
+// the same channel.  Requests conflict if their sectors overlap and either
+// is a write.
+
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <stdint.h>
+
+#define IOS_MAX_CHANNELS 4
+// Most requests in flight on one channel.
+#define IOS_DEPTH 8
+
+struct ios_req
+{
+  uint32_t lba;
+  uint32_t count;
+  bool write;
+  void *ctx;            // The caller's request.
+};
+
+struct ios_channel
+{
+  struct ios_req q[IOS_DEPTH];
+  int head, queued;
+};
+
+struct ios
+{
+  int channels;
+  int queued;           // Over all channels.
+  struct ios_channel chan[IOS_MAX_CHANNELS];
+};
+
+void ios_init(struct ios *s, int channels);
+
+// The channel to send a request on: the one holding any requests it
+// conflicts with, otherwise the least busy.  Returns -1 if it must wait for
+// responses first, because it conflicts with requests on more than one
+// channel or the channel is full.
+int ios_pick(const struct ios *s, uint32_t lba, uint32_t count, bool write);
+
+void ios_push(struct ios *s, int c, uint32_t lba, uint32_t count, bool write,
+  void *ctx);
+// The oldest request on channel c, which is answered next, or NULL.
+void *ios_oldest(const struct ios *s, int c);
+void *ios_pop(struct ios *s, int c);
+
+#endif /* IOSCHED_H */
@@ -6,11 +6,169 @@
 // https://www.ewan.cc
 
 #include "ipc.h"
+#include "perf.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
-MessageBufferHandle_t usb_to_ssh, ssh_to_usb;
+// A ring of request slots for each LUN.  Slot indices are passed through
+// the queues and each slot has its own completion semaphore, so several
+// requests can be outstanding and each requester waits only for its own.
+// Request IDs carry a sequence number above the slot index to catch stale
+// completions.  Each LUN has its own slots, so one whose remote host is
+// slow or reconnecting cannot hold up the others.
+static struct ipc_msg slots[IPC_LUNS * IPC_SLOTS];
+static unsigned char *bufs;
+static SemaphoreHandle_t done[IPC_LUNS * IPC_SLOTS];
+static QueueHandle_t free_slots[IPC_LUNS], usb_to_ssh[IPC_LUNS];
+static SemaphoreHandle_t ssh_ready[IPC_LUNS];
+static uint32_t ipc_seq = 0;
 
-void init_ipc(void)
+uint32_t ipc_requests = 0, ipc_bytes_moved = 0, ipc_bytes_copied = 0;
+
+// Request sizing.  Each period of IPC_SIZE_SAMPLES requests near the current
+// size measures its throughput.  The size keeps stepping the same way, by
+// doubling or halving, while throughput improves by an eighth or more, and
+// turns back when it gets worse by as much.  Requests taking longer than
+// IPC_TARGET_MS on average always halve it, to keep USB commands well
+// inside host timeouts on a poor link.
+#define IPC_SIZE_SAMPLES 8
+#define IPC_TARGET_MS 250
+
+// Each LUN may be on a different remote host, so is sized separately.
+struct ipc_sizing
+{
+  uint32_t xfer;
+  uint32_t period_n, period_ms, period_rate;
+  uint64_t period_bytes;
+  int8_t last_step;
+};
+static struct ipc_sizing sizing[IPC_LUNS];
+// Smoothed service time in ms and throughput in bytes per second.
+uint32_t ipc_srtt_ms[IPC_LUNS], ipc_rate[IPC_LUNS];
+
+void init_ipc(uint8_t luns)
+{
+  bufs = (unsigned char*)malloc(luns * IPC_SLOTS * IPC_BUF_SIZE);
+  assert(bufs && luns <= IPC_LUNS);
+  for (uint8_t lun = 0; lun < luns; lun++)
+  {
+    free_slots[lun] = xQueueCreate(IPC_SLOTS, sizeof (uint8_t));
+    usb_to_ssh[lun] = xQueueCreate(IPC_SLOTS, sizeof (uint8_t));
+    ssh_ready[lun] = xSemaphoreCreateBinary();
+    for (uint8_t s = lun * IPC_SLOTS; s < (lun + 1) * IPC_SLOTS; s++)
+    {
+      slots[s].lun = lun;
+      done[s] = xSemaphoreCreateBinary();
+      xQueueSend(free_slots[lun], &s, 0);
+    }
+    sizing[lun].xfer = 4 * IPC_MIN_XFER;
+  }
+}
+
+void ipc_signal_ready(uint8_t lun)
+{
+  xSemaphoreGive(ssh_ready[lun]);
+}
+
+bool ipc_wait_ready(uint8_t lun, TickType_t wait)
+{
+  return xSemaphoreTake(ssh_ready[lun], wait) == pdTRUE;
+}
+
+struct ipc_msg* ipc_alloc(uint8_t lun, TickType_t wait)
+{
+  uint8_t s;
+  if (xQueueReceive(free_slots[lun], &s, wait) != pdTRUE) return NULL;
+  // Requesters run on both cores, so the sequence number is taken
+  // atomically, as are the totals when a slot is freed.
+  slots[s].id = __atomic_add_fetch(&ipc_seq, 1, __ATOMIC_RELAXED) << 8 | s;
+  slots[s].data = bufs + s * IPC_BUF_SIZE;
+  slots[s].copied = 0;
+  slots[s].status = 0;
+  slots[s].lost = 0;
+  return &slots[s];
+}
+
+void ipc_submit(struct ipc_msg *msg)
+{
+  uint8_t s = msg - slots;
+  msg->submitted = perf_now();
+  xQueueSend(usb_to_ssh[msg->lun], &s, portMAX_DELAY);
+}
+
+void ipc_wait(struct ipc_msg *msg)
+{
+  xSemaphoreTake(done[msg - slots], portMAX_DELAY);
+  perf_add(PERF_IPC, msg->submitted);
+}
+
+void ipc_free(struct ipc_msg *msg)
+{
+  uint8_t s = msg - slots;
+  __atomic_fetch_add(&ipc_requests, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ipc_bytes_moved, msg->dlen, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ipc_bytes_copied, msg->copied, __ATOMIC_RELAXED);
+  xQueueSend(free_slots[msg->lun], &s, portMAX_DELAY);
+}
+
+void ipc_copy_in(struct ipc_msg *msg, const void *src, uint32_t len)
 {
-  usb_to_ssh = xMessageBufferCreate(sizeof (struct ipc_msg) + 4);
-  ssh_to_usb = xMessageBufferCreate(sizeof (struct ipc_msg) + 4);
+  memcpy(msg->data, src, len);
+  msg->copied += len;
+}
+
+void ipc_copy_out(struct ipc_msg *msg, void *dst, uint32_t len)
+{
+  memcpy(dst, msg->data, len);
+  msg->copied += len;
+}
+
+struct ipc_msg* ipc_next(uint8_t lun, TickType_t wait)
+{
+  uint8_t s;
+  if (xQueueReceive(usb_to_ssh[lun], &s, wait) != pdTRUE) return NULL;
+  perf_add(PERF_IPC_QUEUE, slots[s].submitted);
+  return &slots[s];
+}
+
+void ipc_complete(uint32_t id)
+{
+  uint8_t s = id & 0xff;
+  assert(s < IPC_LUNS * IPC_SLOTS && slots[s].id == id);
+  xSemaphoreGive(done[s]);
+}
+
+uint32_t ipc_xfer_size(uint8_t lun)
+{
+  return sizing[lun].xfer;
+}
+
+void ipc_sample(uint8_t lun, uint32_t bytes, uint32_t ms)
+{
+  struct ipc_sizing *z = &sizing[lun];
+  // Small requests say little about how the current size is doing.
+  if (bytes < z->xfer / 2) return;
+  if (!ms) ms = 1;
+  ipc_srtt_ms[lun] = ipc_srtt_ms[lun] ? (7 * ipc_srtt_ms[lun] + ms) / 8 : ms;
+  z->period_bytes += bytes;
+  z->period_ms += ms;
+  if (++z->period_n < IPC_SIZE_SAMPLES) return;
+
+  uint32_t rate = z->period_bytes * 1000 / z->period_ms;
+  int8_t step = 0;
+  if (z->period_ms / z->period_n > IPC_TARGET_MS) step = -1;
+  else if (!z->period_rate) step = 1;
+  else if (rate > z->period_rate + z->period_rate / 8)
+    step = z->last_step ? z->last_step : 1;
+  else if (rate + rate / 8 < z->period_rate)
+    step = z->last_step ? -z->last_step : -1;
+  ipc_rate[lun] = rate;
+  z->period_rate = rate;
+  z->period_n = z->period_ms = z->period_bytes = 0;
+
+  if (step > 0 && z->xfer < IPC_MAX_XFER) z->xfer *= 2;
+  else if (step < 0 && z->xfer > IPC_MIN_XFER) z->xfer /= 2;
+  else step = 0;
+  z->last_step = step;
 }
@@ -6,19 +6,77 @@
 // https://www.ewan.cc
 
 #include "FreeRTOS.h"
-#include "freertos/message_buffer.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
-extern MessageBufferHandle_t usb_to_ssh, ssh_to_usb;
+// Most logical units, each a drive of its own with its own SSH task.  No
+// more are allowed by USBMSC.
+#define IPC_LUNS 3
+// Number of requests that may be in flight to each SSH task at once.
+#define IPC_SLOTS 4
+// Size of each slot's own payload buffer.
+#define IPC_BUF_SIZE 4096
+// Largest request payload, when the requester lends its own buffer.
+#define IPC_MAX_XFER (256 * 1024)
+// Smallest size ipc_xfer_size() will suggest.
+#define IPC_MIN_XFER (8 * 1024)
 
-enum host_cmds { CREATE_BACKING_FILE, USB_READ, USB_WRITE };
+// SECTOR_CHECKSUMS fills data with the CRC-32C of each of dlen / 4 sectors
+// from lba, or sets dlen to zero if the remote host cannot checksum them.
+enum host_cmds { CREATE_BACKING_FILE, USB_READ, USB_WRITE, SECTOR_CHECKSUMS };
 
 struct ipc_msg
 {
+  uint32_t id;
+  uint8_t lun;      // Set by ipc_alloc().
   enum host_cmds host_cmd;
   uint32_t secsz;
   uint32_t lba;
-  uint16_t dlen;
-  unsigned char data[4096];
+  uint32_t dlen;
+  // Payload.  Points at the slot's own buffer after ipc_alloc(), but the
+  // requester may point it at its own memory instead, which must then stay
+  // valid until ipc_wait() returns.  Either way the SSH task reads and
+  // writes the channel directly to and from it.
+  unsigned char *data;
+  uint32_t copied;  // Payload bytes memcpy'd to get this request done.
+  // 0, or -1 if the remote host failed the request, in which case the
+  // payload of a read is not to be used.  Set by the SSH task.
+  int8_t status;
+  uint8_t lost;     // Sessions lost while the SSH task had it.
+  uint32_t sent;    // millis() when the SSH task sent it.
+  uint32_t submitted;  // perf_now() when submitted.
 };
 
-void init_ipc(void);
+// Totals over all freed requests.
+extern uint32_t ipc_requests, ipc_bytes_moved, ipc_bytes_copied;
+
+// Payload size to split large transfers to a LUN into, tuned from the time
+// taken by its remote host to serve each request.  The SSH task reports
+// each one with ipc_sample().  Estimates of the service time and throughput
+// are kept for diagnostics.
+uint32_t ipc_xfer_size(uint8_t lun);
+void ipc_sample(uint8_t lun, uint32_t bytes, uint32_t ms);
+extern uint32_t ipc_srtt_ms[IPC_LUNS], ipc_rate[IPC_LUNS];
+
+void init_ipc(uint8_t luns);
+
+// SSH task start-up handshake, one for each LUN.  Waiting returns false if
+// the SSH task was not ready within wait ticks.
+void ipc_signal_ready(uint8_t lun);
+bool ipc_wait_ready(uint8_t lun, TickType_t wait);
+
+// Requesting side.  Take a free slot for a LUN (NULL if none within wait
+// ticks), fill it in and submit it, then wait for its completion before
+// freeing it.
+struct ipc_msg* ipc_alloc(uint8_t lun, TickType_t wait);
+void ipc_submit(struct ipc_msg *msg);
+void ipc_wait(struct ipc_msg *msg);
+void ipc_free(struct ipc_msg *msg);
+// Copy payload to or from the slot's buffer, counting the bytes copied.
+void ipc_copy_in(struct ipc_msg *msg, const void *src, uint32_t len);
+void ipc_copy_out(struct ipc_msg *msg, void *dst, uint32_t len);
+
+// Servicing side.  Requests for a LUN are delivered in submission order and
+// may be completed in any order.
+struct ipc_msg* ipc_next(uint8_t lun, TickType_t wait);
+void ipc_complete(uint32_t id);
@@ -0,0 +1,132 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// LZ4 block format compression for sector data on the wire.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "lzblk.h"
+#include <string.h>
+
+// Format limits: the last match must start 12 bytes before the end and the
+// last 5 bytes are always literals.
+#define LZ_MIN_MATCH 4
+#define LZ_MFLIMIT 12
+#define LZ_LASTLITERALS 5
+#define LZ_HASH_BITS 10
+
+static inline uint32_t _read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static inline uint32_t _hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length as a 4-bit token field plus 255-valued extension bytes.
+static int _put_len(uint8_t *dst, int op, int cap, uint32_t len)
+{
+  for (len -= 15; len >= 255; len -= 255)
+  {
+    if (op >= cap) return -1;
+    dst[op++] = 255;
+  }
+  if (op >= cap) return -1;
+  dst[op++] = len;
+  return op;
+}
+
+// Emit literals followed by a match, or just literals if mlen is zero.
+static int _emit(uint8_t *dst, int op, int cap, const uint8_t *lit,
+  uint32_t litlen, uint16_t offset, uint32_t mlen)
+{
+  if (op >= cap) return -1;
+  int token = op++;
+  dst[token] = (litlen < 15 ? litlen : 15) << 4;
+  if (litlen >= 15 && (op = _put_len(dst, op, cap, litlen)) < 0) return -1;
+  if (op + (int)litlen > cap) return -1;
+  memcpy(dst + op, lit, litlen);
+  op += litlen;
+  if (!mlen) return op;
+
+  if (op + 2 > cap) return -1;
+  dst[op++] = offset;
+  dst[op++] = offset >> 8;
+  mlen -= LZ_MIN_MATCH;
+  dst[token] |= mlen < 15 ? mlen : 15;
+  if (mlen >= 15 && (op = _put_len(dst, op, cap, mlen)) < 0) return -1;
+  return op;
+}
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+  uint16_t table[1 << LZ_HASH_BITS];
+  int ip = 0, anchor = 0, op = 0;
+
+  if (len > LZ_MAX_INPUT) return -1;
+  memset(table, 0, sizeof table);
+  while (ip < len - LZ_MFLIMIT)
+  {
+    uint32_t seq = _read32(src + ip);
+    uint32_t h = _hash(seq);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref >= ip || _read32(src + ref) != seq)
+    {
+      ip++;
+      continue;
+    }
+
+    int mlen = LZ_MIN_MATCH;
+    while (ip + mlen < len - LZ_LASTLITERALS &&
+      src[ref + mlen] == src[ip + mlen])
+      mlen++;
+    op = _emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+    if (op < 0) return -1;
+    ip += mlen;
+    anchor = ip;
+  }
+  return _emit(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+  int ip = 0, op = 0;
+  while (ip < len)
+  {
+    uint8_t token = src[ip++];
+    uint32_t lit = token >> 4, b;
+    if (lit == 15) do
+    {
+      if (ip >= len) return -1;
+      b = src[ip++];
+      lit += b;
+    } while (b == 255);
+    if (ip + (int)lit > len || op + (int)lit > cap) return -1;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == len) break;
+
+    if (ip + 2 > len) return -1;
+    uint32_t offset = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    if (!offset || (int)offset > op) return -1;
+    uint32_t mlen = token & 15;
+    if (mlen == 15) do
+    {
+      if (ip >= len) return -1;
+      b = src[ip++];
+      mlen += b;
+    } while (b == 255);
+    mlen += LZ_MIN_MATCH;
+    if (op + (int)mlen > cap) return -1;
+    // Matches may overlap their own output, so copy bytewise.
+    for (uint32_t m = 0; m < mlen; m++, op++) dst[op] = dst[op - offset];
+  }
+  return op;
+}
@@ -0,0 +1,26 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// LZ4 block format compression for sector data on the wire.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// Shared by the firmware and the host-side block server, so this must not
+// depend on Arduino or FreeRTOS.  Inputs are limited to 64 KB so that match
+// positions fit in 16 bits and the hash table stays small on the stack.
+
+#ifndef LZBLK_H
+#define LZBLK_H
+
+#include <stdint.h>
+
+#define LZ_MAX_INPUT 65536
+
+// Returns the compressed length, or -1 if it would not fit in cap bytes.
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+// Returns the decompressed length, or -1 if the input is malformed or would
+// not fit in cap bytes.
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+#endif /* LZBLK_H */
@@ -0,0 +1,145 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Per-stage latency histograms and throughput counters.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "perf.h"
+#include "cache.h"
+#include "ipc.h"
+#include "Arduino.h"
+#include "esp_freertos_hooks.h"
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+// Counters are updated without a lock.  Each stage is only timed from one
+// task at a time in practice, and a lost count costs nothing but accuracy.
+struct perf_hist
+{
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint32_t buckets[PERF_BUCKETS];
+};
+
+static struct perf_hist hists[PERF_STAGES];
+static const char *stage_names[PERF_STAGES] =
+  { "usb-rd", "usb-wr", "cache", "ipc-q", "ipc", "send", "recv", "dd" };
+
+uint32_t perf_usb_read_bytes = 0, perf_usb_write_bytes = 0;
+
+#if configGENERATE_RUN_TIME_STATS
+// Idle time of each core, as FreeRTOS counts the run time of its idle task.
+// A task can only read the counter of its own core's idle task, so the
+// idle hook saves it.  The counter only moves when the idle task is
+// switched out, and so does not move between hook calls either.  The hook
+// lets the idle task wait for an interrupt, so an idle core sleeps.
+static volatile uint32_t idle_run[portNUM_PROCESSORS];
+
+static bool _idle_hook(void)
+{
+  idle_run[xPortGetCoreID()] = ulTaskGetIdleRunTimeCounter();
+  return true;
+}
+#endif
+
+void init_perf(void)
+{
+#if configGENERATE_RUN_TIME_STATS
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    esp_register_freertos_idle_hook_for_cpu(_idle_hook, core);
+#endif
+}
+
+uint32_t perf_now(void)
+{
+  return micros();
+}
+
+void perf_add(enum perf_stages stage, uint32_t start)
+{
+  uint32_t us = micros() - start;
+  uint32_t b = us ? 32 - __builtin_clz(us) : 0;
+  struct perf_hist *h = &hists[stage];
+  h->count++;
+  h->total_us += us;
+  if (us > h->max_us) h->max_us = us;
+  h->buckets[b < PERF_BUCKETS ? b : PERF_BUCKETS - 1]++;
+}
+
+void perf_boot(const char *phase)
+{
+  static uint32_t last_ms = 0;
+  uint32_t now = millis();
+  HWSerial.printf("%%BOOT %s at-ms=%u after-ms=%u\r\n", phase, now,
+    now - last_ms);
+  last_ms = now;
+}
+
+// Upper bound in microseconds of the bucket holding the given percentile.
+static uint32_t _percentile(const struct perf_hist *h, uint32_t pc)
+{
+  uint32_t want = ((uint64_t)h->count * pc + 99) / 100, seen = 0;
+  for (uint32_t b = 0; b < PERF_BUCKETS; b++)
+    if ((seen += h->buckets[b]) >= want) return (1UL << b) - 1;
+  return h->max_us;
+}
+
+void perf_report(void)
+{
+  static uint32_t last_ms = 0, last_rd = 0, last_wr = 0, last_ipc = 0;
+  uint32_t now = millis(), ms = now - last_ms ? now - last_ms : 1;
+
+  HWSerial.printf("%%PERF rd-Bps=%llu wr-Bps=%llu ipc-Bps=%llu hits=%u "
+    "misses=%u evicts=%u",
+    (perf_usb_read_bytes - last_rd) * 1000ULL / ms,
+    (perf_usb_write_bytes - last_wr) * 1000ULL / ms,
+    (ipc_bytes_moved - last_ipc) * 1000ULL / ms,
+    cache_hits, cache_misses, cache_evictions);
+#if configGENERATE_RUN_TIME_STATS
+  // Both counters are in the units of the run time clock.
+  static uint32_t last_run, last_idle[portNUM_PROCESSORS];
+  uint32_t run = portGET_RUN_TIME_COUNTER_VALUE(), span = run - last_run;
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+  {
+    uint32_t idle = idle_run[core] - last_idle[core];
+    uint32_t pc = span ? (uint64_t)idle * 100 / span : 100;
+    last_idle[core] += idle;
+    HWSerial.printf(" cpu%d-busy=%u%%", core, pc < 100 ? 100 - pc : 0);
+  }
+  last_run = run;
+#endif
+  for (int s = 0; s < PERF_STAGES; s++)
+    if (hists[s].count)
+      HWSerial.printf(" %s-us=%u/%u/%u", stage_names[s],
+        _percentile(&hists[s], 50), _percentile(&hists[s], 99),
+        hists[s].max_us);
+  HWSerial.print("\r\n");
+
+  last_ms = now;
+  last_rd = perf_usb_read_bytes;
+  last_wr = perf_usb_write_bytes;
+  last_ipc = ipc_bytes_moved;
+}
+
+void perf_dump(void)
+{
+  for (int s = 0; s < PERF_STAGES; s++)
+  {
+    const struct perf_hist *h = &hists[s];
+    HWSerial.printf("%%PERF-HIST %s count=%u mean-us=%llu max-us=%u",
+      stage_names[s], h->count, h->count ? h->total_us / h->count : 0,
+      h->max_us);
+    for (uint32_t b = 0; b < PERF_BUCKETS - 1; b++)
+      if (h->buckets[b]) HWSerial.printf(" <%lu:%u", 1UL << b, h->buckets[b]);
+    if (h->buckets[PERF_BUCKETS - 1])
+      HWSerial.printf(" >=%lu:%u", 1UL << (PERF_BUCKETS - 2),
+        h->buckets[PERF_BUCKETS - 1]);
+    HWSerial.print("\r\n");
+  }
+}
@@ -0,0 +1,44 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Per-stage latency histograms and throughput counters.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+
+enum perf_stages
+{
+  PERF_USB_READ,        // Whole onRead() callback.
+  PERF_USB_WRITE,       // Whole onWrite() callback.
+  PERF_CACHE,           // Cache lookups for one read.
+  PERF_IPC_QUEUE,       // Submitted until the SSH task takes it.
+  PERF_IPC,             // Submitted until completed, seen by the requester.
+  PERF_SSH_SEND,        // Sending a request to the block server.
+  PERF_NET_READ,        // Receiving a block server response.
+  PERF_DD,              // A whole request run with dd.
+  PERF_STAGES
+};
+
+// Power of two buckets of microseconds, the last holding anything longer.
+#define PERF_BUCKETS 24
+
+// Start measuring how busy each core is.
+void init_perf(void);
+
+// Timestamp in microseconds, valid across tasks and cores.
+uint32_t perf_now(void);
+// Count one pass through a stage that started at the given timestamp.
+void perf_add(enum perf_stages stage, uint32_t start);
+
+extern uint32_t perf_usb_read_bytes, perf_usb_write_bytes;
+
+// Note that start-up has reached a phase, with a %BOOT line giving the time
+// since power on and since the last phase.  Phases may be reached by
+// different tasks, which overlap.
+void perf_boot(const char *phase);
+
+// One %PERF line with rates and core use since the last report.
+void perf_report(void);
+// Every histogram in full.
+void perf_dump(void);
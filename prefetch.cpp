@@ -0,0 +1,159 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Sequential read-ahead into the sector cache.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "prefetch.h"
+#include "cache.h"
+#include "ipc.h"
+#include "tasks.h"
+#include "Arduino.h"
+
+// Read-ahead window limits in bytes.  The window doubles while read-ahead
+// sectors are being used and halves when they are evicted unread.
+#define PF_MIN_WINDOW (8 * 1024)
+#define PF_MAX_WINDOW (128 * 1024)
+
+struct pf_hint
+{
+  uint8_t lun;
+  uint32_t lba;
+  uint32_t count;
+};
+
+// Stream detector state, and window, for each LUN.
+struct pf_stream
+{
+  uint32_t disk_blocks;
+  uint32_t window;
+  uint32_t last_lba, last_count, pf_end;
+  int32_t stride;
+  uint32_t last_hits, last_wasted;
+};
+
+static uint16_t _block_size = 0;
+static uint32_t min_window, max_window;
+static struct pf_stream *streams = NULL;
+static QueueHandle_t pf_hints;
+static uint8_t *staging;
+
+static void prefetchTask(void *pvParameter)
+{
+  struct pf_hint hint;
+  while (1)
+  {
+    xQueueReceive(pf_hints, &hint, portMAX_DELAY);
+
+    // Read the window in requests of the size the link suits.
+    for (uint32_t done = 0, n; done < hint.count; done += n)
+    {
+      n = ipc_xfer_size(hint.lun) / _block_size;
+      if (n > hint.count - done) n = hint.count - done;
+      struct ipc_msg *msg = ipc_alloc(hint.lun, portMAX_DELAY);
+      msg->host_cmd = USB_READ;
+      msg->secsz = _block_size;
+      msg->lba = hint.lba + done;
+      msg->dlen = n * _block_size;
+      msg->data = staging;
+      //HWSerial.printf("%%PF lba=%u count=%u\r\n", msg->lba, n);
+      ipc_submit(msg);
+      ipc_wait(msg);
+      for (uint32_t l = 0; !msg->status && l < n; l++)
+        if (put_prefetch_cache_block(hint.lun, msg->lba + l,
+          staging + l * _block_size))
+          msg->copied += _block_size;
+      ipc_free(msg);
+    }
+  }
+}
+
+void init_prefetch(uint16_t block_size, const uint32_t *disk_blocks,
+  uint8_t luns, uint32_t cache_blocks)
+{
+  _block_size = block_size;
+  min_window = PF_MIN_WINDOW / block_size;
+  max_window = PF_MAX_WINDOW / block_size;
+  // Never read ahead more than a quarter of the cache.
+  if (max_window > cache_blocks / 4) max_window = cache_blocks / 4;
+  if (max_window < min_window) return;
+
+  // One task reads ahead for every LUN, each through its own IPC slots.
+  struct pf_stream *st = (struct pf_stream*)calloc(luns, sizeof *st);
+  staging = (uint8_t*)malloc(PF_MAX_WINDOW);
+  if (!staging || !st)
+  {
+    free(staging);
+    free(st);
+    return;
+  }
+  for (uint8_t l = 0; l < luns; l++)
+  {
+    st[l].disk_blocks = disk_blocks[l];
+    st[l].window = min_window;
+  }
+  pf_hints = xQueueCreate(TASK_PREFETCH_HINTS, sizeof (struct pf_hint));
+  streams = st;
+  xTaskCreatePinnedToCore(prefetchTask, "prefetch", 4096, NULL,
+    TASK_PREFETCH_PRIORITY, NULL, TASK_USB_CORE);
+}
+
+uint32_t prefetch_window(uint8_t lun)
+{
+  return streams ? streams[lun].window : 0;
+}
+
+void prefetch_observe(uint8_t lun, uint32_t lba, uint32_t count)
+{
+  if (!streams) return;
+  struct pf_stream *st = &streams[lun];
+
+  int32_t d = lba - st->last_lba;
+  bool seq = lba == st->last_lba + st->last_count;
+  bool strided = !seq && d > 0 && d == st->stride;
+  st->stride = d;
+  st->last_lba = lba;
+  st->last_count = count;
+  if (!seq && !strided)
+  {
+    st->pf_end = 0;
+    return;
+  }
+
+  // Adapt the window to how well read-ahead has been doing.
+  const struct cache_lun *c = &cache_luns[lun];
+  if (c->prefetch_wasted != st->last_wasted)
+  {
+    if (st->window / 2 >= min_window) st->window /= 2;
+  }
+  else if (c->prefetch_hits != st->last_hits)
+  {
+    if (st->window * 2 <= max_window) st->window *= 2;
+  }
+  st->last_hits = c->prefetch_hits;
+  st->last_wasted = c->prefetch_wasted;
+
+  // Stay a window ahead of a sequential stream, topping up once half of it
+  // has been consumed.  A strided stream gets its next request read early.
+  struct pf_hint hint;
+  hint.lun = lun;
+  if (seq)
+  {
+    uint32_t next = lba + count;
+    if (st->pf_end < next) st->pf_end = next;
+    if (st->pf_end - next > st->window / 2) return;
+    hint.lba = st->pf_end;
+    hint.count = next + st->window - st->pf_end;
+  }
+  else
+  {
+    hint.lba = lba + st->stride;
+    hint.count = count < max_window ? count : max_window;
+  }
+  if (hint.lba >= st->disk_blocks) return;
+  if (hint.count > st->disk_blocks - hint.lba)
+    hint.count = st->disk_blocks - hint.lba;
+  if (xQueueSend(pf_hints, &hint, 0) == pdTRUE && seq)
+    st->pf_end = hint.lba + hint.count;
+}
@@ -0,0 +1,20 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Sequential read-ahead into the sector cache.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+
+// Read ahead on luns LUNs, whose sizes are given in disk_blocks.
+void init_prefetch(uint16_t block_size, const uint32_t *disk_blocks,
+  uint8_t luns, uint32_t cache_blocks);
+
+// Called for every USB read before the cache is consulted.  Starts reading
+// ahead in the background when the reads of a LUN look sequential or
+// strided.
+void prefetch_observe(uint8_t lun, uint32_t lba, uint32_t count);
+
+// Current read-ahead window of a LUN in sectors.
+uint32_t prefetch_window(uint8_t lun);
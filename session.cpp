@@ -0,0 +1,591 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Serving a LUN's requests over sessions to its remote host.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// Kept apart from libssh, which is only used through the transport in
+// session.h, so that reconnecting and replaying can be tested on the host
+// against a stand-in for sshd (see host/sim/sshd.cpp).
+
+#include "session.h"
+#include "Arduino.h"
+#include <assert.h>
+#include "ipc.h"
+#include "lzblk.h"
+#include "crc32c.h"
+#include "iosched.h"
+#include "perf.h"
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+extern short ledPins[];
+
+// Delay before reconnecting a lost SSH session, doubling on each failure.
+#define SSH_RETRY_MIN_MS 500
+#define SSH_RETRY_MAX_MS 30000
+// Sessions a request may be outstanding on when they are lost before it is
+// failed rather than sent again, in case it is what brings them down.
+#define SSH_REPLAY_TRIES 3
+
+// Timeout waiting for the block server to start, before falling back to dd.
+#define BLK_HELLO_TIMEOUT_MS 5000
+
+// Have the block server compress read data, and compress written data here.
+// Decompressing is cheap but compressing at WiFi speed is best left to the
+// ESP32-S3.
+#define BLK_LZ_READS 1
+#if defined CONFIG_IDF_TARGET_ESP32S3
+#define BLK_LZ_WRITES 1
+#else
+#define BLK_LZ_WRITES 0
+#endif
+
+// Block server channels kept open on the session.  Each runs its own server
+// process, so one can read the disk while another sends.
+#define BLK_CHANNELS 2
+#if IPC_SLOTS > IOS_DEPTH
+#error Too many IPC slots for the channel scheduler
+#endif
+// Checksum mismatches in a row before giving up on the block server.
+#define BLK_CRC_TRIES 3
+
+// Sector bytes moved through the block server, and bytes on the wire for them.
+uint32_t blk_payload_bytes[IPC_LUNS], blk_wire_bytes[IPC_LUNS];
+uint32_t blk_crc_errors[IPC_LUNS];
+
+static int channel_read_full(struct ssh_chan *chan, void *buf, uint32_t len)
+{
+  uint32_t total = 0;
+  while (total < len)
+  {
+    int rbytes = chan_read(chan, (char*)buf + total, len - total, -1);
+    if (rbytes <= 0) return -1;
+    total += rbytes;
+  }
+  return 0;
+}
+
+static void blk_server_close(struct ssh_chan *chan)
+{
+  chan_eof(chan);
+  chan_close(chan);
+}
+
+// Start the persistent block server on the remote host.  Returns NULL if it
+// is not installed or does not answer, in which case dd is used instead.
+static struct ssh_chan *blk_server_open(struct session *s,
+  struct ssh_link *link)
+{
+  char cmd[strlen(s->block_server) + strlen(s->backing_file) + 2];
+  struct blk_hello hello;
+  int rbytes;
+
+  snprintf(cmd, sizeof cmd, "%s %s", s->block_server, s->backing_file);
+  struct ssh_chan *chan = chan_exec(link, cmd);
+  if (chan == NULL) goto unavailable;
+  rbytes = chan_read(chan, &hello, sizeof hello, BLK_HELLO_TIMEOUT_MS);
+  if (rbytes > 0 && rbytes < (int)sizeof hello)
+    rbytes = channel_read_full(chan, (char*)&hello + rbytes,
+      sizeof hello - rbytes) ? -1 : sizeof hello;
+  if (rbytes != sizeof hello || hello.magic != BLK_MAGIC ||
+    hello.version != BLK_VERSION) goto failed;
+
+  HWSerial.printf("%%SSH Block server started lun=%u size=%llu features=%x\r\n",
+    s->lun, (unsigned long long)hello.size, hello.features);
+  s->srv_features = hello.features;
+  return chan;
+failed:
+  blk_server_close(chan);
+unavailable:
+  HWSerial.printf("%%SSH Block server unavailable lun=%u\r\n", s->lun);
+  return NULL;
+}
+
+// Send a payload as chunks for the request flags given, sending zero chunks
+// bare and compressing others that shrink.
+static int blk_send_chunks(struct session *s, struct ssh_chan *chan,
+  const uint8_t *data, uint32_t len, uint8_t flags)
+{
+  for (uint32_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    uint32_t n = len - done < BLK_CHUNK_SIZE ? len - done : BLK_CHUNK_SIZE;
+    struct blk_chunk chunk = { 0 };
+    int clen = 0;
+    if (flags & BLK_F_ZERO && blk_is_zero(data + done, n))
+      chunk.type = BLK_CHUNK_ZERO;
+    else if (flags & BLK_F_LZ &&
+      (clen = lz_compress(data + done, n, s->lz_chunk, n - 1)) > 0)
+    {
+      chunk.type = BLK_CHUNK_LZ;
+      chunk.len = clen;
+    }
+    else
+    {
+      chunk.type = BLK_CHUNK_RAW;
+      chunk.len = n;
+    }
+    if (chan_write(chan, &chunk, sizeof chunk) != sizeof chunk)
+      return -1;
+    if (chunk.len && chan_write(chan,
+      clen > 0 ? s->lz_chunk : data + done, chunk.len) != chunk.len)
+      return -1;
+    blk_wire_bytes[s->lun] += sizeof chunk + chunk.len;
+  }
+  return 0;
+}
+
+// Receive a payload sent as chunks, straight into place where it is raw.
+// Zero chunks are filled in here, so holes in the backing file never cross
+// the network.
+static int blk_recv_chunks(struct session *s, struct ssh_chan *chan,
+  uint8_t *data, uint32_t len)
+{
+  for (uint32_t done = 0; done < len; done += BLK_CHUNK_SIZE)
+  {
+    uint32_t n = len - done < BLK_CHUNK_SIZE ? len - done : BLK_CHUNK_SIZE;
+    struct blk_chunk chunk;
+    if (channel_read_full(chan, &chunk, sizeof chunk)) return -1;
+    if (chunk.type == BLK_CHUNK_ZERO && chunk.len == 0)
+      memset(data + done, 0, n);
+    else if (chunk.type == BLK_CHUNK_RAW && chunk.len == n)
+    {
+      if (channel_read_full(chan, data + done, n)) return -1;
+    }
+    else if (chunk.type == BLK_CHUNK_LZ && chunk.len <= sizeof s->lz_chunk)
+    {
+      if (channel_read_full(chan, s->lz_chunk, chunk.len)) return -1;
+      if (lz_decompress(s->lz_chunk, chunk.len, data + done, n) != (int)n)
+        return -1;
+    }
+    else return -1;
+    blk_wire_bytes[s->lun] += sizeof chunk + chunk.len;
+  }
+  return 0;
+}
+
+static uint8_t blk_op(const struct ipc_msg *msg)
+{
+  switch (msg->host_cmd)
+  {
+    case USB_WRITE: return BLK_WRITE;
+    case SECTOR_CHECKSUMS: return BLK_CSUM;
+    default: return BLK_READ;
+  }
+}
+
+// Sectors covered by a request.
+static uint32_t blk_count(const struct ipc_msg *msg)
+{
+  if (msg->host_cmd == SECTOR_CHECKSUMS) return msg->dlen / sizeof (uint32_t);
+  return msg->dlen / msg->secsz;
+}
+
+// True if the block server can carry out this request, rather than dd.
+static bool blk_server_can(const struct session *s,
+  const struct ipc_msg *msg)
+{
+  if (msg->host_cmd == CREATE_BACKING_FILE) return false;
+  if (msg->host_cmd == SECTOR_CHECKSUMS)
+    return s->srv_features & BLK_FEAT_CSUM;
+  return true;
+}
+
+// Send one request to the block server without waiting for its response.
+static int blk_server_send(struct session *s, struct ssh_chan *chan,
+  struct ipc_msg *msg)
+{
+  struct blk_req req;
+
+  req.op = blk_op(msg);
+  req.flags = 0;
+  req.secsz = msg->secsz;
+  req.count = blk_count(msg);
+  req.lba = msg->lba;
+  if (s->srv_features & BLK_FEAT_LZ &&
+    (req.op == BLK_READ ? BLK_LZ_READS : BLK_LZ_WRITES))
+    req.flags |= BLK_F_LZ;
+  if (s->srv_features & BLK_FEAT_ZERO)
+  {
+    req.flags |= BLK_F_ZERO;
+    // Writes of nothing but zeros, as from mkfs, become a discard.
+    if (req.op == BLK_WRITE && blk_is_zero(msg->data, msg->dlen))
+      req.op = BLK_DISCARD;
+  }
+  if (s->srv_features & BLK_FEAT_CRC &&
+    (req.op == BLK_READ || req.op == BLK_WRITE))
+    req.flags |= BLK_F_CRC;
+
+  if (chan_write(chan, &req, sizeof req) != sizeof req) return -1;
+  blk_wire_bytes[s->lun] += sizeof req;
+  if (req.op == BLK_DISCARD) blk_payload_bytes[s->lun] += msg->dlen;
+  if (req.op == BLK_WRITE)
+  {
+    blk_payload_bytes[s->lun] += msg->dlen;
+    if (req.flags & (BLK_F_LZ | BLK_F_ZERO))
+    {
+      if (blk_send_chunks(s, chan, msg->data, msg->dlen, req.flags))
+        return -1;
+    }
+    else
+    {
+      if (chan_write(chan, msg->data, msg->dlen) != (int)msg->dlen)
+        return -1;
+      blk_wire_bytes[s->lun] += msg->dlen;
+    }
+    if (req.flags & BLK_F_CRC)
+    {
+      uint32_t crc = crc32c(0, msg->data, msg->dlen);
+      if (chan_write(chan, &crc, sizeof crc) != sizeof crc)
+        return -1;
+      blk_wire_bytes[s->lun] += sizeof crc;
+    }
+  }
+  return 0;
+}
+
+// Collect the block server's response to the oldest request sent.  Returns
+// 1 if the data, either way, did not match its checksum.  A request the
+// remote host could not carry out leaves the channel in step, so only the
+// request fails.
+static int blk_server_recv(struct session *s, struct ssh_chan *chan,
+  struct ipc_msg *msg)
+{
+  struct blk_rsp rsp;
+  uint8_t op = blk_op(msg);
+
+  if (channel_read_full(chan, &rsp, sizeof rsp)) return -1;
+  blk_wire_bytes[s->lun] += sizeof rsp;
+  if (rsp.op != op && !(op == BLK_WRITE && rsp.op == BLK_DISCARD)) return -1;
+  if (rsp.status == BLK_ECRC) return 1;
+  if (rsp.status != BLK_OK)
+  {
+    HWSerial.printf("%%SSH Request failed lun=%u lba=%u status=%u\r\n",
+      s->lun, msg->lba, rsp.status);
+    msg->status = -1;
+    return rsp.dlen ? -1 : 0;
+  }
+  if (op == BLK_CSUM)
+  {
+    if (rsp.dlen != msg->dlen) return -1;
+    if (channel_read_full(chan, msg->data, rsp.dlen)) return -1;
+    blk_wire_bytes[s->lun] += rsp.dlen;
+  }
+  else if (op == BLK_READ)
+  {
+    blk_payload_bytes[s->lun] += msg->dlen;
+    if (rsp.flags & (BLK_F_LZ | BLK_F_ZERO))
+    {
+      if (blk_recv_chunks(s, chan, msg->data, msg->dlen)) return -1;
+    }
+    else
+    {
+      if (rsp.dlen != msg->dlen) return -1;
+      if (channel_read_full(chan, msg->data, rsp.dlen)) return -1;
+      blk_wire_bytes[s->lun] += rsp.dlen;
+    }
+    if (rsp.flags & BLK_F_CRC)
+    {
+      uint32_t crc;
+      if (channel_read_full(chan, &crc, sizeof crc)) return -1;
+      blk_wire_bytes[s->lun] += sizeof crc;
+      if (crc != crc32c(0, msg->data, msg->dlen)) return 1;
+    }
+  }
+  return 0;
+}
+
+// Wait for the first block server channel with a response coming, returning
+// its index or -1 on error.
+static int blk_server_ready(struct ssh_chan **srv,
+  const struct ios *inflight)
+{
+  struct ssh_chan *busy[IOS_MAX_CHANNELS];
+  int n = 0, c, ready = 0;
+
+  for (c = 0; c < inflight->channels; c++)
+    if (ios_oldest(inflight, c)) busy[n++] = srv[c];
+  if (!n || (n > 1 && (ready = chan_select(busy, n)) < 0)) return -1;
+
+  for (c = 0; c < inflight->channels; c++)
+    if (srv[c] == busy[ready]) return c;
+  return -1;
+}
+
+// Run one request as a shell command on a new channel.
+static int dd_exec(struct session *s, struct ssh_link *link,
+  struct ipc_msg *msg)
+{
+    struct ssh_chan *chan;
+    const char *backing_file = s->backing_file;
+    // Increase the '108' to a higher value if you get assertion failures.
+    char cmd[strlen(backing_file) * 3 + 108];
+    int cmdlen = 0, rbytes, status;
+    uint32_t total = 0;
+
+    // There is no checksum tool we can count on over the shell.
+    if (msg->host_cmd == SECTOR_CHECKSUMS)
+    {
+      msg->dlen = 0;
+      return 0;
+    }
+
+    if (msg->host_cmd == CREATE_BACKING_FILE)
+    {
+      long long size = (0LL + msg->lba) * (0LL + msg->secsz);
+      cmdlen = snprintf(cmd, sizeof cmd, "test -f %s || truncate --size %lld %s", backing_file, size, backing_file);
+    }
+    else if (msg->host_cmd == USB_READ)
+    {
+      digitalWrite(ledPins[5], HIGH);
+      cmdlen = snprintf(cmd, sizeof cmd, "dd if=%s bs=%d skip=%lld count=%d of=/dev/shm/$(basename %s).buf 2>/dev/null && cat /dev/shm/$(basename %s).buf", backing_file, msg->secsz, 0LL + msg->lba, msg->dlen/msg->secsz, backing_file, backing_file);
+    }
+    else if (msg->host_cmd == USB_WRITE)
+    {
+      digitalWrite(ledPins[6], HIGH);
+      cmdlen = snprintf(cmd, sizeof cmd, "dd of=%s conv=notrunc bs=%d seek=%lld count=%d 2>/dev/null", backing_file, msg->secsz, 0LL + msg->lba, msg->dlen/msg->secsz);
+    }
+    else strcpy(cmd, "false");
+    //printf("%%SSH CMD %s\n", cmd);
+    assert(cmdlen < (int)sizeof cmd);
+    chan = chan_exec(link, cmd);
+    if (chan == NULL) {
+        HWSerial.printf("Fail 1\r\n");
+        return -1;
+    }
+    if (msg->host_cmd == USB_WRITE)
+    {
+      chan_write(chan, msg->data, msg->dlen);
+    }
+
+    rbytes = chan_read(chan, msg->data + total, msg->dlen, -1);
+    if (rbytes < 0) {
+      HWSerial.printf("Fail 2\r\n");
+      goto failed;
+    }
+
+    while (rbytes > 0) {
+        total += rbytes;
+        if (total == msg->dlen) break;
+
+        rbytes = chan_read(chan, msg->data + total, msg->dlen - total, -1);
+    }
+
+    if (rbytes < 0) {
+      HWSerial.printf("Fail 4\r\n");
+      goto failed;
+    }
+
+    // A read past the end of the backing file comes back short.  Sectors
+    // there read as zeros, as from the block server, rather than leave stale
+    // data in the rest of the buffer.
+    if (msg->host_cmd == USB_READ && total != msg->dlen)
+      memset(msg->data + total, 0, msg->dlen - total);
+
+    // The command failing, as opposed to the session, fails only this
+    // request.  Sending it again would most likely fail the same way.
+    chan_eof(chan);
+    status = chan_exit_status(chan);
+    if (status && !link_up(link)) goto failed;
+    if (status)
+    {
+      HWSerial.printf("%%SSH Command failed lun=%u lba=%u status=%d\r\n",
+        s->lun, msg->lba, status);
+      msg->status = -1;
+    }
+    chan_close(chan);
+    if (msg->host_cmd == USB_READ) digitalWrite(ledPins[5], LOW);
+    else if (msg->host_cmd == USB_WRITE) digitalWrite(ledPins[6], LOW);
+
+    return 0;
+failed:
+    chan_close(chan);
+
+    return -1;
+}
+
+int session_main(struct session *s){
+    struct ssh_link *link = NULL;
+    struct ssh_chan *srv[BLK_CHANNELS];
+    int nsrv = 0, c, rc, crc_fails = 0;
+    bool srv_tried = false, ready = false, lost;
+    uint32_t retry_ms = SSH_RETRY_MIN_MS;
+    // When each channel last finished a request, for timing the next.
+    uint32_t srv_done[BLK_CHANNELS];
+    // Requests sent to the block server channels awaiting a response.
+    struct ios inflight;
+    struct ipc_msg *msg = NULL, *done;
+    // Requests outstanding when the session was lost, to be sent again in
+    // order once reconnected.  Rewriting the same sectors with the same
+    // data, or reading them again, does no harm.
+    struct ipc_msg *replay[IPC_SLOTS], *keep[IPC_SLOTS];
+    int nreplay = 0, next_replay = 0;
+
+    ios_init(&inflight, 0);
+
+    while (1)
+    {
+      // Requests from the MSC task stay queued while reconnecting, so the
+      // host only sees them take longer.
+      if (!link)
+      {
+        if (!(link = link_open(s->lun)))
+        {
+          HWSerial.printf("%%SSH Reconnecting lun=%u in %u ms\r\n", s->lun,
+            retry_ms);
+          vTaskDelay(retry_ms / portTICK_PERIOD_MS);
+          retry_ms = min(retry_ms * 2, (uint32_t)SSH_RETRY_MAX_MS);
+          continue;
+        }
+        retry_ms = SSH_RETRY_MIN_MS;
+        srv_tried = false;
+        if (!ready)
+        {
+          perf_boot("ssh");
+          //printf("%%IPC SSH Signalling MSC\n");
+          ipc_signal_ready(s->lun);
+          digitalWrite(ledPins[3], LOW);
+          ready = true;
+        }
+        else HWSerial.printf("%%SSH Reconnected lun=%u replaying=%d\r\n",
+          s->lun, nreplay - next_replay);
+      }
+
+      // Keep sending requests to the block server while the MSC task has
+      // more queued, and only wait on a response when there are none.
+      //printf("%%IPC SSH Wait for MSC\n");
+      if (!msg && next_replay < nreplay) msg = replay[next_replay++];
+      if (!msg) msg = ipc_next(s->lun, inflight.queued ? 0 : portMAX_DELAY);
+
+      if (msg && msg->host_cmd != CREATE_BACKING_FILE && !srv_tried)
+      {
+        while (nsrv < BLK_CHANNELS &&
+          (srv[nsrv] = blk_server_open(s, link)))
+          srv_done[nsrv++] = millis();
+        if (nsrv) HWSerial.printf("%%SSH Block server lun=%u channels=%d\r\n",
+          s->lun, nsrv);
+        else HWSerial.printf("%%SSH Using dd lun=%u\r\n", s->lun);
+        ios_init(&inflight, nsrv);
+        srv_tried = true;
+      }
+
+      if (msg && nsrv && blk_server_can(s, msg) && (c = ios_pick(&inflight,
+        msg->lba, blk_count(msg), msg->host_cmd == USB_WRITE)) >= 0)
+      {
+        digitalWrite(msg->host_cmd == USB_READ ? ledPins[5] : ledPins[6], HIGH);
+        ios_push(&inflight, c, msg->lba, blk_count(msg),
+          msg->host_cmd == USB_WRITE, msg);
+        msg->sent = millis();
+        uint32_t st = perf_now();
+        bool sent = !blk_server_send(s, srv[c], msg);
+        perf_add(PERF_SSH_SEND, st);
+        msg = NULL;
+        if (sent) continue;
+      }
+      else if (inflight.queued)
+      {
+        // Anything else received waits for a response, and until the
+        // pipeline has drained if it cannot go to the block server.
+        uint32_t st = perf_now();
+        rc = -1;
+        if ((c = blk_server_ready(srv, &inflight)) >= 0 &&
+          !(rc = blk_server_recv(s, srv[c],
+            done = (struct ipc_msg*)ios_oldest(&inflight, c))))
+        {
+          perf_add(PERF_NET_READ, st);
+          crc_fails = 0;
+          ios_pop(&inflight, c);
+          // Each channel serves its requests one by one, so time this one
+          // from when the channel became free of earlier ones.
+          uint32_t now = millis(), start = done->sent;
+          if ((int32_t)(srv_done[c] - start) > 0) start = srv_done[c];
+          srv_done[c] = now;
+          if (done->host_cmd != SECTOR_CHECKSUMS && !done->status)
+            ipc_sample(s->lun, done->dlen, now - start);
+          digitalWrite(done->host_cmd == USB_READ ? ledPins[5] : ledPins[6], LOW);
+          //printf("%%IPC SSH Signalling MSC id=%u\n", done->id);
+          ipc_complete(done->id);
+          continue;
+        }
+        // Send everything outstanding again on fresh channels, in order, as
+        // when the session is lost, but keeping the session.
+        if (rc > 0)
+        {
+          blk_crc_errors[s->lun]++;
+          HWSerial.printf("%%SSH Checksum mismatch lun=%u lba=%u\r\n",
+            s->lun, done->lba);
+          lost = false;
+          if (++crc_fails < BLK_CRC_TRIES) goto resend;
+          crc_fails = 0;
+        }
+      }
+      else
+      {
+        uint32_t st = perf_now();
+        if (dd_exec(s, link, msg)) goto failed;
+        perf_add(PERF_DD, st);
+        //printf("%%IPC SSH Signalling MSC id=%u\n", msg->id);
+        ipc_complete(msg->id);
+        msg = NULL;
+        continue;
+      }
+
+      // A block server channel failed.  If the session went with it then
+      // reconnect, otherwise replay everything outstanding with dd, in order
+      // on each channel so that overlapping requests stay ordered.
+      if (!link_up(link)) goto failed;
+      HWSerial.printf("%%SSH Block server failed lun=%u, using dd\r\n",
+        s->lun);
+      for (c = 0; c < nsrv; c++) blk_server_close(srv[c]);
+      nsrv = 0;
+      for (c = 0; c < inflight.channels; c++)
+        while ((done = (struct ipc_msg*)ios_oldest(&inflight, c)))
+        {
+          if (dd_exec(s, link, done)) goto failed;
+          ios_pop(&inflight, c);
+          ipc_complete(done->id);
+        }
+      continue;
+
+failed:
+      HWSerial.printf("%%SSH Session lost lun=%u\r\n", s->lun);
+      lost = true;
+resend:
+      // Keep every request not yet completed, in the order each channel
+      // had them, then the one not yet sent and any still to be replayed
+      // from before.  Requests that overlap are always on the same channel,
+      // so they stay in order.
+      c = 0;
+      for (int ch = 0; ch < inflight.channels; ch++)
+        while ((done = (struct ipc_msg*)ios_pop(&inflight, ch)))
+          keep[c++] = done;
+      if (msg) keep[c++] = msg;
+      while (next_replay < nreplay) keep[c++] = replay[next_replay++];
+      nreplay = 0;
+      for (int k = 0; k < c; k++)
+        if (lost && ++keep[k]->lost >= SSH_REPLAY_TRIES)
+        {
+          HWSerial.printf("%%SSH Giving up lun=%u lba=%u\r\n", s->lun,
+            keep[k]->lba);
+          keep[k]->status = -1;
+          ipc_complete(keep[k]->id);
+        }
+        else replay[nreplay++] = keep[k];
+      next_replay = 0;
+      msg = NULL;
+      ios_init(&inflight, 0);
+      for (c = 0; c < nsrv; c++) blk_server_close(srv[c]);
+      nsrv = 0;
+      srv_tried = false;
+      if (!lost) continue;
+      link_close(link);
+      link = NULL;
+    } // while (1)
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Serving a LUN's requests over sessions to its remote host.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+#include "blkproto.h"
+
+// What a LUN's SSH task keeps between sessions: the commands to run on the
+// remote host, and what the block server said it can do.
+struct session
+{
+  uint8_t lun;
+  const char *block_server;
+  const char *backing_file;
+  uint16_t srv_features;
+  uint8_t lz_chunk[BLK_CHUNK_SIZE];
+};
+
+// Serve the LUN's requests for ever, connecting and reconnecting as needed.
+// Requests outstanding when a session is lost are sent again on the next,
+// unless they were outstanding on SSH_REPLAY_TRIES sessions, when they fail.
+int session_main(struct session *s);
+
+// Sector bytes moved through the block server of each LUN, and bytes on the
+// wire for them.
+extern uint32_t blk_payload_bytes[], blk_wire_bytes[];
+// Extents sent again because they did not match their checksums.
+extern uint32_t blk_crc_errors[];
+
+// The transport a session runs over: SSH with libssh in ssh_exec.cpp on the
+// device, and host/sim/sshd.cpp on the host.
+struct ssh_link;
+struct ssh_chan;
+
+// Open a session to the LUN's remote host, or NULL if it cannot be reached
+// this time.  link_up() is false once the session has been lost.
+struct ssh_link *link_open(uint8_t lun);
+bool link_up(struct ssh_link *link);
+void link_close(struct ssh_link *link);
+
+// Run a command on the remote host on a channel of its own, or NULL.
+struct ssh_chan *chan_exec(struct ssh_link *link, const char *cmd);
+// Read up to len bytes of the command's output, waiting up to timeout_ms,
+// or for ever if negative.  Returns bytes read, 0 on timeout or end of
+// file, or -1 on error.
+int chan_read(struct ssh_chan *chan, void *buf, uint32_t len,
+  int timeout_ms);
+// Returns len, or -1 on error.
+int chan_write(struct ssh_chan *chan, const void *buf, uint32_t len);
+// Wait for any of n channels to have output, returning its index, or -1.
+int chan_select(struct ssh_chan **chans, int n);
+// End the command's input, and wait for it to exit with its status, or -1
+// if it did not say.
+void chan_eof(struct ssh_chan *chan);
+int chan_exit_status(struct ssh_chan *chan);
+void chan_close(struct ssh_chan *chan);
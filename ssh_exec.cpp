@@ -5,6 +5,7 @@
 // Copyright (C) 2016–2025 Ewan Parker.
 // https://www.ewan.cc
 
+#include "ssh_exec.h"
 // Set local WiFi credentials below.
 #include "wifimsc_ssh_config.h"
 
@@ -13,9 +14,16 @@ const unsigned int configSTACK = 31200;
 
 #include "Arduino.h"
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "esp_netif.h"
 #include "WiFi.h"
 #include "ipc.h"
+#include "session.h"
+#include "perf.h"
+#include "tasks.h"
 // Include the Arduino library.
 #include "libssh_esp32.h"
 
@@ -34,6 +42,7 @@ extern short ledPins[];
 // Timing and timeout configuration.
 #define WIFI_TIMEOUT_S 10
 #define NET_WAIT_MS 100
+#define SSH_CONNECT_TIMEOUT_MS 5000
 
 // Networking state of this esp32 device.
 typedef enum
@@ -55,9 +64,10 @@ static volatile bool gotIpAddr, gotIp6Addr;
 #include "driver/uart.h"
 #include "esp_vfs_dev.h"
 
-void createFile(char *fileName, unsigned char *buffer, size_t len)
+void createFile(const char *fileName, unsigned char *buffer, size_t len,
+  const char *mode = "w")
 {
-  File fDest = SPIFFS.open(fileName, "w");
+  File fDest = SPIFFS.open(fileName, mode);
   size_t w = fDest.write(buffer, len);
   fDest.close();
   HWSerial.printf("%%CFG-CREATE file=%s length=%d.\r\n", fileName, w);
@@ -385,115 +395,239 @@ ssh_session connect_ssh(const char *host, const char *user,int verbosity){
   return NULL;
 }
 
-int ex_main(){
-    ssh_session session;
-    ssh_channel channel;
-    // Increase the '108' to a higher value if you get assertion failures.
-    char cmd[BACKING_FILE_LEN * 3 + 108];
-    int cmdlen, rc;
-
-    session = connect_ssh((char*)SERVER, (char*)USER_NAME, 0);
-    if (session == NULL) {
-        ssh_finalize();
-        return 1;
+// Each LUN has an SSH task of its own, with its own session and block
+// server channels, so that one remote host being slow or out of reach does
+// not hold up another.  Its state is kept between sessions so that
+// reconnecting is quick: the server's address, the hash of its host key
+// once checked against known_hosts, our private key, and the next session
+// with its options set.
+struct transport
+{
+  uint8_t lun;
+  const struct lun_ssh_config *cfg;
+  struct sockaddr_storage srv_addr;
+  socklen_t srv_addrlen;
+  unsigned char srv_hash[64];
+  size_t srv_hashlen;
+  ssh_key id_key;
+  ssh_session next_session;
+};
+
+static struct transport transports[IPC_LUNS];
+static struct session sessions[IPC_LUNS];
+static uint8_t _luns = 0;
+
+static void prepare_session(struct transport *t)
+{
+  if (!t->id_key)
+  {
+    // The key is built in, so parse it once instead of reading it back
+    // from SPIFFS each time.
+    char *pem = (char*)malloc(t->cfg->id_len + 1);
+    if (pem)
+    {
+      memcpy(pem, t->cfg->id, t->cfg->id_len);
+      pem[t->cfg->id_len] = 0;
+      if (ssh_pki_import_privkey_base64(pem, NULL, NULL, NULL, &t->id_key))
+        t->id_key = NULL;
+      free(pem);
     }
+  }
+  if (t->next_session) return;
+  ssh_session s = t->next_session = ssh_new();
+  if (s &&
+    (ssh_options_set(s, SSH_OPTIONS_USER, (char*)t->cfg->user_name) < 0 ||
+    ssh_options_set(s, SSH_OPTIONS_HOST, (char*)t->cfg->server) < 0))
+  {
+    ssh_free(s);
+    t->next_session = NULL;
+  }
+}
 
-    //printf("%%IPC SSH Signalling MSC\n");
-    char dummy;
-    xMessageBufferSend(ssh_to_usb, &dummy, 1, portMAX_DELAY);
-    digitalWrite(ledPins[3], LOW);
-
-    struct ipc_msg msg;
-    int ipc_num = 1;
-    while (1)
+// Connect a socket to the server, only looking its name up again if the
+// address used last time fails.
+static int connect_socket(struct transport *t, unsigned int port)
+{
+  for (int tries = 0; tries < 2; tries++)
+  {
+    if (!t->srv_addrlen)
     {
-      int rbytes, total = 0;
-
-      channel = ssh_channel_new(session);
-      if (channel == NULL) {
-          ssh_disconnect(session);
-          ssh_free(session);
-          ssh_finalize();
-          return 1;
-      }
+      struct addrinfo hints, *ai;
+      char service[8];
+      memset(&hints, 0, sizeof hints);
+      hints.ai_socktype = SOCK_STREAM;
+      snprintf(service, sizeof service, "%u", port);
+      if (getaddrinfo((char*)t->cfg->server, service, &hints, &ai)) return -1;
+      memcpy(&t->srv_addr, ai->ai_addr, ai->ai_addrlen);
+      t->srv_addrlen = ai->ai_addrlen;
+      freeaddrinfo(ai);
+    }
 
-      rc = ssh_channel_open_session(channel);
-      if (rc < 0) {
-          goto failed;
-      }
+    int fd = socket(t->srv_addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int flags = fcntl(fd, F_GETFL, 0), err = 0;
+    socklen_t errlen = sizeof err;
+    struct timeval tv = { SSH_CONNECT_TIMEOUT_MS / 1000,
+      SSH_CONNECT_TIMEOUT_MS % 1000 * 1000 };
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if ((!connect(fd, (struct sockaddr*)&t->srv_addr, t->srv_addrlen) ||
+      (errno == EINPROGRESS && select(fd + 1, NULL, &fds, NULL, &tv) == 1 &&
+      !getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) && !err)) &&
+      fcntl(fd, F_SETFL, flags) >= 0)
+      return fd;
+    close(fd);
+    t->srv_addrlen = 0;
+  }
+  return -1;
+}
 
-      //printf("%%IPC SSH Wait for MSC signal start %d\n", ipc_num);
-      rc = xMessageBufferReceive(usb_to_ssh, &msg, sizeof msg, portMAX_DELAY);
-      //printf("%%IPC SSH Wait for MSC signal finish %d, sz=%d\n", ipc_num++, rc); ipc_num++;
-      if (msg.host_cmd == CREATE_BACKING_FILE)
-      {
-        long long size = (0LL + msg.lba) * (0LL + msg.secsz);
-        cmdlen = snprintf(cmd, sizeof cmd, "test -f %s || truncate --size %lld %s", BACKING_FILE, size, BACKING_FILE);
-      }
-      else if (msg.host_cmd == USB_READ)
-      {
-        digitalWrite(ledPins[5], HIGH);
-        cmdlen = snprintf(cmd, sizeof cmd, "dd if=%s bs=%d skip=%lld count=%d of=/dev/shm/$(basename %s).buf 2>/dev/null; cat /dev/shm/$(basename %s).buf", BACKING_FILE, msg.secsz, 0LL + msg.lba, msg.dlen/msg.secsz, BACKING_FILE, BACKING_FILE);
-      }
-      else if (msg.host_cmd == USB_WRITE)
-      {
-        digitalWrite(ledPins[6], HIGH);
-        cmdlen = snprintf(cmd, sizeof cmd, "dd of=%s conv=notrunc bs=%d seek=%lld count=%d 2>/dev/null", BACKING_FILE, msg.secsz, 0LL + msg.lba, msg.dlen/msg.secsz);
-      }
-      else strcpy(cmd, "false");
-      //printf("%%SSH CMD %s\n", cmd);
-      assert(cmdlen < sizeof cmd);
-      rc = ssh_channel_request_exec(channel, cmd);
-      if (msg.host_cmd == USB_WRITE)
-      {
-        ssh_channel_write(channel, msg.data, msg.dlen);
-      }
-      if (rc < 0) {
-          HWSerial.printf("Fail 1\r\n");
-          goto failed;
-      }
+// Check the server's host key, against the one already checked if any, so
+// that known_hosts is only read on the first connection.
+static int verify_host(struct transport *t, ssh_session session)
+{
+  ssh_key key;
+  unsigned char *hash = NULL;
+  size_t hlen = 0;
+  bool same = false;
+
+  if (ssh_get_server_publickey(session, &key) < 0) return -1;
+  if (ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA256, &hash, &hlen))
+    hash = NULL;
+  ssh_key_free(key);
+  if (!hash) return -1;
+  same = t->srv_hashlen && hlen == t->srv_hashlen &&
+    !memcmp(hash, t->srv_hash, hlen);
+  if (!same && !verify_knownhost(session) && hlen <= sizeof t->srv_hash)
+  {
+    memcpy(t->srv_hash, hash, hlen);
+    t->srv_hashlen = hlen;
+    same = true;
+  }
+  ssh_clean_pubkey_hash(&hash);
+  return same ? 0 : -1;
+}
 
-      rbytes = ssh_channel_read(channel, msg.data + total, msg.dlen, 0);
-      if (rbytes == SSH_ERROR) {
-        HWSerial.printf("Fail 2\r\n");
-        goto failed;
-      }
+// Like connect_ssh() but using the state kept between sessions, and
+// preparing the next session once connected.
+static ssh_session open_session(struct transport *t)
+{
+  unsigned int port = 22;
+  int fd;
+
+  prepare_session(t);
+  ssh_session session = t->next_session;
+  t->next_session = NULL;
+  if (!session) return NULL;
+  ssh_options_get_port(session, &port);
+  if ((fd = connect_socket(t, port)) < 0)
+  {
+    ssh_free(session);
+    return NULL;
+  }
+  // The session closes the socket when disconnected.
+  ssh_options_set(session, SSH_OPTIONS_FD, &fd);
+  bool ok = !ssh_connect(session) && !verify_host(t, session);
+  if (ok && !(t->id_key &&
+    ssh_userauth_publickey(session, NULL, t->id_key) == SSH_AUTH_SUCCESS))
+    ok = authenticate_console(session) == SSH_AUTH_SUCCESS;
+  if (!ok)
+  {
+    HWSerial.printf("%%SSH Connection failed lun=%u: %s\r\n", t->lun,
+      ssh_get_error(session));
+    ssh_disconnect(session);
+    ssh_free(session);
+    return NULL;
+  }
+  prepare_session(t);
+  return session;
+}
 
-      if (rbytes) do {
-          total += rbytes;
+// The transport for session.cpp.  Links and channels are libssh's sessions
+// and channels.
+struct ssh_link *link_open(uint8_t lun)
+{
+  return (struct ssh_link*)open_session(&transports[lun]);
+}
 
-          rbytes = ssh_channel_read(channel, msg.data + total, msg.dlen - total, 0);
-          total = 0;
-      } while (rbytes > 0);
+bool link_up(struct ssh_link *link)
+{
+  return ssh_is_connected((ssh_session)link);
+}
 
-      if (rbytes < 0) {
-        HWSerial.printf("Fail 4\r\n");
-        goto failed;
-      }
+void link_close(struct ssh_link *link)
+{
+  ssh_disconnect((ssh_session)link);
+  ssh_free((ssh_session)link);
+}
 
-      //printf("%%IPC SSH Signalling MSC\n");
-      xMessageBufferSend(ssh_to_usb, &msg, sizeof msg, portMAX_DELAY);
+struct ssh_chan *chan_exec(struct ssh_link *link, const char *cmd)
+{
+  ssh_channel channel = ssh_channel_new((ssh_session)link);
+  if (channel == NULL) return NULL;
+  if (ssh_channel_open_session(channel) < 0 ||
+    ssh_channel_request_exec(channel, cmd) < 0)
+  {
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return NULL;
+  }
+  return (struct ssh_chan*)channel;
+}
 
-      ssh_channel_send_eof(channel);
-      ssh_channel_close(channel);
-      ssh_channel_free(channel);
-      if (msg.host_cmd == USB_READ) digitalWrite(ledPins[5], LOW);
-      else if (msg.host_cmd == USB_WRITE) digitalWrite(ledPins[6], LOW);
-    } // while (1)
+int chan_read(struct ssh_chan *chan, void *buf, uint32_t len, int timeout_ms)
+{
+  int rbytes = timeout_ms < 0 ?
+    ssh_channel_read((ssh_channel)chan, buf, len, 0) :
+    ssh_channel_read_timeout((ssh_channel)chan, buf, len, 0, timeout_ms);
+  return rbytes < 0 ? -1 : rbytes;
+}
 
-    ssh_disconnect(session);
-    ssh_free(session);
-    ssh_finalize();
+int chan_write(struct ssh_chan *chan, const void *buf, uint32_t len)
+{
+  return ssh_channel_write((ssh_channel)chan, buf, len) == (int)len ? len : -1;
+}
 
-    return 0;
-failed:
-    ssh_channel_close(channel);
-    ssh_channel_free(channel);
-    ssh_disconnect(session);
-    ssh_free(session);
-    ssh_finalize();
+int chan_select(struct ssh_chan **chans, int n)
+{
+  ssh_channel ready[n + 1];
+  for (int c = 0; c < n; c++) ready[c] = (ssh_channel)chans[c];
+  ready[n] = NULL;
+  // Select leaves only the ready channels.
+  if (ssh_channel_select(ready, NULL, NULL, NULL) != SSH_OK) return -1;
+  for (int c = 0; c < n; c++)
+    if (ready[0] && ready[0] == (ssh_channel)chans[c]) return c;
+  return -1;
+}
+
+void chan_eof(struct ssh_chan *chan)
+{
+  ssh_channel_send_eof((ssh_channel)chan);
+}
+
+int chan_exit_status(struct ssh_chan *chan)
+{
+  return ssh_channel_get_exit_status((ssh_channel)chan);
+}
+
+void chan_close(struct ssh_chan *chan)
+{
+  ssh_channel_close((ssh_channel)chan);
+  ssh_channel_free((ssh_channel)chan);
+}
 
-    return 1;
+// The SSH task of each LUN after the first, which the control task runs
+// itself.
+static void transportTask(void *pvParameter)
+{
+  struct session *s = (struct session*)pvParameter;
+  int ex_rc = session_main(s);
+  HWSerial.printf
+    ("\n%%MSC Execution completed prematurely: lun=%u rc=%d\r\n", s->lun,
+    ex_rc);
+  while (1) vTaskDelay(60000 / portTICK_PERIOD_MS);
 }
 
 #define newDevState(s) (devState = s)
@@ -574,8 +708,11 @@ void controlTask(void *pvParameter)
     if (fsGood)
     {
       SPIFFS.begin();
-      createFile("/.ssh/known_hosts", SERVER_HASH, SERVER_HASH_LEN);
-      createFile("/.ssh/id_ed25519", ID, ID_LEN);
+      for (uint8_t l = 0; l < _luns; l++)
+        createFile("/.ssh/known_hosts", LUN_SSH_CONFIG[l].server_hash,
+          LUN_SSH_CONFIG[l].server_hash_len, l ? "a" : "w");
+      createFile("/.ssh/id_ed25519", LUN_SSH_CONFIG[0].id,
+        LUN_SSH_CONFIG[0].id_len);
       // On the ESP32-S2 (not S3) the following is required to write SPIFFS.
       SPIFFS.end(); SPIFFS.begin();
     }
@@ -609,12 +746,16 @@ void controlTask(void *pvParameter)
         vTaskDelay(NET_WAIT_MS / portTICK_PERIOD_MS);
         break;
       case STATE_PHY_CONNECTED :
+        perf_boot("wifi");
         newDevState(STATE_WAIT_IPADDR);
         // Set the initial time, where timeout will be started
         xStartTime = xTaskGetTickCount();
         break;
       case STATE_WAIT_IPADDR :
-        if (gotIpAddr && gotIp6Addr)
+        // Either address family will do to start with.  Should the server
+        // only be reachable over the other, connecting is retried until it
+        // comes up.
+        if (gotIpAddr || gotIp6Addr)
           newDevState(STATE_GOT_IPADDR);
         else
         {
@@ -622,10 +763,7 @@ void controlTask(void *pvParameter)
           if (xTaskGetTickCount() >= xStartTime + xTicksTimeout)
           {
             HWSerial.println("%%NET Timeout waiting for IP address");
-            if (gotIpAddr || gotIp6Addr)
-              newDevState(STATE_GOT_IPADDR);
-            else
-              newDevState(STATE_NEW);
+            newDevState(STATE_NEW);
           }
           else
           {
@@ -634,6 +772,7 @@ void controlTask(void *pvParameter)
         }
         break;
       case STATE_GOT_IPADDR :
+        perf_boot(gotIpAddr ? "ipv4" : "ipv6");
         newDevState(STATE_OTA_UPDATING);
         break;
       case STATE_OTA_UPDATING :
@@ -646,9 +785,12 @@ void controlTask(void *pvParameter)
         // Initialize the Arduino library.
         libssh_begin();
 
-        // Run the main code.
+        // Run the main code, one SSH task per LUN.
+        for (uint8_t l = 1; l < _luns; l++)
+          xTaskCreatePinnedToCore(transportTask, "ssh", configSTACK,
+            &sessions[l], TASK_SSH_PRIORITY, NULL, TASK_NET_CORE);
         {
-          int ex_rc = ex_main();
+          int ex_rc = session_main(&sessions[0]);
           digitalWrite(ledPins[0], LOW);
           HWSerial.printf
             ("\n%%MSC Execution completed prematurely: rc=%d\r\n", ex_rc);
@@ -673,9 +815,18 @@ void controlTask(void *pvParameter)
   }
 }
 
-void ssh_exec_setup()
+void ssh_exec_setup(uint8_t luns)
 {
   devState = STATE_NEW;
+  _luns = luns;
+  for (uint8_t l = 0; l < luns; l++)
+  {
+    transports[l].lun = l;
+    transports[l].cfg = &LUN_SSH_CONFIG[l];
+    sessions[l].lun = l;
+    sessions[l].block_server = (const char*)LUN_SSH_CONFIG[l].block_server;
+    sessions[l].backing_file = (const char*)LUN_SSH_CONFIG[l].backing_file;
+  }
 
   // Use the expected blocking I/O behavior.
   setvbuf(stdin, NULL, _IONBF, 0);
@@ -694,5 +845,5 @@ void ssh_exec_setup()
 
   // Stack size needs to be larger, so continue in a new task.
   xTaskCreatePinnedToCore(controlTask, "ctl", configSTACK, NULL,
-    (tskIDLE_PRIORITY + 3), NULL, portNUM_PROCESSORS - 1);
+    TASK_SSH_PRIORITY, NULL, TASK_NET_CORE);
 }
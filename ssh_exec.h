@@ -5,4 +5,24 @@
 // Copyright (C) 2016–2023 Ewan Parker.
 // https://www.ewan.cc
 
-void ssh_exec_setup(void);
+#include <stdint.h>
+
+// Where the backing file of a LUN is kept, and how to get at it, from the
+// profile configured for the LUN.  Generated into wifimsc_ssh_config.h.
+struct lun_ssh_config
+{
+  unsigned char *server;
+  unsigned char *user_name;
+  unsigned char *server_hash;
+  unsigned int server_hash_len;
+  unsigned char *backing_file;
+  unsigned int backing_file_len;
+  unsigned char *block_server;
+  unsigned int block_server_len;
+  unsigned char *id;
+  unsigned int id_len;
+};
+
+// Bring up WiFi, then a session to the remote host of each of luns LUNs,
+// each served by its own SSH task.
+void ssh_exec_setup(uint8_t luns);
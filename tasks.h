@@ -0,0 +1,24 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Cores, priorities and queue depths of the tasks moving data.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+// The SSH task, which does the networking and the crypto, shares the first
+// core with the WiFi driver.  Read-ahead and write-back flushing run on the
+// last core, as do the Arduino loop and its cache maintenance, so that on
+// the ESP32-S3 they do not hold up the network.  The ESP32-S2 has only the
+// one core for everything.
+#define TASK_NET_CORE 0
+#define TASK_USB_CORE (portNUM_PROCESSORS - 1)
+
+// Higher runs first.  The SSH task is above the workers that feed it, so
+// that it sends their requests as soon as they are queued.
+#define TASK_SSH_PRIORITY (tskIDLE_PRIORITY + 3)
+#define TASK_PREFETCH_PRIORITY (tskIDLE_PRIORITY + 2)
+#define TASK_FLUSH_PRIORITY (tskIDLE_PRIORITY + 2)
+
+// Read-ahead hints waiting for the prefetch task.  Requests waiting for the
+// SSH task are limited by IPC_SLOTS in ipc.h.
+#define TASK_PREFETCH_HINTS 2
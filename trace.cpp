@@ -0,0 +1,69 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Block I/O trace capture.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "trace.h"
+#include "Arduino.h"
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+// Records per line of a dump.
+#define TRACE_DUMP_LINE 4
+
+// Only the USB task adds records, for every LUN, so the ring needs no lock.
+// A dump taken while requests arrive may show a record half written.
+static struct trace_rec *ring = NULL;
+static uint32_t ring_size = 0;
+static uint32_t trace_total = 0;
+
+void init_trace(uint32_t records)
+{
+  if (!records || !psramFound()) return;
+  ring = (struct trace_rec*)ps_malloc(records * sizeof *ring);
+  if (ring) ring_size = records;
+  HWSerial.printf("%%TRACE records=%u bytes=%u\r\n", ring_size,
+    ring_size * sizeof *ring);
+}
+
+void trace_add(uint8_t lun, uint8_t op, uint32_t lba, uint16_t count,
+  uint8_t flags, uint32_t start_us, uint32_t remote_us)
+{
+  if (!ring_size) return;
+  struct trace_rec *rec = &ring[trace_total % ring_size];
+  rec->start_us = start_us;
+  rec->lba = lba;
+  rec->count = count;
+  rec->op = op;
+  rec->flags = flags;
+  rec->remote_us = remote_us;
+  rec->lun = lun;
+  trace_total++;
+}
+
+void trace_dump(void)
+{
+  uint32_t total = trace_total;
+  uint32_t n = total < ring_size ? total : ring_size;
+
+  HWSerial.printf("%%TRACE-BEGIN records=%u dropped=%u size=%u\r\n", n,
+    total - n, sizeof (struct trace_rec));
+  for (uint32_t i = 0; i < n; i += TRACE_DUMP_LINE)
+  {
+    HWSerial.print("%TRACE-DATA ");
+    for (uint32_t r = i; r < n && r < i + TRACE_DUMP_LINE; r++)
+    {
+      const uint8_t *b = (const uint8_t*)&ring[(total - n + r) % ring_size];
+      for (uint32_t k = 0; k < sizeof (struct trace_rec); k++)
+        HWSerial.printf("%02x", b[k]);
+    }
+    HWSerial.print("\r\n");
+  }
+  HWSerial.printf("%%TRACE-END\r\n");
+}
@@ -0,0 +1,35 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Block I/O trace capture.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+
+enum trace_ops { TRACE_READ = 0, TRACE_WRITE = 1 };
+
+// Request outcome flags.
+#define TRACE_F_HIT 0x01        // Some sectors were found in the cache.
+#define TRACE_F_MISS 0x02       // Some sectors went to the remote host.
+#define TRACE_F_WB 0x04         // Written to the write-back cache.
+
+// One USB request, as dumped.  Times are from micros().
+struct trace_rec
+{
+  uint32_t start_us;
+  uint32_t lba;
+  uint16_t count;       // Sectors.
+  uint8_t op;
+  uint8_t flags;
+  uint32_t remote_us;   // Time spent waiting on the remote host.
+  uint8_t lun;
+} __attribute__((packed));
+
+// Keep the latest records requests in a ring in PSRAM, or none if zero.
+void init_trace(uint32_t records);
+void trace_add(uint8_t lun, uint8_t op, uint32_t lba, uint16_t count,
+  uint8_t flags, uint32_t start_us, uint32_t remote_us);
+
+// Print the ring, oldest first, as hex records on the serial console.
+void trace_dump(void);
@@ -0,0 +1,225 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Write-back caching with a background flusher.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include "writeback.h"
+#include "cache.h"
+#include "ipc.h"
+#include "tasks.h"
+#include "Arduino.h"
+
+#if ARDUINO_USB_CDC_ON_BOOT
+#define HWSerial Serial0
+#else
+#define HWSerial Serial
+#endif
+
+// Flush anything dirty for longer than this.
+#define WB_FLUSH_AGE_MS 2000
+// How often the flusher looks for work when not woken.
+#define WB_POLL_MS 100
+// Most dirty sectors gathered in one pass.
+#define WB_BATCH 1024
+// Largest single remote write, though ipc_xfer_size() usually sets a smaller
+// one, and the widest gap of clean cached sectors written again to join two
+// dirty runs.
+#define WB_MAX_EXTENT IPC_MAX_XFER
+#define WB_GAP_SECTORS 16
+
+static uint16_t _block_size = 0;
+static uint8_t _luns = 0;
+static uint32_t wb_max_dirty = 0;
+static volatile bool wb_flush_all = false, wb_failed = false;
+static SemaphoreHandle_t wb_wake, wb_done;
+static uint8_t *staging;
+
+static int _cmp_block(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Write out a sorted list of dirty sectors as a few large extents.  A run
+// of dirty sectors is carried across gaps of up to WB_GAP_SECTORS that are
+// in the cache, since sending those again costs less than a round trip.
+// Those are held in the cache until written, so none can be evicted and
+// written through afresh before the older copy here reaches the remote
+// host.  Sectors the remote host failed to write stay dirty, to be tried
+// again later, and false is returned.
+static bool flush_blocks(uint8_t lun, uint32_t *list, uint32_t n)
+{
+  uint32_t max = ipc_xfer_size(lun) / _block_size;
+  uint32_t i = 0;
+  bool ok = true;
+  while (i < n)
+  {
+    uint32_t lba = list[i], count = 0, j = i;
+    while (j < n && list[j] - lba < max)
+    {
+      if (list[j] - lba > count)
+      {
+        uint32_t c = count;
+        if (list[j] - lba - c > WB_GAP_SECTORS) break;
+        while (lba + c < list[j] &&
+          hold_cache_block(lun, lba + c, staging + c * _block_size)) c++;
+        if (lba + c < list[j])
+        {
+          while (c > count) flushed_cache_block(lun, lba + --c, true);
+          break;
+        }
+        count = c;
+      }
+      if (!clean_cache_block(lun, list[j], staging + count * _block_size))
+        break;
+      count++;
+      j++;
+    }
+    if (!count)
+    {
+      i++;
+      continue;
+    }
+
+    //HWSerial.printf("%%WB-FLUSH lun=%u lba=%u count=%u dirty=%u\r\n", lun,
+    //  lba, count, j - i);
+    struct ipc_msg *msg = ipc_alloc(lun, portMAX_DELAY);
+    msg->host_cmd = USB_WRITE;
+    msg->secsz = _block_size;
+    msg->lba = lba;
+    msg->dlen = count * _block_size;
+    msg->data = staging;
+    msg->copied += msg->dlen;
+    ipc_submit(msg);
+    ipc_wait(msg);
+    if (msg->status)
+    {
+      HWSerial.printf("%%WB-FLUSH failed lun=%u lba=%u count=%u\r\n", lun,
+        lba, count);
+      ok = false;
+    }
+    for (uint32_t c = 0; c < count; c++)
+      flushed_cache_block(lun, lba + c, !msg->status);
+    i = j;
+    ipc_free(msg);
+  }
+  return ok;
+}
+
+static void flushTask(void *pvParameter)
+{
+  uint32_t *list = (uint32_t*)malloc(WB_BATCH * sizeof *list);
+  while (1)
+  {
+    xSemaphoreTake(wb_wake, WB_POLL_MS / portTICK_PERIOD_MS);
+    bool failed = false;
+
+    for (uint8_t lun = 0; lun < _luns; lun++)
+    {
+      uint32_t oldest, n = get_dirty_cache_blocks(lun, list, WB_BATCH,
+        &oldest);
+      if (n && (wb_flush_all || dirty_cache_blocks() >= wb_max_dirty / 2 ||
+        millis() - oldest >= WB_FLUSH_AGE_MS))
+      {
+        //HWSerial.printf("%%WB-FLUSH lun=%u blocks=%u\r\n", lun, n);
+        qsort(list, n, sizeof *list, _cmp_block);
+        if (!flush_blocks(lun, list, n)) failed = true;
+      }
+    }
+    // A flush of everything that cannot finish ends, rather than hold up
+    // an eject for ever.
+    if (failed) wb_failed = true;
+    if (!dirty_cache_blocks() || failed) wb_flush_all = false;
+    xSemaphoreGive(wb_done);
+  }
+}
+
+void init_writeback(uint16_t block_size, uint32_t max_dirty, uint8_t luns)
+{
+  _block_size = block_size;
+  _luns = luns;
+  wb_max_dirty = max_dirty;
+  if (!wb_max_dirty) return;
+
+  staging = (uint8_t*)malloc(WB_MAX_EXTENT);
+  if (!staging)
+  {
+    wb_max_dirty = 0;
+    return;
+  }
+  wb_wake = xSemaphoreCreateBinary();
+  wb_done = xSemaphoreCreateBinary();
+  xTaskCreatePinnedToCore(flushTask, "flush", 4096, NULL, TASK_FLUSH_PRIORITY,
+    NULL, TASK_USB_CORE);
+}
+
+bool writeback_enabled(void)
+{
+  return wb_max_dirty != 0;
+}
+
+// Write count sectors from data straight to the remote host, lending it
+// the buffer.
+static int write_through(uint8_t lun, uint32_t lba, uint8_t *data,
+  uint32_t count)
+{
+  int rc = 0;
+  for (uint32_t done = 0, n; done < count; done += n)
+  {
+    n = ipc_xfer_size(lun) / _block_size;
+    if (n > count - done) n = count - done;
+    struct ipc_msg *msg = ipc_alloc(lun, portMAX_DELAY);
+    msg->host_cmd = USB_WRITE;
+    msg->secsz = _block_size;
+    msg->lba = lba + done;
+    msg->dlen = n * _block_size;
+    msg->data = data + done * _block_size;
+    ipc_submit(msg);
+    ipc_wait(msg);
+    if (msg->status) rc = -1;
+    ipc_free(msg);
+  }
+  return rc;
+}
+
+int wb_write(uint8_t lun, uint32_t lba, uint8_t* buffer, uint32_t bufsize)
+{
+  // A run of sectors the cache had no room for, such as when the rest of it
+  // is pinned.  None of them has an older copy in the cache.
+  uint32_t sectors = bufsize / _block_size, through = 0;
+  int rc = 0;
+  for (uint32_t l = 0; l < sectors; l++)
+  {
+    while (dirty_cache_blocks() >= wb_max_dirty)
+    {
+      xSemaphoreGive(wb_wake);
+      xSemaphoreTake(wb_done, WB_POLL_MS / portTICK_PERIOD_MS);
+    }
+    if (!put_dirty_cache_block(lun, lba + l, buffer + l * _block_size))
+      through++;
+    else if (through)
+    {
+      if (write_through(lun, lba + l - through,
+        buffer + (l - through) * _block_size, through)) rc = -1;
+      through = 0;
+    }
+  }
+  if (through && write_through(lun, lba + sectors - through,
+    buffer + (sectors - through) * _block_size, through)) rc = -1;
+  return rc;
+}
+
+void wb_flush(void)
+{
+  if (!wb_max_dirty) return;
+
+  wb_failed = false;
+  wb_flush_all = true;
+  while (dirty_cache_blocks() && !wb_failed)
+  {
+    xSemaphoreGive(wb_wake);
+    xSemaphoreTake(wb_done, WB_POLL_MS / portTICK_PERIOD_MS);
+  }
+}
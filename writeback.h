@@ -0,0 +1,22 @@
+// Ewan Parker, created 17th October 2026.
+// USB Mass Storage, backed by sparse file on remote SSH host.
+// Write-back caching with a background flusher.
+//
+// Copyright (C) 2026 Ewan Parker.
+// https://www.ewan.cc
+
+#include <stdint.h>
+
+// Enable write-back with at most max_dirty sectors, over all luns LUNs, not
+// yet written to the remote hosts.  Zero leaves writes synchronous.
+void init_writeback(uint16_t block_size, uint32_t max_dirty, uint8_t luns);
+bool writeback_enabled(void);
+
+// Write sectors of a LUN to the cache, waiting only if the dirty limit is
+// reached.  Any the cache has no room for are written straight to the
+// remote host instead.  Returns -1 if the remote host failed any of those.
+int wb_write(uint8_t lun, uint32_t lba, uint8_t* buffer, uint32_t bufsize);
+
+// Write every dirty sector of every LUN to the remote hosts and wait until
+// it is done.
+void wb_flush(void);